@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <array>
 
 namespace metric {
 
@@ -22,6 +23,18 @@ struct VolumeResult {
     std::string error_message;
 };
 
+// 骨架体积计算结果（按圆台段解析求和，无需网格）
+struct SkeletonVolumeResult {
+    bool success = false;
+    int num_segments = 0;            // 骨架段数
+    double volume = 0.0;             // 体积（立方米）
+    double surface_area = 0.0;       // 侧表面积（平方米）
+    double base_height = 0.0;        // 高度分级起点（骨架最低点z）
+    double class_height = 1.0;       // 高度分级间隔（米）
+    std::vector<double> volume_by_height;  // 第i级为 [base + i*h, base + (i+1)*h) 内的体积
+    std::string error_message;
+};
+
 class TreeVolume {
 public:
     // 从OBJ文件计算体积
@@ -52,6 +65,21 @@ public:
     static VolumeStatistics calculateStatistics(
         const std::vector<VolumeResult>& results
     );
+    
+    // 从AdTree导出的骨架文件（带radius属性的PLY或二进制.skel）计算体积、表面积和分高度级体积
+    static SkeletonVolumeResult calculateFromSkeleton(
+        const std::string& ply_file,
+        double class_height = 1.0,
+        bool verbose = false
+    );
+    
+    // 从骨架顶点、半径和边计算：每条边是半径线性变化的圆台，复杂度O(边数)
+    static SkeletonVolumeResult calculateFromSegments(
+        const std::vector<std::array<double, 3>>& vertices,
+        const std::vector<double>& radii,
+        const std::vector<std::array<int, 2>>& edges,
+        double class_height = 1.0
+    );
 };
 
 } // namespace metric
@@ -12,6 +12,16 @@
 #include <filesystem>
 #include <algorithm>
 #include <limits>
+#include <cmath>
+#include <cstdint>
+
+#ifdef HAS_HAPPLY
+#include "happly.h"
+#endif
+
+#ifdef HAS_SKELETON_FILE
+#include "skeleton_file.h"
+#endif
 
 namespace metric {
 
@@ -222,4 +232,240 @@ TreeVolume::VolumeStatistics TreeVolume::calculateStatistics(
     return stats;
 }
 
+// 半径从r0线性变化到r1、长度为len的圆台体积
+static double frustumVolume(double len, double r0, double r1) {
+    const double kPi = 3.14159265358979323846;
+    return kPi * len / 3.0 * (r0 * r0 + r0 * r1 + r1 * r1);
+}
+
+namespace {
+
+// 逐条边累加圆台体积；顶点和半径通过访问函数读取，PLY数组与.skel映射共用（后者不拷贝）
+template <typename PositionFn, typename RadiusFn, typename ForEachEdgeFn>
+SkeletonVolumeResult segmentVolume(
+    std::size_t num_vertices,
+    std::size_t num_edges,
+    PositionFn position,
+    RadiusFn radius,
+    ForEachEdgeFn forEachEdge,
+    double class_height) {
+    
+    const double kPi = 3.14159265358979323846;
+    SkeletonVolumeResult result;
+    result.class_height = class_height;
+    
+    if (num_vertices == 0 || num_edges == 0) {
+        result.error_message = "骨架为空";
+        return result;
+    }
+    
+    // 高度分级从骨架最低点开始
+    result.base_height = std::numeric_limits<double>::max();
+    double top_height = std::numeric_limits<double>::lowest();
+    for (std::size_t i = 0; i < num_vertices; ++i) {
+        const double z = position(i)[2];
+        result.base_height = std::min(result.base_height, z);
+        top_height = std::max(top_height, z);
+    }
+    if (class_height > 0) {
+        const std::size_t num_classes = static_cast<std::size_t>((top_height - result.base_height) / class_height) + 1;
+        result.volume_by_height.assign(num_classes, 0.0);
+    }
+    
+    forEachEdge([&](int a, int b) {
+        if (a < 0 || b < 0 ||
+            a >= static_cast<int>(num_vertices) || b >= static_cast<int>(num_vertices)) {
+            return;
+        }
+        const std::array<double, 3> p0 = position(a);
+        const std::array<double, 3> p1 = position(b);
+        const double r0 = radius(a);
+        const double r1 = radius(b);
+        const double len = std::sqrt((p1[0] - p0[0]) * (p1[0] - p0[0]) +
+                                     (p1[1] - p0[1]) * (p1[1] - p0[1]) +
+                                     (p1[2] - p0[2]) * (p1[2] - p0[2]));
+        
+        ++result.num_segments;
+        result.volume += frustumVolume(len, r0, r1);
+        result.surface_area += kPi * (r0 + r1) * std::sqrt(len * len + (r0 - r1) * (r0 - r1));
+        
+        if (result.volume_by_height.empty()) {
+            return;
+        }
+        
+        // 按高度级切分圆台：半径随参数t线性变化，每一部分仍是圆台
+        const double z0 = p0[2] - result.base_height;
+        const double z1 = p1[2] - result.base_height;
+        const std::size_t last = result.volume_by_height.size() - 1;
+        const std::size_t k0 = std::min(static_cast<std::size_t>(std::min(z0, z1) / class_height), last);
+        const std::size_t k1 = std::min(static_cast<std::size_t>(std::max(z0, z1) / class_height), last);
+        if (k0 == k1 || z0 == z1) {
+            result.volume_by_height[k0] += frustumVolume(len, r0, r1);
+            return;
+        }
+        for (std::size_t k = k0; k <= k1; ++k) {
+            // 该段落在第k级内的高度范围（最高一级向上不封顶）
+            const double lo = std::max(std::min(z0, z1), k * class_height);
+            const double hi = (k == last) ? std::max(z0, z1) : std::min(std::max(z0, z1), (k + 1) * class_height);
+            const double ta = std::clamp((lo - z0) / (z1 - z0), 0.0, 1.0);
+            const double tb = std::clamp((hi - z0) / (z1 - z0), 0.0, 1.0);
+            const double t_lo = std::min(ta, tb);
+            const double t_hi = std::max(ta, tb);
+            result.volume_by_height[k] += frustumVolume(len * (t_hi - t_lo),
+                                                        r0 + (r1 - r0) * t_lo,
+                                                        r0 + (r1 - r0) * t_hi);
+        }
+    });
+    
+    result.success = result.num_segments > 0;
+    if (!result.success) {
+        result.error_message = "骨架中没有有效的边";
+    }
+    return result;
+}
+
+} // namespace
+
+// 从骨架顶点、半径和边计算体积
+SkeletonVolumeResult TreeVolume::calculateFromSegments(
+    const std::vector<std::array<double, 3>>& vertices,
+    const std::vector<double>& radii,
+    const std::vector<std::array<int, 2>>& edges,
+    double class_height) {
+    
+    if (!vertices.empty() && radii.size() != vertices.size()) {
+        SkeletonVolumeResult result;
+        result.class_height = class_height;
+        result.error_message = "半径数量与顶点数量不一致";
+        return result;
+    }
+    return segmentVolume(
+        vertices.size(), edges.size(),
+        [&](std::size_t i) { return vertices[i]; },
+        [&](std::size_t i) { return radii[i]; },
+        [&](auto&& visit) {
+            for (const auto& e : edges) {
+                visit(e[0], e[1]);
+            }
+        },
+        class_height);
+}
+
+#if defined(HAS_HAPPLY) || defined(HAS_SKELETON_FILE)
+// 输出骨架体积计算结果
+static void printSkeletonVolume(const SkeletonVolumeResult& result, double class_height) {
+    std::cout << "  骨架段数: " << result.num_segments << std::endl;
+    std::cout << "  体积: " << result.volume << " 立方米" << std::endl;
+    std::cout << "  表面积: " << result.surface_area << " 平方米" << std::endl;
+    for (size_t k = 0; k < result.volume_by_height.size(); ++k) {
+        std::cout << "  高度 " << k * class_height << "-" << (k + 1) * class_height
+                  << " 米: " << result.volume_by_height[k] << " 立方米" << std::endl;
+    }
+}
+#endif
+
+// 从骨架文件（PLY或二进制.skel）计算体积
+SkeletonVolumeResult TreeVolume::calculateFromSkeleton(
+    const std::string& ply_file,
+    double class_height,
+    bool verbose) {
+    
+    SkeletonVolumeResult result;
+    result.class_height = class_height;
+    
+    if (fs::path(ply_file).extension() == ".skel") {
+#ifdef HAS_SKELETON_FILE
+        if (verbose) {
+            std::cout << "读取二进制骨架文件: " << fs::path(ply_file).filename().string() << std::endl;
+        }
+        
+        // 直接在映射的数组上计算：每个有父节点的顶点对应一条边
+        preprocessing::SkeletonFile file;
+        if (!file.open(ply_file)) {
+            result.error_message = "无法读取二进制骨架文件: " + file.error();
+            return result;
+        }
+        const double* t = file.translation();
+        const std::int32_t* parent = file.parent();
+        const std::size_t n = file.size();
+        std::size_t num_edges = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            num_edges += parent[i] >= 0 ? 1 : 0;
+        }
+        
+        result = segmentVolume(
+            n, num_edges,
+            [&](std::size_t i) {
+                return std::array<double, 3>{file.x()[i] + t[0], file.y()[i] + t[1], file.z()[i] + t[2]};
+            },
+            [&](std::size_t i) { return static_cast<double>(file.radius()[i]); },
+            [&](auto&& visit) {
+                for (std::size_t i = 0; i < n; ++i) {
+                    if (parent[i] >= 0) {
+                        visit(parent[i], static_cast<int>(i));
+                    }
+                }
+            },
+            class_height);
+        
+        if (verbose && result.success) {
+            printSkeletonVolume(result, class_height);
+        }
+#else
+        (void)verbose;
+        result.error_message = "二进制骨架支持未编译（需要skeleton_file.h）";
+#endif
+        return result;
+    }
+    
+#ifdef HAS_HAPPLY
+    if (verbose) {
+        std::cout << "读取PLY骨架文件: " << fs::path(ply_file).filename().string() << std::endl;
+    }
+    
+    std::vector<std::array<double, 3>> vertices;
+    std::vector<double> radii;
+    std::vector<std::array<int, 2>> edges;
+    
+    try {
+        happly::PLYData plyIn(ply_file);
+        
+        std::vector<float> x = plyIn.getElement("vertex").getProperty<float>("x");
+        std::vector<float> y = plyIn.getElement("vertex").getProperty<float>("y");
+        std::vector<float> z = plyIn.getElement("vertex").getProperty<float>("z");
+        std::vector<float> r = plyIn.getElement("vertex").getProperty<float>("radius");
+        std::vector<std::vector<int>> edgeIndices =
+            plyIn.getElement("edge").getListProperty<int>("vertex_indices");
+        
+        vertices.reserve(x.size());
+        radii.reserve(x.size());
+        for (size_t i = 0; i < x.size(); ++i) {
+            vertices.push_back({x[i], y[i], z[i]});
+            radii.push_back(r[i]);
+        }
+        edges.reserve(edgeIndices.size());
+        for (const auto& edge : edgeIndices) {
+            if (edge.size() == 2) {
+                edges.push_back({edge[0], edge[1]});
+            }
+        }
+    } catch (const std::exception& e) {
+        result.error_message = std::string("无法读取骨架PLY文件: ") + e.what();
+        return result;
+    }
+    
+    result = calculateFromSegments(vertices, radii, edges, class_height);
+    
+    if (verbose && result.success) {
+        printSkeletonVolume(result, class_height);
+    }
+#else
+    (void)ply_file;
+    (void)verbose;
+    result.error_message = "PLY支持未编译（需要happly.h）";
+#endif
+    
+    return result;
+}
+
 } // namespace metric
\ No newline at end of file
@@ -0,0 +1,181 @@
+#ifndef PREPROCESSING_SKELETON_FILE_H
+#define PREPROCESSING_SKELETON_FILE_H
+
+// AdTree二进制骨架文件（.skel）的格式定义与只读内存映射
+//
+// 文件为小端序，各数组按8字节对齐，映射后可直接作为数组使用（零拷贝）：
+//   头部（48字节）: char[8] "ADTSKEL\0" | uint32 版本 | uint32 顶点数n | double[3] 平移量 | uint64 保留
+//   float  x[n], y[n], z[n]  顶点坐标（SoA，加上平移量即为原始坐标）
+//   float  radius[n]         顶点半径
+//   int32  parent[n]         父顶点索引，枝条起点为-1
+//   uint8  order[n]          枝条级数，主干为0
+//   uint8  flags[n]          SKEL_TIP: 枝条末端；SKEL_BRANCH_START: 枝条起点
+// 写入端见 AdTree/main.cpp 中的 save_skeleton_binary()
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace preprocessing {
+
+constexpr char kSkeletonMagic[8] = {'A', 'D', 'T', 'S', 'K', 'E', 'L', '\0'};
+constexpr std::uint32_t kSkeletonVersion = 1;
+constexpr std::size_t kSkeletonHeaderSize = 48;
+
+// 顶点标志位
+constexpr std::uint8_t SKEL_TIP = 1;
+constexpr std::uint8_t SKEL_BRANCH_START = 2;
+
+// 按8字节对齐后的数组字节数
+inline std::size_t skeletonSectionSize(std::size_t bytes) {
+    return (bytes + 7) / 8 * 8;
+}
+
+// 骨架文件的只读映射，数组指针在对象存活期间有效
+class SkeletonFile {
+public:
+    SkeletonFile() = default;
+    ~SkeletonFile() { close(); }
+    SkeletonFile(const SkeletonFile&) = delete;
+    SkeletonFile& operator=(const SkeletonFile&) = delete;
+
+    // 映射文件并校验头部，失败时error()给出原因
+    bool open(const std::string& filename) {
+        close();
+        if (!map(filename)) {
+            return false;
+        }
+        const char* base = static_cast<const char*>(data_);
+        if (size_ < kSkeletonHeaderSize || std::memcmp(base, kSkeletonMagic, sizeof(kSkeletonMagic)) != 0) {
+            return fail("不是AdTree二进制骨架文件");
+        }
+        std::uint32_t version = 0;
+        std::memcpy(&version, base + 8, sizeof(version));
+        if (version != kSkeletonVersion) {
+            return fail("不支持的骨架文件版本: " + std::to_string(version));
+        }
+        std::uint32_t n = 0;
+        std::memcpy(&n, base + 12, sizeof(n));
+        std::memcpy(translation_, base + 16, sizeof(translation_));
+
+        const std::size_t floats = skeletonSectionSize(n * sizeof(float));
+        const std::size_t bytes = skeletonSectionSize(n);
+        if (size_ < kSkeletonHeaderSize + 5 * floats + 2 * bytes) {
+            return fail("骨架文件不完整");
+        }
+        const char* p = base + kSkeletonHeaderSize;
+        x_ = reinterpret_cast<const float*>(p);           p += floats;
+        y_ = reinterpret_cast<const float*>(p);           p += floats;
+        z_ = reinterpret_cast<const float*>(p);           p += floats;
+        radius_ = reinterpret_cast<const float*>(p);      p += floats;
+        parent_ = reinterpret_cast<const std::int32_t*>(p); p += floats;
+        order_ = reinterpret_cast<const std::uint8_t*>(p);  p += bytes;
+        flags_ = reinterpret_cast<const std::uint8_t*>(p);
+        num_vertices_ = n;
+        return true;
+    }
+
+    void close() {
+        if (data_) {
+#ifdef _WIN32
+            UnmapViewOfFile(data_);
+#else
+            munmap(data_, size_);
+#endif
+        }
+        data_ = nullptr;
+        size_ = 0;
+        num_vertices_ = 0;
+    }
+
+    std::size_t size() const { return num_vertices_; }
+    const double* translation() const { return translation_; }
+    const float* x() const { return x_; }
+    const float* y() const { return y_; }
+    const float* z() const { return z_; }
+    const float* radius() const { return radius_; }
+    const std::int32_t* parent() const { return parent_; }
+    const std::uint8_t* order() const { return order_; }
+    const std::uint8_t* flags() const { return flags_; }
+    const std::string& error() const { return error_; }
+
+private:
+    bool fail(const std::string& message) {
+        close();
+        error_ = message;
+        return false;
+    }
+
+    bool map(const std::string& filename) {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return fail("无法打开骨架文件: " + filename);
+        }
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+            CloseHandle(file);
+            return fail("骨架文件为空: " + filename);
+        }
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+        if (!mapping) {
+            return fail("无法映射骨架文件: " + filename);
+        }
+        data_ = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (!data_) {
+            return fail("无法映射骨架文件: " + filename);
+        }
+        size_ = static_cast<std::size_t>(file_size.QuadPart);
+#else
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return fail("无法打开骨架文件: " + filename);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return fail("骨架文件为空: " + filename);
+        }
+        void* data = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            return fail("无法映射骨架文件: " + filename);
+        }
+        data_ = data;
+        size_ = static_cast<std::size_t>(st.st_size);
+#endif
+        return true;
+    }
+
+    void* data_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t num_vertices_ = 0;
+    double translation_[3] = {0.0, 0.0, 0.0};
+    const float* x_ = nullptr;
+    const float* y_ = nullptr;
+    const float* z_ = nullptr;
+    const float* radius_ = nullptr;
+    const std::int32_t* parent_ = nullptr;
+    const std::uint8_t* order_ = nullptr;
+    const std::uint8_t* flags_ = nullptr;
+    std::string error_;
+};
+
+} // namespace preprocessing
+
+#endif // PREPROCESSING_SKELETON_FILE_H
@@ -69,7 +69,7 @@ struct SkeletonFilterResult {
 // 结构提取器类 - 简化版，只负责筛选叶节点
 class StructureExtractor {
 public:
-    // 处理单个PLY文件，输出筛选后的叶节点
+    // 处理单个骨架文件（PLY或二进制.skel），输出筛选后的叶节点
     static SkeletonFilterResult filterLeafNodes(
         const std::string& input_ply_path,
         const std::string& output_dir = "",
@@ -77,7 +77,7 @@ public:
         bool verbose = false
     );
     
-    // 批量处理目录中的所有PLY文件
+    // 批量处理目录中的所有骨架文件
     static std::vector<SkeletonFilterResult> processDirectory(
         const std::string& input_dir,
         const std::string& output_dir = "",
@@ -93,6 +93,14 @@ private:
         bool verbose = false
     );
     
+    // 从二进制骨架文件（.skel，内存映射）直接提取叶节点并计算骨架高度
+    static bool readLeafNodesFromSkeletonFile(
+        const std::string& filename,
+        LeafNodes& leafNodes,
+        double& skeletonHeight,
+        bool verbose = false
+    );
+    
     // 提取叶节点（度为1的节点）
     static LeafNodes extractLeafNodes(const TreeSkeleton& skeleton);
     
@@ -1,5 +1,6 @@
 #include "preprocessing/structure_extract.h"
 #include "preprocessing/happly.h"
+#include "preprocessing/skeleton_file.h"
 #include <iostream>
 #include <fstream>
 #include <algorithm>
@@ -26,8 +27,10 @@ SkeletonFilterResult StructureExtractor::filterLeafNodes(
         return result;
     }
     
-    if (input_path.extension() != ".ply") {
-        result.error_message = "Input file is not a PLY file: " + input_ply_path;
+    // 二进制骨架（.skel）直接映射读取，PLY作为兼容格式
+    const bool binary = input_path.extension() == ".skel";
+    if (input_path.extension() != ".ply" && !binary) {
+        result.error_message = "Input file is not a PLY or SKEL file: " + input_ply_path;
         return result;
     }
     
@@ -49,18 +52,23 @@ SkeletonFilterResult StructureExtractor::filterLeafNodes(
     }
     
     try {
-        // 1. 读取骨架数据
-        TreeSkeleton skeleton;
-        if (!readSkeletonFromPLY(input_ply_path, skeleton, verbose)) {
-            result.error_message = "Failed to read PLY file";
-            return result;
+        // 1-3. 读取骨架、计算骨架总高度（用于筛选算法）并提取所有叶节点
+        double skeleton_height = 0.0;
+        LeafNodes allLeafNodes;
+        if (binary) {
+            if (!readLeafNodesFromSkeletonFile(input_ply_path, allLeafNodes, skeleton_height, verbose)) {
+                result.error_message = "Failed to read skeleton file";
+                return result;
+            }
+        } else {
+            TreeSkeleton skeleton;
+            if (!readSkeletonFromPLY(input_ply_path, skeleton, verbose)) {
+                result.error_message = "Failed to read PLY file";
+                return result;
+            }
+            skeleton_height = calculateSkeletonHeight(skeleton);
+            allLeafNodes = extractLeafNodes(skeleton);
         }
-        
-        // 2. 计算骨架总高度（用于筛选算法）
-        double skeleton_height = calculateSkeletonHeight(skeleton);
-        
-        // 3. 提取所有叶节点
-        LeafNodes allLeafNodes = extractLeafNodes(skeleton);
         result.total_leaves = allLeafNodes.size();
         
         if (verbose) {
@@ -120,17 +128,23 @@ std::vector<SkeletonFilterResult> StructureExtractor::processDirectory(
         return results;
     }
     
-    // 收集所有PLY文件
+    // 收集所有骨架文件（同名的.skel和.ply只处理.skel）
     std::vector<fs::path> ply_files;
     for (const auto& entry : fs::directory_iterator(input_dir)) {
-        if (entry.is_regular_file() && entry.path().extension() == ".ply") {
-            ply_files.push_back(entry.path());
+        if (!entry.is_regular_file()) {
+            continue;
+        }
+        const fs::path& path = entry.path();
+        if (path.extension() == ".skel") {
+            ply_files.push_back(path);
+        } else if (path.extension() == ".ply" && !fs::exists(fs::path(path).replace_extension(".skel"))) {
+            ply_files.push_back(path);
         }
     }
     
     if (ply_files.empty()) {
         if (verbose) {
-            std::cout << "No PLY files found in: " << input_dir << std::endl;
+            std::cout << "No skeleton files found in: " << input_dir << std::endl;
         }
         return results;
     }
@@ -139,7 +153,7 @@ std::vector<SkeletonFilterResult> StructureExtractor::processDirectory(
     std::sort(ply_files.begin(), ply_files.end());
     
     if (verbose) {
-        std::cout << "Found " << ply_files.size() << " PLY files" << std::endl;
+        std::cout << "Found " << ply_files.size() << " skeleton files" << std::endl;
     }
     
     // 处理每个文件
@@ -220,6 +234,54 @@ bool StructureExtractor::readSkeletonFromPLY(
     }
 }
 
+bool StructureExtractor::readLeafNodesFromSkeletonFile(
+    const std::string& filename,
+    LeafNodes& leafNodes,
+    double& skeletonHeight,
+    bool verbose) {
+    
+    if (verbose) {
+        std::cout << "  Reading skeleton file: " << filename << std::endl;
+    }
+    
+    SkeletonFile file;
+    if (!file.open(filename)) {
+        if (verbose) {
+            std::cerr << "  Error reading skeleton file: " << file.error() << std::endl;
+        }
+        return false;
+    }
+    
+    // 坐标加上平移量还原为原始坐标（与PLY一致）
+    const double* t = file.translation();
+    leafNodes.clear();
+    skeletonHeight = 0.0;
+    if (file.size() == 0) {
+        return true;
+    }
+    
+    double minZ = file.z()[0] + t[2];
+    double maxZ = minZ;
+    for (size_t i = 0; i < file.size(); ++i) {
+        const double z = file.z()[i] + t[2];
+        minZ = std::min(minZ, z);
+        maxZ = std::max(maxZ, z);
+        
+        // 枝条的两端（末端和起点）即度为1的节点
+        if (file.flags()[i] & (SKEL_TIP | SKEL_BRANCH_START)) {
+            LeafNode node;
+            node.original_index = static_cast<int>(i);
+            node.position = Point_3(file.x()[i] + t[0], file.y()[i] + t[1], z);
+            node.height = z;
+            node.radius = file.radius()[i];
+            leafNodes.nodes.push_back(node);
+        }
+    }
+    skeletonHeight = maxZ - minZ;
+    
+    return true;
+}
+
 LeafNodes StructureExtractor::extractLeafNodes(const TreeSkeleton& skeleton) {
     LeafNodes leafNodes;
     
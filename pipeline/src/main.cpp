@@ -19,6 +19,10 @@
 #include <thread>
 #include <algorithm>
 
+#ifdef HAS_RECONSTRUCTION_PARAMS
+#include "reconstruction_params.h"   // AdTree的重建参数预设（仅头文件）
+#endif
+
 namespace fs = std::filesystem;
 
 // 树木指标结构
@@ -36,10 +40,16 @@ struct TreeMetrics {
     double volume = 0.0;            // 体积/材积
     double surface_area = 0.0;      // 表面积
     bool mesh_is_closed = false;    // 网格是否封闭
+    double skeleton_volume = 0.0;   // 骨架解析体积
+    double skeleton_surface_area = 0.0; // 骨架解析表面积
+    double volume_class_height = 0.0;   // 高度分级间隔
+    std::vector<double> volume_by_height; // 分高度级骨架体积
     int leaf_nodes_total = 0;       // 总叶节点数
     int leaf_nodes_filtered = 0;    // 筛选后叶节点数
     bool has_skeleton_data = false; // 是否有骨架数据
     std::string dbh_method;         // DBH计算方法
+    std::string reconstruction_preset; // AdTree重建预设
+    bool fit_branches = false;      // AdTree是否对一级枝干拟合圆柱（--fit-branches，预设之外）
     
     // 处理时间戳
     std::string processing_time;
@@ -84,13 +94,23 @@ struct Config {
     std::string report_dir;         // 报告输出目录 (data/output/report)
     std::string adtree_exe;
     bool fill_holes = true;
+    bool cap_branches = false;      // AdTree输出带端盖的封闭网格（无需填洞）
+    bool fit_branches = false;      // AdTree对一级枝干也拟合圆柱（accurate预设默认开启）
+    double voxel_size = 0.0;        // AdTree先在体素降采样点云上提取骨架（米，0表示使用全部点）
+    int tet_slab_size = 0;          // AdTree按高度分块三角化的每块点数（0表示不分块，至少1000）
+    bool skeleton_ply = false;      // 除二进制骨架(.skel)外再输出PLY骨架（供外部工具查看）
+    std::string preset = "balanced"; // AdTree重建预设：fast（预览）、balanced、accurate（最终成果）
+    std::string engine = "delaunay"; // AdTree骨架提取方法：delaunay（默认）或voxel（体素图测地距离，更快）
     int max_hole_size = -1;
     bool use_default_paths = false;
     bool process_skeleton = true;   // 是否处理骨架
     double filter_ratio = 0.15;     // 叶节点筛选比例
     bool verbose = false;            // 详细输出
     bool calculate_volume = true;   // 是否计算体积
+    bool mesh_volume = true;        // 是否从网格计算体积（CGAL）
+    double volume_class_height = 1.0; // 骨架体积的高度分级间隔（米）
     bool calculate_crown = true;    // 是否计算冠幅
+    bool metrics_only = false;      // 只重建骨架（不生成枝干网格，跳过填洞和基于网格的指标）
 };
 
 // 获取当前时间字符串
@@ -144,8 +164,34 @@ bool generate_single_json_report(const TreeMetrics& metrics, const std::string&
     json_file << "      \"value_m3\": " << std::fixed << std::setprecision(3) << metrics.volume << ",\n";
     json_file << "      \"surface_area_m2\": " << std::fixed << std::setprecision(3) << metrics.surface_area << ",\n";
     json_file << "      \"mesh_closed\": " << (metrics.mesh_is_closed ? "true" : "false") << "\n";
+    json_file << "    },\n";
+    json_file << "    \"skeleton_volume\": {\n";
+    json_file << "      \"value_m3\": " << std::fixed << std::setprecision(3) << metrics.skeleton_volume << ",\n";
+    json_file << "      \"surface_area_m2\": " << std::fixed << std::setprecision(3) << metrics.skeleton_surface_area << ",\n";
+    json_file << "      \"class_height_m\": " << std::fixed << std::setprecision(3) << metrics.volume_class_height << ",\n";
+    json_file << "      \"by_height_m3\": [";
+    for (size_t k = 0; k < metrics.volume_by_height.size(); ++k) {
+        json_file << (k > 0 ? ", " : "") << std::fixed << std::setprecision(4) << metrics.volume_by_height[k];
+    }
+    json_file << "]\n";
     json_file << "    }\n";
     json_file << "  },\n";
+    json_file << "  \"reconstruction\": {\n";
+    json_file << "    \"preset\": \"" << metrics.reconstruction_preset << "\"";
+#ifdef HAS_RECONSTRUCTION_PARAMS
+    ReconstructionParams params;
+    if (ReconstructionParams::from_preset(metrics.reconstruction_preset, params)) {
+        json_file << ",\n";
+        json_file << "    \"subtree_threshold\": " << std::defaultfloat << params.subtree_threshold << ",\n";
+        json_file << "    \"centralize_range\": " << params.centralize_range << ",\n";
+        json_file << "    \"line_query_factor\": " << params.line_query_factor << ",\n";
+        json_file << "    \"min_fitting_points\": " << params.min_fitting_points << ",\n";
+        json_file << "    \"smoothing_slices\": " << params.smoothing_slices << ",\n";
+        json_file << "    \"surface_slices\": " << params.surface_slices << ",\n";
+        json_file << "    \"fit_branches\": " << (params.fit_branches || metrics.fit_branches ? "true" : "false");
+    }
+#endif
+    json_file << "\n  },\n";
     json_file << "  \"skeleton_info\": {\n";
     json_file << "    \"has_data\": " << (metrics.has_skeleton_data ? "true" : "false") << ",\n";
     json_file << "    \"total_leaf_nodes\": " << metrics.leaf_nodes_total << ",\n";
@@ -169,8 +215,8 @@ bool generate_csv_report(const std::vector<TreeMetrics>& metrics_list, const std
     // CSV头
     csv_file << "Tree_ID,Processing_Time,Height,H0_Crown_Base,Crown_Depth,DBH_cm,DBH_Method,"
              << "Crown_Radius,Crown_Diameter,Max_Crown_Width,Min_Crown_Width,Aspect_Ratio,"
-             << "Volume_m3,Surface_Area_m2,Mesh_Closed,"
-             << "Has_Skeleton,Total_Leaf_Nodes,Filtered_Leaf_Nodes\n";
+             << "Volume_m3,Surface_Area_m2,Mesh_Closed,Skeleton_Volume_m3,Skeleton_Surface_Area_m2,"
+             << "Has_Skeleton,Total_Leaf_Nodes,Filtered_Leaf_Nodes,Preset\n";
     
     // 数据行
     for (const auto& m : metrics_list) {
@@ -189,9 +235,12 @@ bool generate_csv_report(const std::vector<TreeMetrics>& metrics_list, const std
                  << std::fixed << std::setprecision(3) << m.volume << ","
                  << std::fixed << std::setprecision(3) << m.surface_area << ","
                  << (m.mesh_is_closed ? "Yes" : "No") << ","
+                 << std::fixed << std::setprecision(3) << m.skeleton_volume << ","
+                 << std::fixed << std::setprecision(3) << m.skeleton_surface_area << ","
                  << (m.has_skeleton_data ? "Yes" : "No") << ","
                  << m.leaf_nodes_total << ","
-                 << m.leaf_nodes_filtered << "\n";
+                 << m.leaf_nodes_filtered << ","
+                 << m.reconstruction_preset << "\n";
     }
     
     csv_file.close();
@@ -207,6 +256,8 @@ TreeMetrics process_file(const std::string& xyz_file, const Config& config) {
     
     metrics.tree_id = base_name;
     metrics.processing_time = get_current_time();
+    metrics.reconstruction_preset = config.preset;
+    metrics.fit_branches = config.fit_branches;
     std::string filtered_nodes_path;
     std::cout << "\n处理: " << base_name << std::endl;
     std::cout << "----------------------------------------" << std::endl;
@@ -220,10 +271,45 @@ TreeMetrics process_file(const std::string& xyz_file, const Config& config) {
     std::string cmd = "\"" + config.adtree_exe + "\" \"" + 
                       xyz_file + "\" \"" + adtree_dir.string() + "\"";
     
-    if (config.process_skeleton) {
-        cmd += " -s";
+    // 只输出需要的模型：叶片从不使用，枝干网格在只计算指标时不需要
+    if (config.metrics_only) {
+        cmd += " -outputs skeleton";
+    } else if (config.process_skeleton) {
+        cmd += " -outputs skeleton,branches";
+    } else {
+        cmd += " -outputs branches";
+    }
+    
+    if (config.preset != "balanced") {
+        cmd += " -preset " + config.preset;
+    }
+    
+    if (config.engine != "delaunay") {
+        cmd += " -engine " + config.engine;
+    }
+    
+    if (config.cap_branches) {
+        cmd += " -cap";
+    }
+    
+    if (config.fit_branches) {
+        cmd += " -fit-branches";
+    }
+    
+    if (config.voxel_size > 0) {
+        cmd += " -voxel " + std::to_string(config.voxel_size);
+    }
+    
+    if (config.tet_slab_size > 0) {
+        cmd += " -tet-slab " + std::to_string(config.tet_slab_size);
     }
     
+    // 流水线不使用中间图（Delaunay、MST），让AdTree尽早释放以降低峰值内存
+    cmd += " -lowmem";
+    
+    // 骨架以二进制格式传递给后续步骤（内存映射读取，无需解析PLY）
+    cmd += config.skeleton_ply ? " -skeleton-format skel,ply" : " -skeleton-format skel";
+    
     if (config.verbose) {
         std::cout << "     命令: " << cmd << std::endl;
     }
@@ -236,30 +322,46 @@ TreeMetrics process_file(const std::string& xyz_file, const Config& config) {
     
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
     
-    fs::path skeleton_file = adtree_dir / (base_name + "_skeleton.ply");
+    // 优先使用二进制骨架，旧版本AdTree只输出PLY/OBJ
+    fs::path skeleton_ply = adtree_dir / (base_name + "_skeleton.ply");
+    fs::path skeleton_file = adtree_dir / (base_name + "_skeleton.skel");
+    if (!fs::exists(skeleton_file)) {
+        skeleton_file = skeleton_ply;
+    }
     if (!fs::exists(skeleton_file)) {
         fs::path skeleton_obj = adtree_dir / (base_name + "_skeleton.obj");
         if (fs::exists(skeleton_obj)) skeleton_file = skeleton_obj;
     }
     
-    if (!fs::exists(branches_file)) {
+    if (config.metrics_only) {
+        if (!fs::exists(skeleton_file)) {
+            std::cerr << "     错误: 未找到骨架文件: " << skeleton_file << std::endl;
+            return metrics;
+        }
+    } else if (!fs::exists(branches_file)) {
         std::cerr << "     错误: 未找到branches文件: " << branches_file << std::endl;
         return metrics;
     }
     
     std::cout << "     AdTree重建完成" << std::endl;
     
-    // 删除leaves文件（不需要保存）
+    // 删除leaves文件（不需要保存；旧版本AdTree会总是输出）
     if (fs::exists(leaves_file)) {
         fs::remove(leaves_file);
     }
     
     // 若存在骨架：复制到 data/temp（config.output_dir）
+    fs::path skeleton_copy;
     if (fs::exists(skeleton_file)) {
         fs::path dst = fs::path(config.output_dir) / skeleton_file.filename();
         try {
             fs::copy_file(skeleton_file, dst, fs::copy_options::overwrite_existing);
+            skeleton_copy = dst;
             std::cout << "     已复制骨架到: " << dst << std::endl;
+            if (config.skeleton_ply && skeleton_file != skeleton_ply && fs::exists(skeleton_ply)) {
+                fs::copy_file(skeleton_ply, fs::path(config.output_dir) / skeleton_ply.filename(),
+                              fs::copy_options::overwrite_existing);
+            }
         } catch (const std::exception& e) {
             std::cerr << "     警告: 复制骨架失败: " << e.what() << std::endl;
         }
@@ -268,7 +370,9 @@ TreeMetrics process_file(const std::string& xyz_file, const Config& config) {
     // 步骤2: 填洞处理
     fs::path final_output_file;
     
-    if (config.fill_holes) {
+    if (config.metrics_only) {
+        std::cout << "  2. 跳过填洞处理（只计算指标）" << std::endl;
+    } else if (config.fill_holes && !config.cap_branches) {
         std::cout << "  2. 进行网格填洞处理..." << std::endl;
         final_output_file = fs::path(config.output_dir) / (base_name + "_branches_filled.obj");
         
@@ -291,14 +395,14 @@ TreeMetrics process_file(const std::string& xyz_file, const Config& config) {
             std::cout << "     网格无需填洞" << std::endl;
         }
     } else {
-        // 不填洞，直接复制
-        std::cout << "  2. 跳过填洞处理" << std::endl;
+        // 不填洞（或AdTree已输出封闭网格），直接复制
+        std::cout << "  2. 跳过填洞处理" << (config.cap_branches ? "（枝干网格已封闭）" : "") << std::endl;
         final_output_file = fs::path(config.output_dir) / (base_name + "_branches.obj");
         fs::copy_file(branches_file, final_output_file, fs::copy_options::overwrite_existing);
     }
     
     // 步骤3: 处理骨架数据（如果存在）
-    if (config.process_skeleton && fs::exists(skeleton_file)) {
+    if ((config.process_skeleton || config.metrics_only) && fs::exists(skeleton_file)) {
         std::cout << "  3. 处理骨架数据..." << std::endl;
         
         auto skeleton_result = preprocessing::StructureExtractor::filterLeafNodes(
@@ -328,9 +432,11 @@ TreeMetrics process_file(const std::string& xyz_file, const Config& config) {
     // 清理 data/output/models 中的原始骨架
     if (config.use_default_paths && !config.adtree_output_dir.empty()) {
         try {
+            fs::path sk_skel = adtree_dir / (base_name + "_skeleton.skel");
             fs::path sk_ply = adtree_dir / (base_name + "_skeleton.ply");
             fs::path sk_obj = adtree_dir / (base_name + "_skeleton.obj");
             bool removed_any = false;
+            if (fs::exists(sk_skel)) { fs::remove(sk_skel); removed_any = true; }
             if (fs::exists(sk_ply)) { fs::remove(sk_ply); removed_any = true; }
             if (fs::exists(sk_obj)) { fs::remove(sk_obj); removed_any = true; }
             if (removed_any && config.verbose) {
@@ -436,7 +542,7 @@ TreeMetrics process_file(const std::string& xyz_file, const Config& config) {
     }
 
     // 计算体积/材积
-    if (config.calculate_volume && !final_output_file.empty()) {
+    if (config.calculate_volume && config.mesh_volume && !final_output_file.empty()) {
         std::cout << "     计算体积..." << std::endl;
         auto volume_result = metric::TreeVolume::calculateFromOBJ(
             final_output_file.string(),
@@ -458,6 +564,30 @@ TreeMetrics process_file(const std::string& xyz_file, const Config& config) {
         }
     }
     
+    // 由骨架圆台段解析计算体积（无需网格）
+    if (config.calculate_volume && !skeleton_copy.empty()) {
+        std::cout << "     计算骨架体积..." << std::endl;
+        auto skeleton_volume = metric::TreeVolume::calculateFromSkeleton(
+            skeleton_copy.string(),
+            config.volume_class_height,
+            config.verbose
+        );
+        
+        if (skeleton_volume.success) {
+            metrics.skeleton_volume = skeleton_volume.volume;
+            metrics.skeleton_surface_area = skeleton_volume.surface_area;
+            metrics.volume_class_height = skeleton_volume.class_height;
+            metrics.volume_by_height = skeleton_volume.volume_by_height;
+            
+            std::cout << "     骨架体积: " << std::fixed << std::setprecision(3)
+                      << metrics.skeleton_volume << " m³" << std::endl;
+            std::cout << "     骨架表面积: " << std::fixed << std::setprecision(2)
+                      << metrics.skeleton_surface_area << " m²" << std::endl;
+        } else {
+            std::cerr << "     骨架体积计算失败: " << skeleton_volume.error_message << std::endl;
+        }
+    }
+    
     std::cout << "     指标计算完成" << std::endl;
     
     // 生成单个树木的JSON报告
@@ -479,9 +609,19 @@ void print_usage(const char* program_name) {
     std::cout << "  --adtree-exe <path>    指定AdTree路径\n";
     std::cout << "  --no-fill              不进行填洞处理\n";
     std::cout << "  --max-hole-size <n>    最大填洞尺寸\n";
+    std::cout << "  --preset <name>        AdTree重建预设: fast（快速预览）、balanced（默认）、accurate（精细）\n";
+    std::cout << "  --engine <name>        AdTree骨架提取方法: delaunay（默认）、voxel（体素图测地距离，适合高密度点云的快速重建）\n";
+    std::cout << "  --cap-branches         AdTree直接输出封闭的枝干网格（跳过填洞）\n";
+    std::cout << "  --fit-branches         AdTree对一级枝干也拟合圆柱（accurate预设默认开启）\n";
+    std::cout << "  --voxel-size <m>       在体素降采样点云上提取骨架，再用全部点细化（适合高密度点云）\n";
+    std::cout << "  --tet-slab <n>         按高度分块三角化，每块n个点（至少1000；只限制tetgen的内存，点云仍全部载入）\n";
+    std::cout << "  --skeleton-ply         除二进制骨架(.skel)外再输出PLY骨架\n";
     std::cout << "  --no-skeleton          不处理骨架数据\n";
     std::cout << "  --no-volume            不计算体积\n";
+    std::cout << "  --no-mesh-volume       只由骨架计算体积（跳过CGAL网格体积）\n";
+    std::cout << "  --volume-class <m>     骨架体积的高度分级间隔 (默认: 1.0)\n";
     std::cout << "  --no-crown             不计算冠幅\n";
+    std::cout << "  --metrics-only         只重建骨架并计算指标（不生成枝干网格，不计算DBH和网格体积）\n";
     std::cout << "  --filter-ratio <n>     叶节点筛选比例 (默认: 0.15)\n";
     std::cout << "  --verbose              显示详细信息\n";
     std::cout << "  --help, -h             显示帮助\n";
@@ -546,12 +686,44 @@ int main(int argc, char* argv[]) {
                 config.adtree_exe = argv[++i];
             } else if (arg == "--no-fill") {
                 config.fill_holes = false;
+            } else if (arg == "--preset" && i + 1 < argc) {
+                config.preset = argv[++i];
+                if (config.preset != "fast" && config.preset != "balanced" && config.preset != "accurate") {
+                    std::cerr << "错误: 未知的重建预设 " << config.preset << "（可选 fast、balanced、accurate）" << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--engine" && i + 1 < argc) {
+                config.engine = argv[++i];
+                if (config.engine != "delaunay" && config.engine != "voxel") {
+                    std::cerr << "错误: 未知的骨架提取方法 " << config.engine << "（可选 delaunay、voxel）" << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--cap-branches") {
+                config.cap_branches = true;
+            } else if (arg == "--fit-branches") {
+                config.fit_branches = true;
+            } else if (arg == "--voxel-size" && i + 1 < argc) {
+                config.voxel_size = std::atof(argv[++i]);
+            } else if (arg == "--tet-slab" && i + 1 < argc) {
+                config.tet_slab_size = std::atoi(argv[++i]);
+                if (config.tet_slab_size > 0 && config.tet_slab_size < 1000) {
+                    std::cerr << "错误: 分块三角化的每块点数至少为1000" << std::endl;
+                    return 1;
+                }
             } else if (arg == "--max-hole-size" && i + 1 < argc) {
                 config.max_hole_size = std::atoi(argv[++i]);
+            } else if (arg == "--skeleton-ply") {
+                config.skeleton_ply = true;
             } else if (arg == "--no-skeleton") {
                 config.process_skeleton = false;
             } else if (arg == "--no-volume") {
                 config.calculate_volume = false;
+            } else if (arg == "--no-mesh-volume") {
+                config.mesh_volume = false;
+            } else if (arg == "--volume-class" && i + 1 < argc) {
+                config.volume_class_height = std::atof(argv[++i]);
+            } else if (arg == "--metrics-only") {
+                config.metrics_only = true;
             } else if (arg == "--no-crown") {
                 config.calculate_crown = false;
             } else if (arg == "--filter-ratio" && i + 1 < argc) {
@@ -618,7 +790,18 @@ int main(int argc, char* argv[]) {
     }
     std::cout << "  AdTree路径: " << config.adtree_exe << std::endl;
     std::cout << "  文件数量: " << xyz_files.size() << std::endl;
-    std::cout << "  填洞处理: " << (config.fill_holes ? "是" : "否") << std::endl;
+    std::cout << "  填洞处理: " << (config.fill_holes && !config.cap_branches && !config.metrics_only ? "是" : "否") << std::endl;
+    std::cout << "  只计算指标: " << (config.metrics_only ? "是" : "否") << std::endl;
+    std::cout << "  重建预设: " << config.preset << std::endl;
+    std::cout << "  骨架提取: " << config.engine << std::endl;
+    std::cout << "  枝干端盖: " << (config.cap_branches ? "是" : "否") << std::endl;
+    std::cout << "  枝干拟合: " << (config.fit_branches || config.preset == "accurate" ? "是" : "否") << std::endl;
+    if (config.voxel_size > 0) {
+        std::cout << "  骨架体素: " << config.voxel_size << " m" << std::endl;
+    }
+    if (config.tet_slab_size > 0) {
+        std::cout << "  分块点数: " << config.tet_slab_size << std::endl;
+    }
     std::cout << "  骨架处理: " << (config.process_skeleton ? "是" : "否") << std::endl;
     std::cout << "  体积计算: " << (config.calculate_volume ? "是" : "否") << std::endl;
     std::cout << "  冠幅计算: " << (config.calculate_crown ? "是" : "否") << std::endl;
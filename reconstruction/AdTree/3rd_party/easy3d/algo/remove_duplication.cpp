@@ -25,14 +25,74 @@
 #include <easy3d/algo/remove_duplication.h>
 
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 
 #include <easy3d/core/point_cloud.h>
+#include <easy3d/core/box.h>
 #include <3rd_party/kd_tree/Vector3D.h>
 #include <3rd_party/kd_tree/KdTree.h>
 
 
 namespace easy3d {
 
+    namespace details {
+
+        // never a valid key (only 63 bits of the keys are used)
+        const std::uint64_t EMPTY = ~std::uint64_t(0);
+
+        // an open addressing hash table from (packed) grid cell coordinates to cell numbers
+        class CellTable {
+        public:
+            explicit CellTable(std::size_t n) : shift_(64) {
+                std::size_t size = 1;
+                while (size < 2 * n) {
+                    size <<= 1;
+                    --shift_;
+                }
+                keys_.assign(size, EMPTY);
+                values_.resize(size);
+                mask_ = size - 1;
+            }
+
+            // returns the number of the cell, adding it with number 'value' if it does not exist yet
+            int insert(std::uint64_t key, int value) {
+                for (std::size_t pos = slot(key); ; pos = (pos + 1) & mask_) {
+                    if (keys_[pos] == key)
+                        return values_[pos];
+                    if (keys_[pos] == EMPTY) {
+                        keys_[pos] = key;
+                        values_[pos] = value;
+                        return value;
+                    }
+                }
+            }
+
+            // returns the number of the cell, or -1 if it does not exist
+            int find(std::uint64_t key) const {
+                for (std::size_t pos = slot(key); ; pos = (pos + 1) & mask_) {
+                    if (keys_[pos] == key)
+                        return values_[pos];
+                    if (keys_[pos] == EMPTY)
+                        return -1;
+                }
+            }
+
+        private:
+            std::size_t slot(std::uint64_t key) const {
+                return shift_ < 64 ? static_cast<std::size_t>((key * 0x9E3779B97F4A7C15ull) >> shift_) : 0;
+            }
+
+        private:
+            std::vector<std::uint64_t> keys_;
+            std::vector<int> values_;
+            std::size_t mask_;
+            int shift_;
+        };
+
+    }
+
+
     std::vector<PointCloud::Vertex> RemoveDuplication::apply(PointCloud *cloud, float epsilon) {
         const int maxBucketSize = 16;
         std::vector<vec3>& points = cloud->points();
@@ -65,4 +125,150 @@ namespace easy3d {
         return points_to_remove;
     }
 
+
+    std::size_t RemoveDuplication::apply_grid(PointCloud *cloud, float epsilon) {
+        Box3 box;
+        for (const auto& p : cloud->points())
+            box.add_point(p);
+        return apply_grid(cloud, epsilon, box);
+    }
+
+
+    std::size_t RemoveDuplication::apply_grid(PointCloud *cloud, float epsilon, const Box3& box) {
+        std::vector<vec3>& points = cloud->points();
+        const long n = static_cast<long>(points.size());
+        if (n < 2 || !(epsilon > 0))
+            return 0;
+
+        // the cells are (slightly more than) twice as large as epsilon, so the points within epsilon of a point
+        // are in the 2x2x2 cells around the corner of its cell it is closest to. The cell coordinates are packed
+        // into 21 bits each. For a too fine grid, fall back to the kd-tree.
+        const int bits = 21;
+        const double cellSize = 2.0 * epsilon * 1.001;
+        for (int k = 0; k < 3; ++k) {
+            if (box.range(k) / cellSize >= static_cast<double>((1 << bits) - 2)) {
+                const auto& points_to_remove = apply(cloud, epsilon);
+                for (auto v : points_to_remove)
+                    cloud->delete_vertex(v);
+                cloud->garbage_collection();
+                return points_to_remove.size();
+            }
+        }
+
+        // the cell of each point (shifted by one, such that the neighbors of a cell never have negative
+        // coordinates) and the direction of its closest corner (one bit per axis)
+        std::vector<std::uint64_t> keys(n);
+        std::vector<unsigned char> corners(n);
+        const vec3 origin = box.min();
+#pragma omp parallel for
+        for (long i = 0; i < n; ++i) {
+            const vec3& p = points[i];
+            std::uint64_t key = 0;
+            unsigned char corner = 0;
+            for (int k = 0; k < 3; ++k) {
+                const double u = (static_cast<double>(p[k]) - origin[k]) / cellSize;
+                const double c = std::floor(u);
+                key = (key << bits) | (static_cast<std::uint64_t>(c) + 1);
+                if (u - c >= 0.5)
+                    corner |= (1 << (2 - k));
+            }
+            keys[i] = key;
+            corners[i] = corner;
+        }
+
+        // number the non-empty cells and collect their points (in increasing order)
+        details::CellTable cells(n);
+        std::vector<int> cellOf(n);
+        int nCells = 0;
+        for (long i = 0; i < n; ++i) {
+            cellOf[i] = cells.insert(keys[i], nCells);
+            if (cellOf[i] == nCells)
+                ++nCells;
+        }
+        std::vector<int> cellBegin(nCells + 1, 0);
+        for (long i = 0; i < n; ++i)
+            ++cellBegin[cellOf[i] + 1];
+        for (int c = 0; c < nCells; ++c)
+            cellBegin[c + 1] += cellBegin[c];
+        std::vector<int> cellPoints(n);
+        std::vector<int> fill(cellBegin.begin(), cellBegin.end() - 1);
+        for (long i = 0; i < n; ++i)
+            cellPoints[fill[cellOf[i]]++] = static_cast<int>(i);
+
+        // the (at most 8) non-empty cells that may contain points within epsilon of point i
+        const std::uint64_t mask = (std::uint64_t(1) << bits) - 1;
+        auto neighbor_cells = [&](long i, int* ids) -> int {
+            const std::uint64_t key = keys[i];
+            const std::uint64_t x = key >> (2 * bits), y = (key >> bits) & mask, z = key & mask;
+            const std::uint64_t nx = (corners[i] & 4) ? x + 1 : x - 1;
+            const std::uint64_t ny = (corners[i] & 2) ? y + 1 : y - 1;
+            const std::uint64_t nz = (corners[i] & 1) ? z + 1 : z - 1;
+            int num = 0;
+            ids[num++] = cellOf[i];
+            for (int k = 1; k < 8; ++k) {
+                const std::uint64_t cx = (k & 4) ? nx : x;
+                const std::uint64_t cy = (k & 2) ? ny : y;
+                const std::uint64_t cz = (k & 1) ? nz : z;
+                const int id = cells.find((cx << (2 * bits)) | (cy << bits) | cz);
+                if (id >= 0)
+                    ids[num++] = id;
+            }
+            return num;
+        };
+
+        // the same distance test as the kd-tree query around a kept point 'p'
+        const float sqr_dist = epsilon * epsilon;
+        auto is_close = [&](const vec3& p, const vec3& q) -> bool {
+            const float dx = q.x - p.x;
+            const float dy = q.y - p.y;
+            const float dz = q.z - p.z;
+            return dx * dx + dy * dy + dz * dz < sqr_dist;
+        };
+
+        // a point without any preceding point within epsilon is kept. The others are resolved below.
+        enum { KEEP = 0, UNDECIDED = 1, REMOVE = 2 };
+        std::vector<unsigned char> state(n, KEEP);
+#pragma omp parallel for schedule(dynamic, 4096)
+        for (long i = 0; i < n; ++i) {
+            int ids[8];
+            const int num = neighbor_cells(i, ids);
+            for (int k = 0; k < num && state[i] == KEEP; ++k) {
+                for (int j = cellBegin[ids[k]]; j < cellBegin[ids[k] + 1] && cellPoints[j] < i; ++j) {
+                    if (is_close(points[cellPoints[j]], points[i])) {
+                        state[i] = UNDECIDED;
+                        break;
+                    }
+                }
+            }
+        }
+
+        // in the order of the points: a point is removed if a kept preceding point is within epsilon
+        std::size_t num_removed = 0;
+        for (long i = 0; i < n; ++i) {
+            if (state[i] != UNDECIDED)
+                continue;
+            state[i] = KEEP;
+            int ids[8];
+            const int num = neighbor_cells(i, ids);
+            for (int k = 0; k < num && state[i] == KEEP; ++k) {
+                for (int j = cellBegin[ids[k]]; j < cellBegin[ids[k] + 1] && cellPoints[j] < i; ++j) {
+                    const int idx = cellPoints[j];
+                    if (state[idx] == KEEP && is_close(points[idx], points[i])) {
+                        state[i] = REMOVE;
+                        ++num_removed;
+                        break;
+                    }
+                }
+            }
+        }
+
+        for (long i = 0; i < n; ++i) {
+            if (state[i] == REMOVE)
+                cloud->delete_vertex(PointCloud::Vertex(static_cast<int>(i)));
+        }
+        cloud->garbage_collection();
+
+        return num_removed;
+    }
+
 }
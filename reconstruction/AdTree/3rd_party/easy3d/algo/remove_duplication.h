@@ -29,6 +29,7 @@
 #include <vector>
 
 #include <easy3d/core/point_cloud.h>
+#include <easy3d/core/box.h>
 
 
 namespace easy3d {
@@ -43,6 +44,27 @@ namespace easy3d {
          * @return The vertices that should to deleted.
          */
         static std::vector<PointCloud::Vertex> apply(PointCloud *cloud, float epsilon);
+
+        /**
+         * Remove duplicated points of a point clouds in linear time, using a uniform grid with cells slightly larger
+         * than 2 * epsilon (such that the points within epsilon of a point are in the 2x2x2 cells around it). The
+         * points are visited in their order and a point is removed if a preceding kept point lies within epsilon.
+         * The remaining coordinates are those kept by apply(), but not always the same vertices: of exact
+         * duplicates, the first one is kept here, while apply() may keep a later one (depending on the order of
+         * equal distances in its kd-tree). If the grid would be too large, apply() is used instead. The cloud is
+         * compacted (garbage collected) on return.
+         * @param cloud The point cloud.
+         * @param epsilon The distance threshold. Points with a distance smaller than this value will be considered
+         *                as having duplications.
+         * @return The number of removed points.
+         */
+        static std::size_t apply_grid(PointCloud *cloud, float epsilon);
+
+        /**
+         * The same as above, with the bounding box of the points (containing all of them) already known, e.g.,
+         * accumulated while loading the points.
+         */
+        static std::size_t apply_grid(PointCloud *cloud, float epsilon, const Box3& box);
     };
 
 
@@ -29,231 +29,213 @@
 #include "KdTree.h"
 #include <float.h>
 #include <stdlib.h>
+#include <thread>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #define SWAP_POINTS(a,b) \
 			KdTreePoint tmp = points[a];\
 		    points[a] = points[b];\
 		    points[b] = tmp;
 
+// subtrees with fewer points are always built by the calling thread
+static const int g_minParallelBuildSize = 32768;
+
+
+KdTreeQuery::KdTreeQuery()
+	: m_nOfFoundNeighbours(0)
+	, m_nOfNeighbours(0)
+	, m_queryAll(false)
+	, m_queryToLine(true)
+{
+	setNOfNeighbours(1);
+}
+
+void KdTreeQuery::setNOfNeighbours(const unsigned int newNOfNeighbours) {
+	if (newNOfNeighbours != m_nOfNeighbours) {
+		m_nOfNeighbours = newNOfNeighbours;
+		m_queue.setSize(m_nOfNeighbours);
+		m_neighbours.resize(m_nOfNeighbours);
+		m_nOfFoundNeighbours = 0;
+	}
+}
+
+void KdTreeQuery::collect() {
+	if (m_queue.getMax().index == -1) {
+		m_queue.removeMax();
+	}
+
+	m_nOfFoundNeighbours = m_queue.getNofElements();
+	if (m_nOfFoundNeighbours > m_nOfNeighbours)
+	{
+		m_nOfNeighbours = m_nOfFoundNeighbours;
+		m_neighbours.resize(m_nOfNeighbours);
+	}
+
+	for (int i = m_nOfFoundNeighbours - 1; i >= 0; i--) {
+		m_neighbours[i] = m_queue.getMax();
+		m_queue.removeMax();
+	}
+}
+
 
-// ******************
-// global definitions
-// ******************
-bool     g_queryAll;
-
-//=====================================================
-// global parameters for range search
-//-----------------------------------------------------
-float    g_queryOffsets[3];
-Vector3D g_queryPosition;
-//=====================================================
-
-//=====================================================
-// global parameters for line intersection search
-//-----------------------------------------------------
-bool     g_queryToLine;
-Vector3D g_queryLine[2];
-Vector3D g_queryLineDir;
-//-----------------------------------------------------
-// parameters for cylinder intersection
-//-----------------------------------------------------
-float g_queryMaxDist, g_queryMaxSqrDist, g_queryMaxSqrRange;
-//-----------------------------------------------------
-// parameters for cone intersection
-//-----------------------------------------------------
-Vector3D g_queryEye;
-float g_queryMaxCosAngle, g_queryMaxTanAngle, g_queryMinSqrRange;
-//=====================================================
-
-KdTree::KdTree(const Vector3D *positions, unsigned int nOfPositions, unsigned int maxBucketSize) {
+KdTree::KdTree(const Vector3D *positions, unsigned int nOfPositions, unsigned int maxBucketSize, unsigned int nOfThreads) {
 	m_bucketSize = maxBucketSize;
 	m_nOfPositions = nOfPositions;
+	if (nOfThreads == 0)
+		nOfThreads = std::thread::hardware_concurrency();
+	m_parallelDepth = 0;
+	while ((1u << m_parallelDepth) < nOfThreads)
+		++m_parallelDepth;
+
 	m_points = new KdTreePoint[nOfPositions];
-	m_nOfFoundNeighbours = 0;
-	m_nOfNeighbours = 0;
-	m_queryPriorityQueue = new PQueue();
 	for (unsigned int i = 0; i < nOfPositions; i++) {
 		m_points[i].pos = positions[i];
 		m_points[i].index = i;
 	}
-	m_root = new KdNode();
 	Vector3D maximum, minimum;
 	getSpread(m_points, nOfPositions, maximum, minimum);
-	createTree(*m_root, 0, nOfPositions, maximum, minimum);
-	m_root->createBoundingBox(m_boundingBoxLowCorner, m_boundingBoxHighCorner);
+	createTree(m_nodes, 0, nOfPositions, maximum, minimum, 0);
+
+	// store the points in bucket order as separate coordinate arrays
+	m_x.resize(nOfPositions);
+	m_y.resize(nOfPositions);
+	m_z.resize(nOfPositions);
+	m_index.resize(nOfPositions);
+	for (unsigned int i = 0; i < nOfPositions; i++) {
+		m_x[i] = m_points[i].pos.x;
+		m_y[i] = m_points[i].pos.y;
+		m_z[i] = m_points[i].pos.z;
+		m_index[i] = m_points[i].index;
+	}
+	delete[] m_points;
+	m_points = nullptr;
+
+	createBoundingBoxes();
+	m_boundingBoxLowCorner = m_nodes[0].m_boundingBoxLowCorner;
+	m_boundingBoxHighCorner = m_nodes[0].m_boundingBoxHighCorner;
 	setNOfNeighbours(1);
 }
 
 
 KdTree::~KdTree() {
-	delete m_root;
-	delete[] m_points;
-	delete m_queryPriorityQueue;
 }
 
 void KdTree::queryPosition(const Vector3D &position) {
-	if (m_neighbours.size() == 0) {
-		return;
-	}
-	g_queryAll = false;
-	g_queryOffsets[0] = 0.0;
-	g_queryOffsets[1] = 0.0;
-	g_queryOffsets[2] = 0.0;
-	m_queryPriorityQueue->init();
-	m_queryPriorityQueue->insert(-1, FLT_MAX);
-	g_queryPosition = position;
-	float dist = BaseKdNode::computeBoxDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner);
-	m_root->queryNode(dist, m_queryPriorityQueue);
+	queryPosition(m_query, position);
+}
 
-	if (m_queryPriorityQueue->getMax().index == -1) {
-		m_queryPriorityQueue->removeMax();
-	}
+void KdTree::queryRange(const Vector3D &position, float maxSqrDistance, bool queryAll) {
+	queryRange(m_query, position, maxSqrDistance, queryAll);
+}
 
-	m_nOfFoundNeighbours = m_queryPriorityQueue->getNofElements();
-	if (m_nOfFoundNeighbours > m_nOfNeighbours)
-	{
-		m_nOfNeighbours = m_nOfFoundNeighbours;
-		m_neighbours.resize(m_nOfNeighbours);
-	}
+void KdTree::queryLineIntersection(const Vector3D& v1, const Vector3D& v2, float maxDist, bool toLine, bool queryAll) {
+	queryLineIntersection(m_query, v1, v2, maxDist, toLine, queryAll);
+}
 
-	for (int i = m_nOfFoundNeighbours - 1; i >= 0; i--) {
-		m_neighbours[i] = m_queryPriorityQueue->getMax();
-		m_queryPriorityQueue->removeMax();
+void KdTree::queryConeIntersection(const Vector3D& eye, const Vector3D& v1, const Vector3D& v2, float maxAngle, bool toLine, bool queryAll) {
+	queryConeIntersection(m_query, eye, v1, v2, maxAngle, toLine, queryAll);
+}
+
+void KdTree::setNOfNeighbours(const unsigned int newNOfNeighbours) {
+	m_query.setNOfNeighbours(newNOfNeighbours);
+}
+
+void KdTree::queryPosition(KdTreeQuery &query, const Vector3D &position) const {
+	if (query.m_neighbours.size() == 0) {
+		return;
 	}
+	query.m_queryAll = false;
+	query.m_queryOffsets[0] = 0.0;
+	query.m_queryOffsets[1] = 0.0;
+	query.m_queryOffsets[2] = 0.0;
+	query.m_queue.init();
+	query.m_queue.insert(-1, FLT_MAX);
+	query.m_queryPosition = position;
+	float dist = computeBoxDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner);
+	queryNode(0, dist, query);
+	query.collect();
 }
 
-void KdTree::queryRange(const Vector3D &position, float maxSqrDistance, bool queryAll) {
-	if (m_neighbours.size() == 0) {
+void KdTree::queryRange(KdTreeQuery &query, const Vector3D &position, float maxSqrDistance, bool queryAll) const {
+	if (query.m_neighbours.size() == 0) {
 		if (queryAll) {
-			setNOfNeighbours(32);
+			query.setNOfNeighbours(32);
 		}
 		else {
 			return;
 		}
 	}
-	g_queryAll = queryAll;
-	g_queryOffsets[0] = 0.0;
-	g_queryOffsets[1] = 0.0;
-	g_queryOffsets[2] = 0.0;
-	m_queryPriorityQueue->init();
-	m_queryPriorityQueue->insert(-1, maxSqrDistance);
-	g_queryPosition = position;
-
-	float dist = BaseKdNode::computeBoxDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner);
-	m_root->queryNode(dist, m_queryPriorityQueue);
-
-	if (m_queryPriorityQueue->getMax().index == -1) {
-		m_queryPriorityQueue->removeMax();
-	}
+	query.m_queryAll = queryAll;
+	query.m_queryOffsets[0] = 0.0;
+	query.m_queryOffsets[1] = 0.0;
+	query.m_queryOffsets[2] = 0.0;
+	query.m_queue.init();
+	query.m_queue.insert(-1, maxSqrDistance);
+	query.m_queryPosition = position;
 
-	m_nOfFoundNeighbours = m_queryPriorityQueue->getNofElements();
-	if (m_nOfFoundNeighbours > m_nOfNeighbours)
-	{
-		m_nOfNeighbours = m_nOfFoundNeighbours;
-		m_neighbours.resize(m_nOfNeighbours);
-	}
-
-	for (int i = m_nOfFoundNeighbours - 1; i >= 0; i--) {
-		m_neighbours[i] = m_queryPriorityQueue->getMax();
-		m_queryPriorityQueue->removeMax();
-	}
+	float dist = computeBoxDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner);
+	queryNode(0, dist, query);
+	query.collect();
 }
 
-void KdTree::queryLineIntersection(const Vector3D& v1, const Vector3D& v2, float maxDist, bool toLine, bool queryAll)
+void KdTree::queryLineIntersection(KdTreeQuery &query, const Vector3D& v1, const Vector3D& v2, float maxDist, bool toLine, bool queryAll) const
 {
-	if (m_neighbours.size() == 0) {
+	if (query.m_neighbours.size() == 0) {
 		if (queryAll) {
-			setNOfNeighbours(32);
+			query.setNOfNeighbours(32);
 		}
 		else {
 			return;
 		}
 	}
-	g_queryAll = queryAll;
-	g_queryToLine = toLine;
-	g_queryMaxDist = maxDist;
-	g_queryMaxSqrDist = maxDist * maxDist;
-	g_queryLine[0] = v1;
-	g_queryLine[1] = v2;
-	g_queryLineDir = v2 - v1;
-	g_queryMaxSqrRange = g_queryLineDir.getSquaredLength();  // maximal square range
-	g_queryLineDir.normalize();
-	m_queryPriorityQueue->init();
-	m_queryPriorityQueue->insert(-1, FLT_MAX);
-
-	m_root->queryLineIntersection(m_queryPriorityQueue);
-
-	if (m_queryPriorityQueue->getMax().index == -1) {
-		m_queryPriorityQueue->removeMax();
-	}
-
-	m_nOfFoundNeighbours = m_queryPriorityQueue->getNofElements();
-	if (m_nOfFoundNeighbours > m_nOfNeighbours)
-	{
-		m_nOfNeighbours = m_nOfFoundNeighbours;
-		m_neighbours.resize(m_nOfNeighbours);
-	}
-
-	for (int i = m_nOfFoundNeighbours - 1; i >= 0; i--) {
-		m_neighbours[i] = m_queryPriorityQueue->getMax();
-		m_queryPriorityQueue->removeMax();
-	}
+	query.m_queryAll = queryAll;
+	query.m_queryToLine = toLine;
+	query.m_queryMaxDist = maxDist;
+	query.m_queryMaxSqrDist = maxDist * maxDist;
+	query.m_queryLine[0] = v1;
+	query.m_queryLine[1] = v2;
+	query.m_queryLineDir = v2 - v1;
+	query.m_queryMaxSqrRange = query.m_queryLineDir.getSquaredLength();  // maximal square range
+	query.m_queryLineDir.normalize();
+	query.m_queue.init();
+	query.m_queue.insert(-1, FLT_MAX);
+
+	queryLineIntersection(0, query);
+	query.collect();
 }
 
-void KdTree::queryConeIntersection(const Vector3D& eye, const Vector3D& v1, const Vector3D& v2, float maxAngle, bool toLine, bool queryAll)
+void KdTree::queryConeIntersection(KdTreeQuery &query, const Vector3D& eye, const Vector3D& v1, const Vector3D& v2, float maxAngle, bool toLine, bool queryAll) const
 {
-	if (m_neighbours.size() == 0) {
+	if (query.m_neighbours.size() == 0) {
 		if (queryAll) {
-			setNOfNeighbours(32);
+			query.setNOfNeighbours(32);
 		}
 		else {
 			return;
 		}
 	}
-	g_queryAll = queryAll;
-	g_queryToLine = toLine;
-	g_queryMaxCosAngle = cosf(maxAngle);
-	g_queryMaxTanAngle = tanf(maxAngle);
-	g_queryEye = eye;
-	g_queryLine[0] = v1;
-	g_queryLine[1] = v2;
-	g_queryMinSqrRange = (v1 - eye).getSquaredLength();      // minimal square range
-	g_queryLineDir = v2 - eye;
-	g_queryMaxSqrRange = g_queryLineDir.getSquaredLength();  // maximal square range
-	g_queryLineDir.normalize();
-	m_queryPriorityQueue->init();
-	m_queryPriorityQueue->insert(-1, FLT_MAX);
-
-	m_root->queryConeIntersection(m_queryPriorityQueue);
-
-	if (m_queryPriorityQueue->getMax().index == -1) {
-		m_queryPriorityQueue->removeMax();
-	}
-
-	m_nOfFoundNeighbours = m_queryPriorityQueue->getNofElements();
-	if (m_nOfFoundNeighbours > m_nOfNeighbours)
-	{
-		m_nOfNeighbours = m_nOfFoundNeighbours;
-		m_neighbours.resize(m_nOfNeighbours);
-	}
-
-	for (int i = m_nOfFoundNeighbours - 1; i >= 0; i--) {
-		m_neighbours[i] = m_queryPriorityQueue->getMax();
-		m_queryPriorityQueue->removeMax();
-	}
-}
-
-void KdTree::setNOfNeighbours(const unsigned int newNOfNeighbours) {
-	if (newNOfNeighbours != m_nOfNeighbours) {
-		m_nOfNeighbours = newNOfNeighbours;
-		m_queryPriorityQueue->setSize(m_nOfNeighbours);
-		m_nOfNeighbours = newNOfNeighbours;
-		m_neighbours.resize(m_nOfNeighbours);
-		m_nOfFoundNeighbours = 0;
-	}
+	query.m_queryAll = queryAll;
+	query.m_queryToLine = toLine;
+	query.m_queryMaxCosAngle = cosf(maxAngle);
+	query.m_queryMaxTanAngle = tanf(maxAngle);
+	query.m_queryEye = eye;
+	query.m_queryLine[0] = v1;
+	query.m_queryLine[1] = v2;
+	query.m_queryMinSqrRange = (v1 - eye).getSquaredLength();      // minimal square range
+	query.m_queryLineDir = v2 - eye;
+	query.m_queryMaxSqrRange = query.m_queryLineDir.getSquaredLength();  // maximal square range
+	query.m_queryLineDir.normalize();
+	query.m_queue.init();
+	query.m_queue.insert(-1, FLT_MAX);
+
+	queryConeIntersection(0, query);
+	query.collect();
 }
 
-void KdTree::createTree(KdNode &node, int start, int end, Vector3D maximum, Vector3D minimum) {
+void KdTree::createTree(std::vector<KdFlatNode> &nodes, int start, int end, Vector3D maximum, Vector3D minimum, int depth) {
 	int	mid;
 
 	int n = end - start;
@@ -277,6 +259,12 @@ void KdTree::createTree(KdNode &node, int start, int end, Vector3D maximum, Vect
 		}
 	}
 
+	const std::size_t self = nodes.size();
+	nodes.push_back(KdFlatNode());
+	KdFlatNode node;
+	node.m_isLeaf = false;
+	node.m_begin = 0;
+	node.m_nOfElements = 0;
 	node.m_dim = dim;
 	float bestCut = (maximum[dim] + minimum[dim]) / 2.0;
 	float min, max;
@@ -297,38 +285,101 @@ void KdTree::createTree(KdNode &node, int start, int end, Vector3D maximum, Vect
 	else if (br2 < n / 2.0) mid = start + br2;
 	else mid = start + (n >> 1);
 
-	BaseKdNode** childNodes = new BaseKdNode*[2];
-	node.m_children = childNodes;
-	if (mid - start <= m_bucketSize) {
+	KdFlatNode leaf;
+	leaf.m_isLeaf = true;
+	leaf.m_cutVal = 0.0f;
+	leaf.m_right = 0;
+	leaf.m_dim = 0;
+
+	Vector3D leftMaximum = maximum;
+	leftMaximum[dim] = node.m_cutVal;
+	Vector3D rightMinimum = minimum;
+	rightMinimum[dim] = node.m_cutVal;
+
+	const bool leftIsLeaf = (mid - start <= m_bucketSize);
+	const bool rightIsLeaf = (end - mid <= m_bucketSize);
+	if (!leftIsLeaf && !rightIsLeaf && depth < m_parallelDepth && n >= g_minParallelBuildSize) {
+		// the two subtrees work on disjoint ranges of the points: build the left one in another thread
+		std::vector<KdFlatNode> leftNodes, rightNodes;
+		std::thread worker(&KdTree::createTree, this, std::ref(leftNodes), start, mid, leftMaximum, minimum, depth + 1);
+		createTree(rightNodes, mid, end, maximum, rightMinimum, depth + 1);
+		worker.join();
+
+		const unsigned int leftOffset = static_cast<unsigned int>(nodes.size());
+		for (std::size_t i = 0; i < leftNodes.size(); ++i) {
+			if (!leftNodes[i].m_isLeaf)
+				leftNodes[i].m_right += leftOffset;
+			nodes.push_back(leftNodes[i]);
+		}
+		const unsigned int rightOffset = static_cast<unsigned int>(nodes.size());
+		for (std::size_t i = 0; i < rightNodes.size(); ++i) {
+			if (!rightNodes[i].m_isLeaf)
+				rightNodes[i].m_right += rightOffset;
+			nodes.push_back(rightNodes[i]);
+		}
+		node.m_right = rightOffset;
+		nodes[self] = node;
+		return;
+	}
+
+	if (leftIsLeaf) {
 		// new leaf
-		KdLeaf* leaf = new KdLeaf();
-		node.m_children[0] = leaf;
-		leaf->m_points = (m_points + start);
-		leaf->m_nOfElements = mid - start;
+		leaf.m_begin = start;
+		leaf.m_nOfElements = mid - start;
+		nodes.push_back(leaf);
 	}
 	else {
 		// new node
-		KdNode* childNode = new KdNode();
-		node.m_children[0] = childNode;
-		float oldMax = maximum[dim];
-		maximum[dim] = node.m_cutVal;
-		createTree(*childNode, start, mid, maximum, minimum);
-		maximum[dim] = oldMax;
+		createTree(nodes, start, mid, leftMaximum, minimum, depth + 1);
 	}
 
-	if (end - mid <= m_bucketSize) {
+	node.m_right = static_cast<unsigned int>(nodes.size());
+	if (rightIsLeaf) {
 		// new leaf
-		KdLeaf* leaf = new KdLeaf();
-		node.m_children[1] = leaf;
-		leaf->m_points = (m_points + mid);
-		leaf->m_nOfElements = end - mid;
+		leaf.m_begin = mid;
+		leaf.m_nOfElements = end - mid;
+		nodes.push_back(leaf);
 	}
 	else {
 		// new node
-		minimum[dim] = node.m_cutVal;
-		KdNode* childNode = new KdNode();
-		node.m_children[1] = childNode;
-		createTree(*childNode, mid, end, maximum, minimum);
+		createTree(nodes, mid, end, maximum, rightMinimum, depth + 1);
+	}
+	nodes[self] = node;
+}
+
+void KdTree::createBoundingBoxes() {
+	// children are always stored after their parent
+	for (std::size_t i = m_nodes.size(); i-- > 0; ) {
+		KdFlatNode& node = m_nodes[i];
+		Vector3D& lowCorner = node.m_boundingBoxLowCorner;
+		Vector3D& hiCorner = node.m_boundingBoxHighCorner;
+		if (node.m_isLeaf) {
+			if (node.m_nOfElements == 0) {
+				// an empty bucket does not contribute to the box of its parent
+				lowCorner = Vector3D(FLT_MAX, FLT_MAX, FLT_MAX);
+				hiCorner = Vector3D(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+				continue;
+			}
+			const unsigned int begin = node.m_begin;
+			const unsigned int end = node.m_begin + node.m_nOfElements;
+			lowCorner = hiCorner = Vector3D(m_x[begin], m_y[begin], m_z[begin]);
+			for (unsigned int j = begin + 1; j < end; j++) {
+				if (hiCorner.x < m_x[j]) hiCorner.x = m_x[j];
+				else if (lowCorner.x > m_x[j]) lowCorner.x = m_x[j];
+				if (hiCorner.y < m_y[j]) hiCorner.y = m_y[j];
+				else if (lowCorner.y > m_y[j]) lowCorner.y = m_y[j];
+				if (hiCorner.z < m_z[j]) hiCorner.z = m_z[j];
+				else if (lowCorner.z > m_z[j]) lowCorner.z = m_z[j];
+			}
+		}
+		else {
+			const KdFlatNode& left = m_nodes[i + 1];
+			const KdFlatNode& right = m_nodes[node.m_right];
+			for (int d = 0; d < 3; d++) {
+				lowCorner[d] = std::min(left.m_boundingBoxLowCorner[d], right.m_boundingBoxLowCorner[d]);
+				hiCorner[d] = std::max(left.m_boundingBoxHighCorner[d], right.m_boundingBoxHighCorner[d]);
+			}
+		}
 	}
 }
 
@@ -411,34 +462,7 @@ void KdTree::splitAtMid(KdTreePoint *points, int nOfPoints, int dim, float cutVa
 	br2 = l;			// now: points[br1..br2-1] == cutVal < points[br2..n-1]
 }
 
-void BaseKdNode::computeEnclosingBoundingBox(unsigned int nOfPositions, const KdTreePoint *points,
-	Vector3D &lowCorner, Vector3D &hiCorner) {
-	Vector3D tmp;
-	hiCorner = lowCorner = points[0].pos;
-	for (unsigned int i = 1; i < nOfPositions; i++) {
-		tmp = points[i].pos;
-		if (hiCorner[0] < tmp[0]) {
-			hiCorner[0] = tmp[0];
-		}
-		else if (lowCorner[0] > tmp[0]) {
-			lowCorner[0] = tmp[0];
-		}
-		if (hiCorner[1] < tmp[1]) {
-			hiCorner[1] = tmp[1];
-		}
-		else if (lowCorner[1] > tmp[1]) {
-			lowCorner[1] = tmp[1];
-		}
-		if (hiCorner[2] < tmp[2]) {
-			hiCorner[2] = tmp[2];
-		}
-		else if (lowCorner[2] > tmp[2]) {
-			lowCorner[2] = tmp[2];
-		}
-	}
-}
-
-float BaseKdNode::computeBoxDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi) {
+float KdTree::computeBoxDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi) {
      float dist = 0.0;
      float t;
 
@@ -470,7 +494,7 @@ float BaseKdNode::computeBoxDistance(const Vector3D &q, const Vector3D &lo, cons
 	return dist;
 }
 
-float BaseKdNode::computeBoxMaxDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi) {
+float KdTree::computeBoxMaxDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi) {
      float dist;
      float t1, t2;
 
@@ -508,7 +532,7 @@ float BaseKdNode::computeBoxMaxDistance(const Vector3D &q, const Vector3D &lo, c
 	return sqrtf(dist);
 }
 
-bool BaseKdNode::intersectBox(const Vector3D* line, const Vector3D &lo, const Vector3D &hi, float tol)
+bool KdTree::intersectBox(const Vector3D* line, const Vector3D &lo, const Vector3D &hi, float tol)
 {
 	//       Z
 	//       ^      6           7
@@ -590,7 +614,7 @@ bool BaseKdNode::intersectBox(const Vector3D* line, const Vector3D &lo, const Ve
 //       D3DXPlaneFromPoints, but it is precomputed in advance for greater
 //       speed.
 //-----------------------------------------------------------------------------
-bool BaseKdNode::intersectFace(const Vector3D* line, const KdBoxFace& face)
+bool KdTree::intersectFace(const Vector3D* line, const KdBoxFace& face)
 {
 	// If both end points are on the same side of the plane, the line does not intersect the face
 	float dist1 = face.distanceFromPoint(line[0]), dist2 = face.distanceFromPoint(line[1]);
@@ -700,154 +724,196 @@ bool BaseKdNode::intersectFace(const Vector3D* line, const KdBoxFace& face)
 	return true;
 }
 
-void KdNode::queryNode(float rd, PQueue* queryPriorityQueue) {
-     float old_off = g_queryOffsets[m_dim];
-     float new_off = g_queryPosition[m_dim] - m_cutVal;
+void KdTree::queryNode(unsigned int index, float rd, KdTreeQuery &query) const {
+	const KdFlatNode& node = m_nodes[index];
+	if (node.m_isLeaf) {
+		queryLeaf(node, query);
+		return;
+	}
+
+	float old_off = query.m_queryOffsets[node.m_dim];
+	float new_off = query.m_queryPosition[node.m_dim] - node.m_cutVal;
 	if (new_off < 0) {
-		m_children[0]->queryNode(rd, queryPriorityQueue);
+		queryNode(index + 1, rd, query);
 		rd = rd - SQR(old_off) + SQR(new_off);
-		if (rd < queryPriorityQueue->getMaxWeight()) {
-			g_queryOffsets[m_dim] = new_off;
-			m_children[1]->queryNode(rd, queryPriorityQueue);
-			g_queryOffsets[m_dim] = old_off;
+		if (rd < query.m_queue.getMaxWeight()) {
+			query.m_queryOffsets[node.m_dim] = new_off;
+			queryNode(node.m_right, rd, query);
+			query.m_queryOffsets[node.m_dim] = old_off;
 		}
 	}
 	else {
-		m_children[1]->queryNode(rd, queryPriorityQueue);
+		queryNode(node.m_right, rd, query);
 		rd = rd - SQR(old_off) + SQR(new_off);
-		if (rd < queryPriorityQueue->getMaxWeight()) {
-			g_queryOffsets[m_dim] = new_off;
-			m_children[0]->queryNode(rd, queryPriorityQueue);
-			g_queryOffsets[m_dim] = old_off;
+		if (rd < query.m_queue.getMaxWeight()) {
+			query.m_queryOffsets[node.m_dim] = new_off;
+			queryNode(index + 1, rd, query);
+			query.m_queryOffsets[node.m_dim] = old_off;
 		}
 	}
 }
 
-void KdNode::createBoundingBox(Vector3D& lowCorner, Vector3D& highCorner)
-{
-	KdTreePoint points[4];
-	Vector3D vlow, vhigh;
-    for ( unsigned int i = 0; i < 2; i++) {
-		m_children[i]->createBoundingBox(vlow, vhigh);
-		points[2 * i].pos = vlow;
-		points[2 * i + 1].pos = vhigh;
-	}
-	BaseKdNode::computeEnclosingBoundingBox(4, points, lowCorner, highCorner);
-	m_boundingBoxLowCorner = lowCorner;
-	m_boundingBoxHighCorner = highCorner;
-}
-
-void KdNode::queryLineIntersection(PQueue *queryPriorityQueue)
-{
-	if (BaseKdNode::intersectBox(g_queryLine, m_boundingBoxLowCorner, m_boundingBoxHighCorner, g_queryMaxDist))
-	{
-		m_children[0]->queryLineIntersection(queryPriorityQueue);
-		m_children[1]->queryLineIntersection(queryPriorityQueue);
+void KdTree::queryLeaf(const KdFlatNode &leaf, KdTreeQuery &query) const {
+	const unsigned int n = leaf.m_nOfElements;
+	const float* x = &m_x[0] + leaf.m_begin;
+	const float* y = &m_y[0] + leaf.m_begin;
+	const float* z = &m_z[0] + leaf.m_begin;
+	const int* index = &m_index[0] + leaf.m_begin;
+	if (query.m_bucketDist.size() < n)
+		query.m_bucketDist.resize(n);
+	float* sqrDist = &query.m_bucketDist[0];
+
+	const Vector3D& q = query.m_queryPosition;
+	unsigned int i = 0;
+#if defined(__AVX2__)
+	const __m256 qx = _mm256_set1_ps(q.x);
+	const __m256 qy = _mm256_set1_ps(q.y);
+	const __m256 qz = _mm256_set1_ps(q.z);
+	for (; i + 8 <= n; i += 8) {
+		const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), qx);
+		const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), qy);
+		const __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), qz);
+		const __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+		_mm256_storeu_ps(sqrDist + i, d);
+	}
+#endif
+	for (; i < n; i++) {
+		const float dx = x[i] - q.x;
+		const float dy = y[i] - q.y;
+		const float dz = z[i] - q.z;
+		sqrDist[i] = dx * dx + dy * dy + dz * dz;
+	}
+
+	// the queue is updated in the original order of the points
+	for (i = 0; i < n; i++) {
+		if (sqrDist[i] < query.m_queue.getMaxWeight()) {
+			query.m_queue.insert(index[i], sqrDist[i], query.m_queryAll);
+		}
 	}
 }
 
-void KdNode::queryConeIntersection(PQueue* queryPriorityQueue)
+void KdTree::queryLineIntersection(unsigned int index, KdTreeQuery &query) const
 {
-	float fMaxDist;
-	fMaxDist = BaseKdNode::computeBoxMaxDistance(g_queryEye, m_boundingBoxLowCorner, m_boundingBoxHighCorner);
-	fMaxDist = fMaxDist * g_queryMaxTanAngle; // g_queryMaxValue2 = tan( cone_angle )
-	if (BaseKdNode::intersectBox(g_queryLine, m_boundingBoxLowCorner, m_boundingBoxHighCorner, fMaxDist))
-	{
-		m_children[0]->queryConeIntersection(queryPriorityQueue);
-		m_children[1]->queryConeIntersection(queryPriorityQueue);
-	}
-}
+	const KdFlatNode& node = m_nodes[index];
+	if (!intersectBox(query.m_queryLine, node.m_boundingBoxLowCorner, node.m_boundingBoxHighCorner, query.m_queryMaxDist))
+		return;
 
-void KdLeaf::queryNode(float rd, PQueue* queryPriorityQueue) {
-	float sqrDist;
-	//use pointer arithmetic to speed up the linear traversing
-	KdTreePoint* point = m_points;
-    for ( unsigned int i = 0; i < m_nOfElements; i++) {
-		sqrDist = (point->pos - g_queryPosition).getSquaredLength();
-		if (sqrDist < queryPriorityQueue->getMaxWeight()) {
-			queryPriorityQueue->insert(point->index, sqrDist, g_queryAll);
-		}
-		point++;
+	if (node.m_isLeaf)
+		queryLineIntersectionLeaf(node, query);
+	else {
+		queryLineIntersection(index + 1, query);
+		queryLineIntersection(node.m_right, query);
 	}
 }
 
-void KdLeaf::createBoundingBox(Vector3D& lowCorner, Vector3D& highCorner)
+void KdTree::queryLineIntersectionLeaf(const KdFlatNode &leaf, KdTreeQuery &query) const
 {
-	BaseKdNode::computeEnclosingBoundingBox(m_nOfElements, m_points, lowCorner, highCorner);
-	m_boundingBoxLowCorner = lowCorner;
-	m_boundingBoxHighCorner = highCorner;
-}
-
-void KdLeaf::queryLineIntersection(PQueue *queryPriorityQueue)
-{
-	if (BaseKdNode::intersectBox(g_queryLine, m_boundingBoxLowCorner, m_boundingBoxHighCorner, g_queryMaxDist))
-	{
-		Vector3D vc;
-		float sqrDist, sqrDistLine, sqrDistVert;
-		KdTreePoint* point = m_points;
-		// check points individually
-        for ( unsigned int i = 0; i < m_nOfElements; i++) {
-			vc = point->pos - g_queryLine[0];
-			sqrDist = vc.getSquaredLength();
-			sqrDistLine = Vector3D::dotProduct(vc, g_queryLineDir);
-			sqrDistLine *= sqrDistLine;
-			if (sqrDistLine > g_queryMaxSqrRange) continue;
-			sqrDistVert = sqrDist - sqrDistLine;
-			if (sqrDistVert < g_queryMaxSqrDist)
+	const unsigned int n = leaf.m_nOfElements;
+	const float* x = &m_x[0] + leaf.m_begin;
+	const float* y = &m_y[0] + leaf.m_begin;
+	const float* z = &m_z[0] + leaf.m_begin;
+	const int* index = &m_index[0] + leaf.m_begin;
+	if (query.m_bucketDist.size() < n)
+		query.m_bucketDist.resize(n);
+	if (query.m_bucketDistLine.size() < n)
+		query.m_bucketDistLine.resize(n);
+	float* sqrDistVert = &query.m_bucketDist[0];
+	float* sqrDistLine = &query.m_bucketDistLine[0];
+
+	const Vector3D& o = query.m_queryLine[0];
+	const Vector3D& dir = query.m_queryLineDir;
+	unsigned int i = 0;
+#if defined(__AVX2__)
+	const __m256 ox = _mm256_set1_ps(o.x), oy = _mm256_set1_ps(o.y), oz = _mm256_set1_ps(o.z);
+	const __m256 ux = _mm256_set1_ps(dir.x), uy = _mm256_set1_ps(dir.y), uz = _mm256_set1_ps(dir.z);
+	for (; i + 8 <= n; i += 8) {
+		const __m256 vx = _mm256_sub_ps(_mm256_loadu_ps(x + i), ox);
+		const __m256 vy = _mm256_sub_ps(_mm256_loadu_ps(y + i), oy);
+		const __m256 vz = _mm256_sub_ps(_mm256_loadu_ps(z + i), oz);
+		const __m256 sqrDist = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, vx), _mm256_mul_ps(vy, vy)), _mm256_mul_ps(vz, vz));
+		__m256 proj = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, ux), _mm256_mul_ps(vy, uy)), _mm256_mul_ps(vz, uz));
+		proj = _mm256_mul_ps(proj, proj);
+		_mm256_storeu_ps(sqrDistLine + i, proj);
+		_mm256_storeu_ps(sqrDistVert + i, _mm256_sub_ps(sqrDist, proj));
+	}
+#endif
+	for (; i < n; i++) {
+		const float vx = x[i] - o.x;
+		const float vy = y[i] - o.y;
+		const float vz = z[i] - o.z;
+		const float sqrDist = vx * vx + vy * vy + vz * vz;
+		float proj = vx * dir.x + vy * dir.y + vz * dir.z;
+		proj *= proj;
+		sqrDistLine[i] = proj;
+		sqrDistVert[i] = sqrDist - proj;
+	}
+
+	// check points individually. As in the original leaf traversal, scanning the bucket
+	// stops at the first point beyond the end of the segment.
+	for (i = 0; i < n; i++) {
+		if (sqrDistLine[i] > query.m_queryMaxSqrRange) break;
+		if (sqrDistVert[i] < query.m_queryMaxSqrDist)
+		{
+			if (query.m_queryToLine && sqrDistVert[i] < query.m_queue.getMaxWeight())
 			{
-				if (g_queryToLine && sqrDistVert < queryPriorityQueue->getMaxWeight())
-				{
-					// cloest to line first
-					queryPriorityQueue->insert(point->index, sqrDistVert, g_queryAll);
-				}
-				else if (sqrDistLine < queryPriorityQueue->getMaxWeight())
-				{
-					// cloest to eye first
-					queryPriorityQueue->insert(point->index, sqrDistLine, g_queryAll);
-				}
+				// cloest to line first
+				query.m_queue.insert(index[i], sqrDistVert[i], query.m_queryAll);
+			}
+			else if (sqrDistLine[i] < query.m_queue.getMaxWeight())
+			{
+				// cloest to eye first
+				query.m_queue.insert(index[i], sqrDistLine[i], query.m_queryAll);
 			}
-			point++;
 		}
 	}
 }
 
-void KdLeaf::queryConeIntersection(PQueue* queryPriorityQueue)
+void KdTree::queryConeIntersection(unsigned int index, KdTreeQuery &query) const
 {
+	const KdFlatNode& node = m_nodes[index];
 	float fMaxDist;
-	fMaxDist = BaseKdNode::computeBoxMaxDistance(g_queryEye, m_boundingBoxLowCorner, m_boundingBoxHighCorner);
-	fMaxDist = fMaxDist * g_queryMaxTanAngle;
-	if (BaseKdNode::intersectBox(g_queryLine, m_boundingBoxLowCorner, m_boundingBoxHighCorner, fMaxDist))
-	{
-		Vector3D vc;
-		float sqrDist, distLine, sqrDistVert, cosAngle;
-		KdTreePoint* point = m_points;
-		// check points individually
-        for ( unsigned int i = 0; i < m_nOfElements; i++) {
-			vc = point->pos - g_queryEye;
-			sqrDist = vc.getSquaredLength();
-			if (sqrDist < g_queryMinSqrRange) continue;
-			if (sqrDist > g_queryMaxSqrRange) continue;
-
-			distLine = Vector3D::dotProduct(vc, g_queryLineDir);
-			cosAngle = distLine / sqrtf(sqrDist);
-			if (cosAngle > g_queryMaxCosAngle)
+	fMaxDist = computeBoxMaxDistance(query.m_queryEye, node.m_boundingBoxLowCorner, node.m_boundingBoxHighCorner);
+	fMaxDist = fMaxDist * query.m_queryMaxTanAngle; // g_queryMaxValue2 = tan( cone_angle )
+	if (!intersectBox(query.m_queryLine, node.m_boundingBoxLowCorner, node.m_boundingBoxHighCorner, fMaxDist))
+		return;
+
+	if (node.m_isLeaf)
+		queryConeIntersectionLeaf(node, query);
+	else {
+		queryConeIntersection(index + 1, query);
+		queryConeIntersection(node.m_right, query);
+	}
+}
+
+void KdTree::queryConeIntersectionLeaf(const KdFlatNode &leaf, KdTreeQuery &query) const
+{
+	Vector3D vc;
+	float sqrDist, distLine, sqrDistVert, cosAngle;
+	// check points individually (stops at the first point out of range, see queryLineIntersectionLeaf())
+	for (unsigned int i = leaf.m_begin; i < leaf.m_begin + leaf.m_nOfElements; i++) {
+		vc = Vector3D(m_x[i], m_y[i], m_z[i]) - query.m_queryEye;
+		sqrDist = vc.getSquaredLength();
+		if (sqrDist < query.m_queryMinSqrRange) break;
+		if (sqrDist > query.m_queryMaxSqrRange) break;
+
+		distLine = Vector3D::dotProduct(vc, query.m_queryLineDir);
+		cosAngle = distLine / sqrtf(sqrDist);
+		if (cosAngle > query.m_queryMaxCosAngle)
+		{
+			if (query.m_queryToLine)
 			{
-				if (g_queryToLine)
+				// cloest to line first
+				sqrDistVert = sqrDist - distLine * distLine;
+				if (sqrDistVert < query.m_queue.getMaxWeight())
 				{
-					// cloest to line first
-					sqrDistVert = sqrDist - distLine * distLine;
-					if (sqrDistVert < queryPriorityQueue->getMaxWeight())
-					{
-						queryPriorityQueue->insert(point->index, sqrDistVert, g_queryAll);
-					}
-				}
-				else if (sqrDist < queryPriorityQueue->getMaxWeight())
-				{
-					// cloest to eye first
-					queryPriorityQueue->insert(point->index, sqrDist, g_queryAll);
+					query.m_queue.insert(m_index[i], sqrDistVert, query.m_queryAll);
 				}
 			}
-			point++;
+			else if (sqrDist < query.m_queue.getMaxWeight())
+			{
+				// cloest to eye first
+				query.m_queue.insert(m_index[i], sqrDist, query.m_queryAll);
+			}
 		}
 	}
 }
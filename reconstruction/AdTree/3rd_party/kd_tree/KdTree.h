@@ -78,156 +78,101 @@ public:
 };
 
 /**
- * abstract node class
- * base class for leaves and nodes
- *
- * @author Richard Keiser
- * @version 2.0
- */ 
-class BaseKdNode {
-public:
-	Vector3D    m_boundingBoxLowCorner;
-	Vector3D	m_boundingBoxHighCorner;
+ * A node of the kd tree, stored in a flat array in depth-first order.
+ * The left child of an inner node is implicitly the next node in the array, the index
+ * of the right child is stored explicitly. A leaf (bucket) refers to a contiguous range
+ * of the point arrays of the tree.
+ */
+struct KdFlatNode {
 	/**
-	 * look for the nearest neighbours
-	 * @param rd 
-	 *		  the distance of the query position to the node box
-	 * @param queryPriorityQueue
-	 *		  a priority queue
+	 * bounding box of all points below this node
 	 */
-	virtual void queryNode(float rd, PQueue* queryPriorityQueue) = 0;
-    virtual void createBoundingBox( Vector3D& lowCorner, Vector3D& highCorner ) = 0;
-    virtual void queryLineIntersection(PQueue* queryPriorityQueue) = 0;
-    virtual void queryConeIntersection(PQueue* queryPriorityQueue) = 0;
-
-    /**
-	 * compute distance from point to box
-	 *
-	 * @param q 
-	 *		the point position
-	 * @param lo
-	 *		low point of box
-	 * @param hi
-	 *		high point of box
-	 * @return the distance to the box
+	Vector3D		m_boundingBoxLowCorner;
+	Vector3D		m_boundingBoxHighCorner;
+	/**
+	 * cut value of the splitting plane (inner nodes only)
 	 */
-	static float computeBoxDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi);
-
-    /**
-	 * compute the maximal distance from point to one of the eight vertices of the box
-	 *
-	 * @param q 
-	 *		the point position
-	 * @param lo
-	 *		low point of box
-	 * @param hi
-	 *		high point of box
-	 * @return the maximal distance to the box
+	float			m_cutVal;
+	/**
+	 * index of the right child (inner nodes only)
 	 */
-    static float computeBoxMaxDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi);
-
-    /**
-	 * computes the enclosing box of the points
-	 *
-	 * @param lowCorner
-	 *			the low corner of the enclosing box is returned
-	 * @param hiCorner
-	 *			the high corner of the enclosing box is returned
+	unsigned int	m_right;
+	/**
+	 * first point and number of points of the bucket (leaves only)
 	 */
-	static void computeEnclosingBoundingBox(unsigned int nOfPositions, const KdTreePoint *points,
-                                            Vector3D &lowCorner, Vector3D &hiCorner);
-    /**
-	 * compute if a line segment intersects the bounding box
-	 *
-	 * @param v1, v2 
-	 *		the end points of the line segment
-	 * @param lo
-	 *		low point of box
-	 * @param hi
-	 *		high point of box
-     * @param tol
-     *      the error tolerance of the intersection
-	 * @return the distance to the box
+	unsigned int	m_begin;
+	unsigned int	m_nOfElements;
+	/*
+	 * actual dimension of this node
 	 */
-    static bool intersectFace( const Vector3D* line, const KdBoxFace& face );
-	static bool intersectBox( const Vector3D* line, const Vector3D &lo, const Vector3D &hi, float tol );
-
-    virtual ~BaseKdNode() {}
+	unsigned char	m_dim;
+	bool			m_isLeaf;
 };
 
+
 /**
- * Node of a kd tree. The node stands for a box in space.
- *
- * @author Richard Keiser
- * @version 2.0
+ * The state and the results of a query on a kd tree.
+ * A kd tree can be queried concurrently from several threads if each thread uses its own KdTreeQuery.
  */
-class KdNode : public BaseKdNode {
+class KdTreeQuery {
 public:
+	KdTreeQuery();
+
 	/**
-	 * deletes the children of the node
+	 * set the number of nearest neighbours which have to be looked at for a query
+	 *
+	 * @params newNOfNeighbours
+	 *			the number of nearest neighbours
 	 */
-	virtual ~KdNode() {
-		delete m_children[0];
-		delete m_children[1];
-        delete[] m_children;
-	}
+	void setNOfNeighbours(const unsigned int newNOfNeighbours);
 
 	/**
-	 * array of child nodes
+	 * get the index of the i-th nearest neighbour to the query point
+	 * i must be smaller than the number of found neighbours
 	 */
-	BaseKdNode**    m_children;		
+	inline unsigned int getNeighbourPositionIndex(const unsigned int i) const { return m_neighbours[i].index; }
+
 	/**
-	 * cut value of the splitting plane
-	 */
-	float			m_cutVal;		
-	/*
-	 * actual dimension of this node
+	 * get the squared distance of the query point and its i-th nearest neighbour
+	 * i must be smaller than the number of found neighbours
 	 */
-	unsigned char	m_dim;			
+	inline float getSquaredDistance(const unsigned int i) const { return m_neighbours[i].weight; }
 
 	/**
-	 * look for the nearest neighbours
-	 * @param rd 
-	 *		  the distance of the query position to the node box
-	 * @param queryPriorityQueue
-	 *		  a priority queue
+	 * get the number of found neighbours
 	 */
-	void queryNode(float rd, PQueue* queryPriorityQueue);
-    void createBoundingBox( Vector3D& lowCorner, Vector3D& highCorner );
-    void queryLineIntersection(PQueue* queryPriorityQueue);
-    void queryConeIntersection(PQueue* queryPriorityQueue);
-};
+	inline unsigned int getNOfFoundNeighbours() const { return m_nOfFoundNeighbours; }
 
-
-/**
-* A leaf node of the tree (bucket node) containing the primitives
-*
-* @author Richard Keiser
-* @version 2.0
-*/
-class KdLeaf : public BaseKdNode {
-
-public:
-	/**
-	* the primitives of this leaf
-	*/
-	KdTreePoint*	m_points;		
 	/**
-	* the number of elements in this leaf
-	*/
-	unsigned int	m_nOfElements;
+	 * get the number of query neighbors
+	 */
+	inline unsigned int getNOfQueryNeighbours() const { return m_nOfNeighbours; }
 
-	/**
-	* look for the nearest neighbours
-	* @param rd 
-	*		  the distance of the query position to the node box
-	* @param queryPriorityQueue
-	*		  a priority queue
-	*/
-	void queryNode(float rd, PQueue* queryPriorityQueue);
-    void createBoundingBox( Vector3D& lowCorner, Vector3D& highCorner );
-    void queryLineIntersection(PQueue* queryPriorityQueue);
-    void queryConeIntersection(PQueue* queryPriorityQueue);
+private:
+	friend class KdTree;
+
+	// moves the content of the priority queue into the neighbour list (sorted by increasing weight)
+	void collect();
+
+	PQueue					m_queue;
+	std::vector<Neighbour>	m_neighbours;
+	unsigned int			m_nOfFoundNeighbours;
+	unsigned int			m_nOfNeighbours;
+
+	// parameters of the query being processed
+	bool					m_queryAll;
+	bool					m_queryToLine;
+	float					m_queryOffsets[3];
+	Vector3D				m_queryPosition;
+	Vector3D				m_queryLine[2];
+	Vector3D				m_queryLineDir;
+	Vector3D				m_queryEye;
+	float					m_queryMaxDist, m_queryMaxSqrDist, m_queryMaxSqrRange;
+	float					m_queryMaxCosAngle, m_queryMaxTanAngle, m_queryMinSqrRange;
+
+	// per-bucket scratch buffers for the vectorized distance computations
+	std::vector<float>		m_bucketDist;
+	std::vector<float>		m_bucketDistLine;
 };
 
 
@@ -239,6 +184,10 @@ public:
  *	Conference, eds. J. A. Storer and M. Cohn, IEEE Press, 1993, 381-390
  *  and their ANN software library
  *
+ * The nodes are kept in a single array and the points of the buckets are stored as
+ * separate coordinate arrays (SoA), so that the distance tests in the buckets can be
+ * vectorized (AVX2 if enabled at compile time, scalar otherwise).
+ *
  * @author Richard Keiser
  * @version 2.0
  */
@@ -253,8 +202,10 @@ public:
 	 *			number of points
 	 * @param maxBucketSize
 	 *			number of points per bucket
+	 * @param nOfThreads
+	 *			number of threads used to build the tree (0: use all hardware threads)
 	 */
-	KdTree(const Vector3D *positions, unsigned int nOfPositions, unsigned int maxBucketSize);
+	KdTree(const Vector3D *positions, unsigned int nOfPositions, unsigned int maxBucketSize = 16, unsigned int nOfThreads = 0);
 
     /**
 	 * Destructor
@@ -321,6 +272,16 @@ public:
     void queryConeIntersection( const Vector3D& eye, const Vector3D& v1, const Vector3D& v2, float maxAngle,
                                 bool toLine = true, bool queryAll = false );
 
+	/**
+	 * Thread-safe versions of the queries above. The results are stored in <code>query</code>.
+	 */
+	void queryPosition(KdTreeQuery &query, const Vector3D &position) const;
+	void queryRange(KdTreeQuery &query, const Vector3D &position, float maxSqrDistance, bool queryAll = false) const;
+	void queryLineIntersection(KdTreeQuery &query, const Vector3D& v1, const Vector3D& v2, float maxDist,
+                               bool toLine = true, bool queryAll = false) const;
+	void queryConeIntersection(KdTreeQuery &query, const Vector3D& eye, const Vector3D& v1, const Vector3D& v2, float maxAngle,
+                               bool toLine = true, bool queryAll = false) const;
+
 	/**
 	 * set the number of nearest neighbours which have to be looked at for a query
 	 *
@@ -339,15 +300,6 @@ public:
 	 */
 	inline unsigned int getNeighbourPositionIndex (const unsigned int i);
 
-	/** 
-	 * get the position of the i-th nearest neighbour
-	 * i must be smaller than the number of found neighbours
-	 *
-	 * @param i
-	 *			index of the nearest neighbour
-	 * @return the position of the i-th nearest neighbour
-	 */
-	//inline Vector3D getNeighbourPosition(const unsigned int i);
 	/**
 	 * get the squared distance of the query point and its i-th nearest neighbour
 	 * i must be smaller than the number of found neighbours
@@ -376,12 +328,59 @@ public:
 	 */
 	inline unsigned int getNOfQueryNeighbours();
 
+	/**
+	 * get the number of points per bucket
+	 */
+	inline unsigned int getBucketSize() const { return m_bucketSize; }
+
+    /**
+	 * compute distance from point to box
+	 *
+	 * @param q 
+	 *		the point position
+	 * @param lo
+	 *		low point of box
+	 * @param hi
+	 *		high point of box
+	 * @return the distance to the box
+	 */
+	static float computeBoxDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi);
+
+    /**
+	 * compute the maximal distance from point to one of the eight vertices of the box
+	 *
+	 * @param q 
+	 *		the point position
+	 * @param lo
+	 *		low point of box
+	 * @param hi
+	 *		high point of box
+	 * @return the maximal distance to the box
+	 */
+    static float computeBoxMaxDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi);
+
+    /**
+	 * compute if a line segment intersects the bounding box
+	 *
+	 * @param v1, v2 
+	 *		the end points of the line segment
+	 * @param lo
+	 *		low point of box
+	 * @param hi
+	 *		high point of box
+     * @param tol
+     *      the error tolerance of the intersection
+	 * @return the distance to the box
+	 */
+    static bool intersectFace( const Vector3D* line, const KdBoxFace& face );
+	static bool intersectBox( const Vector3D* line, const Vector3D &lo, const Vector3D &hi, float tol );
+
 protected:
 	/** 
 	 * creates the tree using the sliding midpoint splitting rule
 	 * 
-	 * @param node
-	 *		  the node to split
+	 * @param nodes
+	 *		  the node array the (sub)tree is appended to
 	 * @param start
 	 *		  first index in the data array
 	 * @param end
@@ -390,21 +389,37 @@ protected:
 	 *		  maximum coordinates of the data points
 	 * @param minimum
 	 *		  minimum coordinates of the data points
+	 * @param depth
+	 *		  depth of the node, subtrees are built in parallel up to m_parallelDepth
 	 */
-	void createTree(KdNode &node, int start, int end, Vector3D maximum, Vector3D minimum);
+	void createTree(std::vector<KdFlatNode> &nodes, int start, int end, Vector3D maximum, Vector3D minimum, int depth);
 
 	
 private:
-	
+	void queryNode(unsigned int node, float rd, KdTreeQuery &query) const;
+	void queryLeaf(const KdFlatNode &leaf, KdTreeQuery &query) const;
+	void queryLineIntersection(unsigned int node, KdTreeQuery &query) const;
+	void queryLineIntersectionLeaf(const KdFlatNode &leaf, KdTreeQuery &query) const;
+	void queryConeIntersection(unsigned int node, KdTreeQuery &query) const;
+	void queryConeIntersectionLeaf(const KdFlatNode &leaf, KdTreeQuery &query) const;
+
+	// computes the bounding boxes of all nodes bottom-up
+	void createBoundingBoxes();
+
+	// the points in bucket order: coordinates and original indices (SoA)
+	std::vector<float>			m_x, m_y, m_z;
+	std::vector<int>			m_index;
+
+	// the nodes in depth-first order, m_nodes[0] is the root
+	std::vector<KdFlatNode>		m_nodes;
+
+	// only used while building the tree
 	KdTreePoint*				m_points;
-	//const Vector3D*				m_positions;
-    std::vector<Neighbour>  	m_neighbours;
+
 	int							m_bucketSize;
-	KdNode*						m_root;
-	unsigned int				m_nOfFoundNeighbours,
-								m_nOfNeighbours,
-								m_nOfPositions;
-	PQueue*						m_queryPriorityQueue;
+	int							m_parallelDepth;
+	unsigned int				m_nOfPositions;
+	KdTreeQuery					m_query;
 	Vector3D                    m_boundingBoxLowCorner;
 	Vector3D	                m_boundingBoxHighCorner;
 
@@ -420,23 +435,19 @@ private:
 };
 
 inline unsigned int KdTree::getNOfFoundNeighbours() {
-	return m_nOfFoundNeighbours;
+	return m_query.getNOfFoundNeighbours();
 }
 
 inline unsigned int KdTree::getNOfQueryNeighbours() {
-	return m_nOfNeighbours;
+	return m_query.getNOfQueryNeighbours();
 }
 
 inline unsigned int KdTree::getNeighbourPositionIndex(const unsigned int neighbourIndex) {
-	return m_neighbours[neighbourIndex].index;
+	return m_query.getNeighbourPositionIndex(neighbourIndex);
 }
 
-/*inline Vector3D KdTree::getNeighbourPosition(const unsigned int neighbourIndex) {
-	return m_positions[m_neighbours[neighbourIndex].index];
-}*/
-
 inline float KdTree::getSquaredDistance (const unsigned int neighbourIndex) {
-	return m_neighbours[neighbourIndex].weight;
+	return m_query.getSquaredDistance(neighbourIndex);
 }
 
 #endif
@@ -18,6 +18,27 @@ void Optimizer_LM::lm_initialize_control()
 	default_control_.nprint = 0;
 }
 
+void Optimizer_LM::lm_allocate_workspace(int num_fun, int num_var)
+{
+	const std::size_t m = num_fun;
+	const std::size_t n = num_var;
+	if (fvec_.size() < m) {
+		fvec_.resize(m);
+		wa4_.resize(m);
+	}
+	if (fjac_.size() < m * n)
+		fjac_.resize(m * n);
+	if (diag_.size() < n) {
+		diag_.resize(n);
+		qtf_.resize(n);
+		wa1_.resize(n);
+		wa2_.resize(n);
+		wa3_.resize(n);
+		ipvt_.resize(n);
+	}
+}
+
+
 bool Optimizer_LM::optimize(int num_fun, int num_var, double* par, lm_evaluate_func* func, void* data, lm_parameters* control)
 {
 	// use default parameter if ctrl == 0
@@ -25,32 +46,14 @@ bool Optimizer_LM::optimize(int num_fun, int num_var, double* par, lm_evaluate_f
 		control = &default_control_;
 
 	// *** allocate work space.
-
-	double *fvec, *diag, *fjac, *qtf, *wa1, *wa2, *wa3, *wa4;
-	int *ipvt;
-
 	int m = num_fun;
 	int n = num_var;
-
-	if (
-		!(fvec = new double[m]) ||
-		!(diag = new double[n]) ||
-		!(qtf = new double[n]) ||
-		!(fjac = new double[n*m]) ||
-		!(wa1 = new double[n]) ||
-		!(wa2 = new double[n]) ||
-		!(wa3 = new double[n]) ||
-		!(wa4 = new double[m]) ||
-		!(ipvt = new int[n]))
-	{
-		control->info = 9;
-		return false;
-	}
+	lm_allocate_workspace(m, n);
 
 	// *** perform fit.
-
 	control->info = 0;
 	control->nfev = 0;
+
 	// this goes through the modified legacy interface:
 	control->info =
 		lmdif(
@@ -59,41 +62,80 @@ bool Optimizer_LM::optimize(int num_fun, int num_var, double* par, lm_evaluate_f
 		m,
 		n,
 		par,
-		fvec,
+		fvec_.data(),
 		control->ftol,
 		control->xtol,
 		control->gtol,
 		control->maxcall*(n + 1),
 		control->epsilon,
-		diag,
+		diag_.data(),
 		1,
 		control->stepbound,
 		control->nprint,
 		&(control->nfev),
-		fjac,
+		fjac_.data(),
 		m,
-		ipvt,
-		qtf,
-		wa1,
-		wa2,
-		wa3,
-		wa4
+		ipvt_.data(),
+		qtf_.data(),
+		wa1_.data(),
+		wa2_.data(),
+		wa3_.data(),
+		wa4_.data()
 		);
 
 	if (control->info >= 8)
 		control->info = 4;
 
-	// *** clean up.
+	return true;
+}
 
-	delete[](fvec);
-	delete[](diag);
-	delete[](qtf);
-	delete[](fjac);
-	delete[](wa1);
-	delete[](wa2);
-	delete[](wa3);
-	delete[](wa4);
-	delete[](ipvt);
 
-	return true;
-}
\ No newline at end of file
+bool Optimizer_LM::optimize_with_jacobian(int num_fun, int num_var, double* par, lm_evaluate_jacobian_func* func, void* data, lm_parameters* control)
+{
+	// use default parameter if ctrl == 0
+	if (!control)
+		control = &default_control_;
+
+	// *** allocate work space.
+	int m = num_fun;
+	int n = num_var;
+	lm_allocate_workspace(m, n);
+
+	// *** perform fit.
+	control->info = 0;
+	control->nfev = 0;
+	int njev = 0;
+
+	control->info =
+		lmder(
+		func,
+		data,
+		m,
+		n,
+		par,
+		fvec_.data(),
+		fjac_.data(),
+		m,
+		control->ftol,
+		control->xtol,
+		control->gtol,
+		control->maxcall,
+		diag_.data(),
+		1,
+		control->stepbound,
+		control->nprint,
+		&(control->nfev),
+		&njev,
+		ipvt_.data(),
+		qtf_.data(),
+		wa1_.data(),
+		wa2_.data(),
+		wa3_.data(),
+		wa4_.data()
+		);
+
+	if (control->info >= 8)
+		control->info = 4;
+
+	return control->info > 0;	// 0: improper input parameters, < 0: terminated by func
+}
@@ -1,10 +1,12 @@
 #ifndef _MATH_OPTIMIZER_LM_H_
 #define _MATH_OPTIMIZER_LM_H_
 
+#include <vector>
+
 
 /**
 Optimizer_LM for nonlinear least squares problems using Levenberg-Marquardt method.
-It wraps the lmdif() part of cminpack (see http://devernay.free.fr/hacks/cminpack/index.html)
+It wraps the lmdif() and lmder() parts of cminpack (see http://devernay.free.fr/hacks/cminpack/index.html)
 
 min Sum_{i=0}^{M} ( F(x0,..,xN)_i )^2 )
 Where: 
@@ -86,6 +88,22 @@ public:
 		);
 
 	// parameters for calling the high-level interface functions
+	/* for optimize_with_jacobian() */
+	/* if iflag = 1 calculate the functions at var and return this vector in fvec. do not alter fjac. */
+	/* if iflag = 2 calculate the jacobian at var and return this matrix in fjac (column major, */
+	/* i.e., fjac[i + j * ldfjac] is the derivative of function i w.r.t. variable j). do not alter fvec. */
+	/* return a negative value to terminate lmder */
+	typedef int (lm_evaluate_jacobian_func) (
+		void *data,			// user data (the same passed to run)
+		int num_fun,		// Number of functions
+		int num_var,		// Number of variables where n<=m
+		const double* var,	// the n parameters to compute your F
+		double* fvec,		// the values computed by F
+		double* fjac,		// the jacobian of F
+		int ldfjac,			// leading dimension of fjac
+		int iflag			// status
+		);
+
 	struct lm_parameters {
 		double ftol; 		// relative error desired in the sum of squares.
 		double xtol; 		// relative error between last two approximations.
@@ -111,12 +129,32 @@ public:
 		lm_parameters* ctrl = 0		// use default parameter if ctrl == 0
 	);
 
+	// Jacobian provided by the user (analytic). No additional function evaluations are needed for the
+	// Jacobian, so this is much faster than optimize() if the derivatives are known.
+	// Returns false if the input is improper or func terminated the optimization (the parameters are then
+	// those of the last evaluation).
+	bool optimize_with_jacobian(
+		int num_fun,					// Number of functions
+		int num_var,					// Number of variables where num_var<=num_fun
+		double* par,					// starting values of the parameters, it also return the results
+		lm_evaluate_jacobian_func* func,	// your evaluate function (computes F and its Jacobian)
+		void* data,						// user data (will be passed to func)
+		lm_parameters* ctrl = 0			// use default parameter if ctrl == 0
+	);
+
 private:
 	/// Initialize the control: termination condition, steps size..
 	void lm_initialize_control();
 
+	/// Allocate the work space (it is kept for subsequent runs of the same size or smaller)
+	void lm_allocate_workspace(int num_fun, int num_var);
+
 private:
 	lm_parameters default_control_;		// control of this object
+
+	// work space
+	std::vector<double> fvec_, diag_, qtf_, fjac_, wa1_, wa2_, wa3_, wa4_;
+	std::vector<int> ipvt_;
 };
 
 
@@ -0,0 +1,94 @@
+/*
+*	Copyright (C) 2019 by
+*       Shenglan Du (dushenglan940128@163.com)
+*       Liangliang Nan (liangliang.nan@gmail.com)
+*       3D Geoinformation, TU Delft, https://3d.bk.tudelft.nl
+*
+*	This file is part of AdTree, which implements the 3D tree
+*   reconstruction method described in the following paper:
+*   -------------------------------------------------------------------------------------
+*       Shenglan Du, Roderik Lindenbergh, Hugo Ledoux, Jantien Stoter, and Liangliang Nan.
+*       AdTree: Accurate, Detailed, and Automatic Modeling of Laser-Scanned Trees.
+*       Remote Sensing. 2019, 11(18), 2074.
+*   -------------------------------------------------------------------------------------
+*   Please consider citing the above paper if you use the code/program (or part of it).
+*
+*	AdTree is free software; you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License Version 3
+*	as published by the Free Software Foundation.
+*
+*	AdTree is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Checks of the cylinder fitting (run by ctest). Returns 0 if all of them pass.
+
+#include "cylinder.h"
+
+#include <iostream>
+
+
+namespace {
+
+	// the points of a cylinder of radius 0.5 around the z axis, with unit weights
+	std::vector< std::vector<double> > cylinder_points()
+	{
+		std::vector< std::vector<double> > points;
+		for (int i = 0; i < 10; ++i) {
+			for (int k = 0; k < 16; ++k) {
+				const double angle = k * 2.0 * 3.14159265358979323846 / 16;
+				std::vector<double> p = { 0.5 * std::cos(angle), 0.5 * std::sin(angle), 0.1 * i, 1.0 };
+				points.push_back(p);
+			}
+		}
+		return points;
+	}
+
+	bool check(bool condition, const char* message)
+	{
+		if (!condition)
+			std::cerr << "failed: " << message << std::endl;
+		return condition;
+	}
+
+}
+
+
+int main()
+{
+	const std::vector< std::vector<double> > points = cylinder_points();
+	bool ok = true;
+
+	// a fit terminated by the evaluation function (here at once, the axis is degenerated) is a failure
+	{
+		const int m = static_cast<int>(points.size());
+		std::vector<double> data(4 * m);
+		for (int i = 0; i < m; ++i) {
+			for (int k = 0; k < 4; ++k)
+				data[i + k * m] = points[i][k];
+		}
+		double param[7] = { 0.1, 0.1, 0.2, 0.1, 0.1, 0.2, 0.4 };
+		Optimizer_LM optimizer;
+		const bool result = optimizer.optimize_with_jacobian(m, 7, param, (Optimizer_LM::lm_evaluate_jacobian_func*)evaluate_cylinder, data.data());
+		ok &= check(!result, "the optimization with a degenerated axis succeeded");
+
+		Cylinder cylinder(Vector3D(0.1, 0.1, 0.2), Vector3D(0.1, 0.1, 0.2), 0.4f);
+		ok &= check(!cylinder.LeastSquaresFit(points.begin(), points.end()), "the fit of a degenerated axis succeeded");
+	}
+
+	// a valid axis converges to the cylinder
+	{
+		Cylinder cylinder(Vector3D(0.1, 0.0, 0.0), Vector3D(0.0, 0.1, 0.9), 0.4f);
+		ok &= check(cylinder.LeastSquaresFit(points.begin(), points.end()), "the fit of a valid axis failed");
+		ok &= check(std::abs(cylinder.GetRadius() - 0.5) < 1e-6, "the fitted radius is wrong");
+	}
+
+	if (ok)
+		std::cout << "all checks passed" << std::endl;
+	return ok ? 0 : 1;
+}
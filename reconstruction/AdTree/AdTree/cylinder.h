@@ -37,9 +37,18 @@
 #include <vector>
 #include <3rd_party/kd_tree/Vector3D.h>
 #include <stdio.h>
+#include <cmath>
 #include "optimizer_lm.h"
 
 
+//reusable buffers for fitting cylinders (one per thread)
+struct CylinderFitWorkspace
+{
+	std::vector<double> data;	// x, y, z and weight of the points, each in a contiguous block
+	Optimizer_LM optimizer;
+};
+
+
 class Cylinder
 {
 public:
@@ -49,10 +58,18 @@ public:
 	//Initialize the cylinder
 	inline Cylinder(const Vector3D &axisPos1, const Vector3D &axisPos2, float radius);
 
-	//Conduct leas squares
+	//Conduct leas squares. Each point is given as {x, y, z, weight}
 	template< class IteratorT >
 	bool LeastSquaresFit(IteratorT begin, IteratorT end);
 
+	//the same, using the given work space
+	template< class IteratorT >
+	bool LeastSquaresFit(IteratorT begin, IteratorT end, CylinderFitWorkspace& workspace);
+
+	//fit several cylinders in parallel, starting from their current parameters.
+	//cylinders[i] is fit to points[i]; the result of each fit is returned in the same order
+	static inline std::vector<bool> LeastSquaresFitBatch(std::vector<Cylinder>& cylinders, const std::vector< std::vector< std::vector<double> > >& points);
+
 	//Get fitted attributes
 	inline Vector3D GetAxisPosition1() { return m_axisPos1; }
 	inline Vector3D GetAxisPosition2() { return m_axisPos2; }
@@ -85,28 +102,87 @@ Cylinder::Cylinder(const Vector3D &axisPos1, const Vector3D &axisPos2, float rad
 };
 
 
-inline void evaluate_cylinder(double* data, int m, int n, double* var, double* fvec, int iflag)
+//residuals (iflag = 1) or their jacobian (iflag = 2) of the weighted distances of the points to
+//the surface of the cylinder given by the axis (var[0..2], var[3..5]) and the radius (var[6]).
+//the loops over the points have no branches and are vectorized by the compiler.
+inline int evaluate_cylinder(void* p, int m, int n, const double* var, double* fvec, double* fjac, int ldfjac, int iflag)
 {
-	//Compute the objective function
-	Vector3D p1(var[0], var[1], var[2]);
-	Vector3D p2(var[3], var[4], var[5]);
-	double r = var[6];
+	const double* px = static_cast<const double*>(p);
+	const double* py = px + m;
+	const double* pz = px + m * 2;
+	const double* pw = px + m * 3;
+
+	const double x1 = var[0], y1 = var[1], z1 = var[2];
+	const double x2 = var[3], y2 = var[4], z2 = var[5];
+	const double r = var[6];
+	const double ux = x2 - x1, uy = y2 - y1, uz = z2 - z1;
+	const double len = std::sqrt(ux * ux + uy * uy + uz * uz);
+	if (len == 0.0)
+		return -1;	// degenerated axis
+	const double invLen = 1.0 / len;
+
+	if (iflag == 1)
+	{
+		for (int i = 0; i < m; ++i)
+		{
+			const double ax = px[i] - x1, ay = py[i] - y1, az = pz[i] - z1;
+			const double bx = px[i] - x2, by = py[i] - y2, bz = pz[i] - z2;
+			const double cx = ay * bz - az * by, cy = az * bx - ax * bz, cz = ax * by - ay * bx;
+			const double d = std::sqrt(cx * cx + cy * cy + cz * cz) * invLen;
+			fvec[i] = (d - r) * pw[i];
+		}
+		return 0;
+	}
+
+	// with a = p - p1, b = p - p2, c = a x b and d = |c| / |p2 - p1|:
+	//   dd/dp1 = (c^ x b) / L + |c| u^ / L^2,   dd/dp2 = (a x c^) / L - |c| u^ / L^2,   dd/dr = -1
+	double* j0 = fjac;
+	double* j1 = fjac + ldfjac;
+	double* j2 = fjac + ldfjac * 2;
+	double* j3 = fjac + ldfjac * 3;
+	double* j4 = fjac + ldfjac * 4;
+	double* j5 = fjac + ldfjac * 5;
+	double* j6 = fjac + ldfjac * 6;
+	const double hx = ux * invLen * invLen, hy = uy * invLen * invLen, hz = uz * invLen * invLen;
 	for (int i = 0; i < m; ++i)
 	{
-		Vector3D p(data[i], data[i + m], data[i + m * 2]);
-		Vector3D ptemp = Vector3D::crossProduct(p - p1, p - p2);
-		double d = ptemp.normalize() / ((p2 - p1).normalize());
-		fvec[i] = (d - r)*data[i + m * 3];
+		const double ax = px[i] - x1, ay = py[i] - y1, az = pz[i] - z1;
+		const double bx = px[i] - x2, by = py[i] - y2, bz = pz[i] - z2;
+		const double cx = ay * bz - az * by, cy = az * bx - ax * bz, cz = ax * by - ay * bx;
+		const double cLen = std::sqrt(cx * cx + cy * cy + cz * cz);
+		// a point on the axis has no defined gradient, use 0 for the axis parameters
+		const double s = (cLen > 0.0) ? invLen / cLen : 0.0;
+		const double nx = cx * s, ny = cy * s, nz = cz * s;	// c^ / L
+		const double e = cLen * invLen;
+		const double w = pw[i];
+		j0[i] = (ny * bz - nz * by + e * hx) * w;
+		j1[i] = (nz * bx - nx * bz + e * hy) * w;
+		j2[i] = (nx * by - ny * bx + e * hz) * w;
+		j3[i] = (ay * nz - az * ny - e * hx) * w;
+		j4[i] = (az * nx - ax * nz - e * hy) * w;
+		j5[i] = (ax * ny - ay * nx - e * hz) * w;
+		j6[i] = -w;
 	}
+	return 0;
 }
 
 
 
 template< class IteratorT >
 bool Cylinder::LeastSquaresFit(IteratorT begin, IteratorT end)
+{
+	CylinderFitWorkspace workspace;
+	return LeastSquaresFit(begin, end, workspace);
+}
+
+
+template< class IteratorT >
+bool Cylinder::LeastSquaresFit(IteratorT begin, IteratorT end, CylinderFitWorkspace& workspace)
 {
 	int m = end - begin;
 	int n = 7;
+	if (m < n)
+		return false;
 	// assign value to 7 parameters
 	double param[7];
 	for (size_t i = 0; i < 3; ++i)
@@ -116,32 +192,62 @@ bool Cylinder::LeastSquaresFit(IteratorT begin, IteratorT end)
 	param[6] = m_radius;
 
 	//assign value to data
-	double *data = nullptr;
-	int size = 4 * m;
-	data = new double[size];
+	workspace.data.resize(4 * m);
+	double* data = workspace.data.data();
 	int index = 0;
-	std::vector<double> ptemp;
 	for (IteratorT pIter = begin; pIter != end; pIter++)
 	{
-		ptemp = *pIter;
+		const std::vector<double>& ptemp = *pIter;
 		data[index] = ptemp[0];
 		data[index + m] = ptemp[1];
 		data[index + 2*m] = ptemp[2];
 		data[index + 3*m] = ptemp[3];
 		index++;
 	}
-	//Create the optimizer
-	Optimizer_LM lmo;
-	bool result = lmo.optimize(m, n, param, (Optimizer_LM::lm_evaluate_func*)evaluate_cylinder, data);
+	//run the optimizer with the analytic jacobian
+	bool result = workspace.optimizer.optimize_with_jacobian(m, n, param, (Optimizer_LM::lm_evaluate_jacobian_func*)evaluate_cylinder, data);
 	if(!result)
 		return false;
+
+	//the end points may slide along the axis during the optimization. Return the projections
+	//of the initial end points onto the fitted axis, computed in double precision.
+	double u[3] = { param[3] - param[0], param[4] - param[1], param[5] - param[2] };
+	double uu = u[0] * u[0] + u[1] * u[1] + u[2] * u[2];
+	if (uu == 0.0)
+		return false;
+	double t1 = 0.0, t2 = 0.0;
+	for (size_t i = 0; i < 3; ++i)
+	{
+		t1 += (m_axisPos1[i] - param[i]) * u[i];
+		t2 += (m_axisPos2[i] - param[i]) * u[i];
+	}
+	t1 /= uu;
+	t2 /= uu;
+	if (t1 == t2) {	// the initial axis is perpendicular to the fitted one
+		t1 = 0.0;
+		t2 = 1.0;
+	}
 	for(size_t i = 0; i < 3; ++i)
-		m_axisPos1[i] = param[i];
+		m_axisPos1[i] = param[i] + t1 * u[i];
 	for(size_t i = 0; i < 3; ++i)
-		m_axisPos2[i] = param[i + 3];
+		m_axisPos2[i] = param[i] + t2 * u[i];
 	m_radius = param[6];
-	delete[](data);
 	return true;
 }
 
+
+std::vector<bool> Cylinder::LeastSquaresFitBatch(std::vector<Cylinder>& cylinders, const std::vector< std::vector< std::vector<double> > >& points)
+{
+	const int num = static_cast<int>(cylinders.size());
+	std::vector<char> results(num, 0);
+#pragma omp parallel
+	{
+		CylinderFitWorkspace workspace;
+#pragma omp for schedule(dynamic, 1)
+		for (int i = 0; i < num; ++i)
+			results[i] = cylinders[i].LeastSquaresFit(points[i].begin(), points[i].end(), workspace);
+	}
+	return std::vector<bool>(results.begin(), results.end());
+}
+
 #endif
@@ -0,0 +1,166 @@
+/*
+*	Copyright (C) 2019 by
+*       Shenglan Du (dushenglan940128@163.com)
+*       Liangliang Nan (liangliang.nan@gmail.com)
+*       3D Geoinformation, TU Delft, https://3d.bk.tudelft.nl
+*
+*	This file is part of AdTree, which implements the 3D tree
+*   reconstruction method described in the following paper:
+*   -------------------------------------------------------------------------------------
+*       Shenglan Du, Roderik Lindenbergh, Hugo Ledoux, Jantien Stoter, and Liangliang Nan.
+*       AdTree: Accurate, Detailed, and Automatic Modeling of Laser-Scanned Trees.
+*       Remote Sensing. 2019, 11(18), 2074.
+*   -------------------------------------------------------------------------------------
+*   Please consider citing the above paper if you use the code/program (or part of it).
+*
+*	AdTree is free software; you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License Version 3
+*	as published by the Free Software Foundation.
+*
+*	AdTree is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ingest.h"
+
+#include <easy3d/core/point_cloud.h>
+#include <easy3d/algo/remove_duplication.h>
+#include <easy3d/util/line_stream.h>
+#include <easy3d/util/file_system.h>
+#include <easy3d/util/stop_watch.h>
+#include <3rd_party/kd_tree/KdTree.h>
+
+#include <iostream>
+#include <fstream>
+#include <clocale>
+#include <cfloat>
+#include <cmath>
+
+
+using namespace easy3d;
+
+
+CloudStatistics::CloudStatistics()
+	: lowest(0, 0, FLT_MAX)
+	, height(0)
+	, bounding_distance(0)
+	, trunk_min_x(DBL_MAX)
+	, trunk_max_x(-DBL_MAX)
+	, trunk_min_y(DBL_MAX)
+	, trunk_max_y(-DBL_MAX)
+{
+}
+
+
+namespace {
+
+	// the same as io::load_xyz(), but also accumulates the bounding box of the (translated) points
+	bool parse_xyz(const std::string& file_name, PointCloud* cloud, Box3& box)
+	{
+		std::ifstream input(file_name.c_str());
+		if (input.fail()) {
+			std::cerr << "could not open file \'" << file_name << "\'" << std::endl;
+			return false;
+		}
+
+		io::LineInputStream in(input);
+
+		double x0, y0, z0;  // the first point
+		bool got_first_point = false;
+		while (!input.eof()) {
+			in.get_line();
+			if (in.current_line()[0] != '#') {
+				in >> x0 >> y0 >> z0;
+				if (!in.fail()) {
+					cloud->add_vertex(vec3(0, 0, 0));
+					box.add_point(vec3(0, 0, 0));
+					got_first_point = true;
+					break;
+				}
+			}
+		}
+		if (!got_first_point)
+			return false;
+
+		double x, y, z;
+		while (!input.eof()) {
+			in.get_line();
+			if (in.current_line()[0] != '#') {
+				in >> x >> y >> z;
+				if (!in.fail()) {
+					const vec3 p(x - x0, y - y0, z - z0);
+					cloud->add_vertex(p);
+					box.add_point(p);
+				}
+			}
+		}
+
+		PointCloud::ModelProperty<dvec3> prop = cloud->add_model_property<dvec3>("translation");
+		prop[0] = dvec3(x0, y0, z0);
+		std::cout << "input point cloud translated by [" << -prop[0] << "]" << std::endl;
+		return true;
+	}
+
+}
+
+
+PointCloud* ingest_point_cloud(const std::string& file_name, float dedup_ratio, CloudStatistics& stats, KdTree** kdtree)
+{
+	std::setlocale(LC_NUMERIC, "C");
+
+	if (file_system::extension(file_name, true) != "xyz") {
+		std::cerr << "only xyz format is supported" << std::endl;
+		return nullptr;
+	}
+
+	StopWatch w;
+	stats = CloudStatistics();
+	PointCloud* cloud = new PointCloud;
+	cloud->set_name(file_name);
+	if (!parse_xyz(file_name, cloud, stats.box) || cloud->n_vertices() == 0) {
+		delete cloud;
+		return nullptr;
+	}
+	std::cout << "load model done. time: " << w.time_string() << std::endl;
+	std::cout << "cloud loaded. num points: " << cloud->n_vertices() << std::endl;
+
+	// remove duplicated points
+	const float threshold = stats.box.diagonal() * dedup_ratio;
+	RemoveDuplication::apply_grid(cloud, threshold, stats.box);
+	std::cout << "removed too-close points. num points: " << cloud->n_vertices() << std::endl;
+
+	// the lowest point and the height above it
+	const std::vector<vec3>& points = cloud->points();
+	float highest = -FLT_MAX;
+	for (const auto& p : points) {
+		if (p.z < stats.lowest.z)
+			stats.lowest = p;
+		if (p.z > highest)
+			highest = p.z;
+	}
+	stats.height = std::max(0.0, static_cast<double>(highest - stats.lowest.z));
+
+	// the bounding distance and the xy bounding box of the points within 2% of the tree height
+	const double epsiony = 0.02;
+	for (const auto& p : points) {
+		const double distance = std::sqrt(p.distance2(stats.lowest));
+		if (distance > stats.bounding_distance)
+			stats.bounding_distance = distance;
+		if ((p.z - stats.lowest.z) <= epsiony * stats.height) {
+			stats.trunk_min_x = std::min(stats.trunk_min_x, static_cast<double>(p.x));
+			stats.trunk_max_x = std::max(stats.trunk_max_x, static_cast<double>(p.x));
+			stats.trunk_min_y = std::min(stats.trunk_min_y, static_cast<double>(p.y));
+			stats.trunk_max_y = std::max(stats.trunk_max_y, static_cast<double>(p.y));
+		}
+	}
+
+	if (kdtree)
+		*kdtree = new KdTree(reinterpret_cast<const Vector3D*>(points.data()), static_cast<unsigned int>(points.size()), 16);
+
+	return cloud;
+}
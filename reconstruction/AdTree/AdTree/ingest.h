@@ -0,0 +1,71 @@
+#ifndef ADTREE_INGEST_H
+#define ADTREE_INGEST_H
+
+/*
+*	Copyright (C) 2019 by
+*       Shenglan Du (dushenglan940128@163.com)
+*       Liangliang Nan (liangliang.nan@gmail.com)
+*       3D Geoinformation, TU Delft, https://3d.bk.tudelft.nl
+*
+*	This file is part of AdTree, which implements the 3D tree
+*   reconstruction method described in the following paper:
+*   -------------------------------------------------------------------------------------
+*       Shenglan Du, Roderik Lindenbergh, Hugo Ledoux, Jantien Stoter, and Liangliang Nan.
+*       AdTree: Accurate, Detailed, and Automatic Modeling of Laser-Scanned Trees.
+*       Remote Sensing. 2019, 11(18), 2074.
+*   -------------------------------------------------------------------------------------
+*   Please consider citing the above paper if you use the code/program (or part of it).
+*
+*	AdTree is free software; you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License Version 3
+*	as published by the Free Software Foundation.
+*
+*	AdTree is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <string>
+
+#include <easy3d/core/types.h>
+#include <easy3d/core/box.h>
+
+namespace easy3d {
+	class PointCloud;
+}
+
+class KdTree;
+
+
+// the statistics of the input points the skeleton reconstruction starts from
+struct CloudStatistics
+{
+	CloudStatistics();
+
+	easy3d::Box3 box;                 // the bounding box of the loaded points
+	easy3d::vec3 lowest;              // the first point with the smallest z (the root)
+	double       height;              // the largest height above the lowest point
+	double       bounding_distance;   // the largest distance to the lowest point
+	double       trunk_min_x, trunk_max_x, trunk_min_y, trunk_max_y;  // the xy bounding box of the trunk slice
+};
+
+
+/*
+ * Loads a point cloud, translates it to its first point (the translation is stored in the "translation" model
+ * property), removes the points closer than 'dedup_ratio' * (diagonal of the bounding box) to a preceding point,
+ * and computes the statistics of the remaining points. The bounding box is accumulated while parsing, and the
+ * lowest point, the height, the bounding distance and the trunk slice (the points within 2% of the height above
+ * the lowest point) are computed with two passes over the remaining points.
+ * If 'kdtree' is not null, a kd-tree over the remaining points (in their order) is also built and returned in it,
+ * to be shared with the reconstruction (see Skeleton::set_input()). The caller takes the ownership.
+ * Returns the point cloud, or nullptr on failure.
+ */
+easy3d::PointCloud* ingest_point_cloud(const std::string& file_name, float dedup_ratio, CloudStatistics& stats, KdTree** kdtree = nullptr);
+
+
+#endif
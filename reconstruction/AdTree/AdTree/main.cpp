@@ -28,28 +28,45 @@
 
 
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
 
 #include <easy3d/core/graph.h>
 #include <easy3d/core/point_cloud.h>
 #include <easy3d/core/surface_mesh.h>
 #include <easy3d/core/types.h>
-#include <easy3d/fileio/point_cloud_io.h>
 #include <easy3d/fileio/graph_io.h>
 #include <easy3d/fileio/surface_mesh_io.h>
-#include <easy3d/algo/remove_duplication.h>
 #include <easy3d/util/file_system.h>
 
+#include "ingest.h"
 #include "skeleton.h"
 #include "tree_viewer.h"
 
 using namespace easy3d;
 
+// the models to be reconstructed and saved for each point cloud
+enum Output {
+    OUTPUT_SKELETON = 1 << 0,
+    OUTPUT_BRANCHES = 1 << 1,
+    OUTPUT_LEAVES   = 1 << 2
+};
+
+// the file formats of the saved skeletons
+enum SkeletonFormat {
+    SKELETON_PLY    = 1 << 0,
+    SKELETON_BINARY = 1 << 1
+};
+
+
 // save the smoothed skeleton into a PLY file (where each vertex has a radius)
-void save_skeleton(Skeleton* skeleton, PointCloud* cloud, const std::string& file_name) {
-	const ::Graph& sgraph = skeleton->get_smoothed_skeleton();
+bool save_skeleton(Skeleton* skeleton, PointCloud* cloud, const std::string& file_name) {
+	const ::Graph& sgraph = *skeleton->get_smoothed_skeleton();
 	if (boost::num_edges(sgraph) == 0) {
 		std::cerr << "failed to save skeleton (no edge exists)" << std::endl;
-		return;
+		return false;
 	}
 
 	// convert the boost graph to Graph (avoid modifying easy3d's GraphIO, or writing IO for boost graph)
@@ -85,16 +102,130 @@ void save_skeleton(Skeleton* skeleton, PointCloud* cloud, const std::string& fil
 		prop[0] = offset[0];
 	}
 
-	if (GraphIO::save(file_name, &g))
+	if (GraphIO::save(file_name, &g)) {
         std::cout << "model of skeletons saved to: " << file_name << std::endl;
-    else
+        return true;
+    }
+    else {
 		std::cerr << "failed to save the model of skeletons into file" << std::endl;
+        return false;
+    }
+}
+
+
+// save the smoothed skeleton into a compact binary file that can be memory-mapped. The layout (little
+// endian, each array padded to a multiple of 8 bytes, see analysis/preprocessing/.../skeleton_file.h):
+//   char[8] "ADTSKEL", uint32 version (1), uint32 n, double[3] translation, uint64 reserved,
+//   float x[n], y[n], z[n], radius[n], int32 parent[n] (-1 at the start of a branch),
+//   uint8 order[n] (branch order, 0 for the trunk), uint8 flags[n] (1: branch tip, 2: branch start)
+bool save_skeleton_binary(Skeleton* skeleton, PointCloud* cloud, const std::string& file_name) {
+	const ::Graph& sgraph = *skeleton->get_smoothed_skeleton();
+	if (boost::num_edges(sgraph) == 0) {
+		std::cerr << "failed to save skeleton (no edge exists)" << std::endl;
+		return false;
+	}
+
+	// the same vertices (and in the same order) as in the PLY file: the isolated vertices are ignored
+	const std::size_t nAll = boost::num_vertices(sgraph);
+	std::vector<int32_t> index(nAll, -1);
+	int32_t n = 0;
+	for (std::size_t vd = 0; vd < nAll; ++vd) {
+		if (boost::degree(vd, sgraph) != 0)
+			index[vd] = n++;
+	}
+
+	std::vector<float> x(n), y(n), z(n), radius(n);
+	std::vector<int32_t> parent(n, -1);
+	std::vector<uint8_t> order(n, 0), flags(n, 0), children(n, 0);
+	for (std::size_t vd = 0; vd < nAll; ++vd) {
+		if (index[vd] < 0)
+			continue;
+		const SGraphVertexProp& vp = sgraph[vd];
+		const int32_t i = index[vd];
+		x[i] = vp.cVert.x;
+		y[i] = vp.cVert.y;
+		z[i] = vp.cVert.z;
+		radius[i] = static_cast<float>(vp.radius);
+		order[i] = static_cast<uint8_t>(std::min(vp.order, 255));
+	}
+	// the branches are chains added from their start, so the parent of a vertex is its preceding neighbor
+	auto egs = boost::edges(sgraph);
+	for (SGraphEdgeIterator iter = egs.first; iter != egs.second; ++iter) {
+		const int32_t s = index[boost::source(*iter, sgraph)];
+		const int32_t t = index[boost::target(*iter, sgraph)];
+		parent[std::max(s, t)] = std::min(s, t);
+		children[std::min(s, t)] = 1;
+	}
+	for (int32_t i = 0; i < n; ++i) {
+		if (parent[i] >= 0 && !children[i])
+			flags[i] |= 1;
+		if (parent[i] < 0 && children[i])
+			flags[i] |= 2;
+	}
+
+	std::ofstream output(file_name.c_str(), std::ios::binary);
+	if (output.fail()) {
+		std::cerr << "could not open file \'" << file_name << "\'" << std::endl;
+		return false;
+	}
+	auto write_section = [&output](const void* data, std::size_t bytes) {
+		static const char padding[8] = {0};
+		output.write(static_cast<const char*>(data), bytes);
+		output.write(padding, (8 - bytes % 8) % 8);
+	};
+	const char magic[8] = {'A', 'D', 'T', 'S', 'K', 'E', 'L', '\0'};
+	const uint32_t version = 1;
+	const uint32_t count = static_cast<uint32_t>(n);
+	double translation[3] = {0.0, 0.0, 0.0};
+	auto offset = cloud->get_model_property<dvec3>("translation");
+	if (offset) {
+		for (int k = 0; k < 3; ++k)
+			translation[k] = offset[0][k];
+	}
+	const uint64_t reserved = 0;
+	output.write(magic, sizeof(magic));
+	output.write(reinterpret_cast<const char*>(&version), sizeof(version));
+	output.write(reinterpret_cast<const char*>(&count), sizeof(count));
+	output.write(reinterpret_cast<const char*>(translation), sizeof(translation));
+	output.write(reinterpret_cast<const char*>(&reserved), sizeof(reserved));
+	write_section(x.data(), n * sizeof(float));
+	write_section(y.data(), n * sizeof(float));
+	write_section(z.data(), n * sizeof(float));
+	write_section(radius.data(), n * sizeof(float));
+	write_section(parent.data(), n * sizeof(int32_t));
+	write_section(order.data(), n);
+	write_section(flags.data(), n);
+
+	if (output.fail()) {
+		std::cerr << "failed to save the model of skeletons into file" << std::endl;
+		return false;
+	}
+	std::cout << "model of skeletons saved to: " << file_name << std::endl;
+	return true;
 }
 
 
 // returns the number of processed input files.
-int batch_reconstruct(std::vector<std::string>& point_cloud_files, const std::string& output_folder, bool export_skeleton) {
+// If 'checkpoint_folder' is not empty, the state of the reconstruction of each tree is saved into (or, if the file
+// already exists, resumed from the 'resume_stage' of) the checkpoint file <checkpoint_folder>/<name>.ckpt.
+// With 'update', a checkpoint saved for a previous version of the point cloud is updated instead (before trying
+// to resume from it).
+// The leaves of every tree are generated from 'leaf_seed', so they do not depend on the other files of the batch.
+int batch_reconstruct(std::vector<std::string>& point_cloud_files, const std::string& output_folder, int outputs, const ReconstructionParams& params, double lod_tolerance, bool cap_branches, bool low_memory, Skeleton::Engine engine, double voxel_size, int tet_slab_size, int skeleton_formats, const std::string& checkpoint_folder, Skeleton::Stage resume_stage, bool update, unsigned int leaf_seed) {
     int count(0);
+
+    // a single skeleton reconstructs all the trees, reusing its memory from one tree to the next
+    Skeleton *skeleton = new Skeleton();
+    skeleton->set_params(params);
+    skeleton->set_fit_branches(params.fit_branches);
+    skeleton->set_lod_tolerance(lod_tolerance);
+    skeleton->set_cap_branches(cap_branches);
+    skeleton->set_release_intermediates(low_memory);
+    skeleton->set_engine(engine);
+    skeleton->set_voxel_size(voxel_size);
+    skeleton->set_tet_slab_size(tet_slab_size);
+    skeleton->set_leaf_seed(leaf_seed);
+
     for (std::size_t i=0; i<point_cloud_files.size(); ++i) {
         const std::string& xyz_file = point_cloud_files[i];
         std::cout << "------------- " << i + 1 << "/" << point_cloud_files.size() << " -------------" << std::endl;
@@ -105,51 +236,56 @@ int batch_reconstruct(std::vector<std::string>& point_cloud_files, const std::st
                 std::cout << "created output directory '" << output_folder << "'" << std::endl;
             else {
                 std::cerr << "failed creating output directory" << std::endl;
+                delete skeleton;
                 return 0;
             }
         }
 
-        // load point_cloud
-        PointCloud *cloud = PointCloudIO::load(xyz_file);
-        if (cloud) {
-            std::cout << "cloud loaded. num points: " << cloud->n_vertices() << std::endl;
-
-            // compute bbox
-            Box3 box;
-            auto points = cloud->get_vertex_property<vec3>("v:point");
-            for (auto v : cloud->vertices())
-                box.add_point(points[v]);
-
-            // remove duplicated points
-            const float threshold = box.diagonal() * 0.001f;
-            const auto &points_to_remove = RemoveDuplication::apply(cloud, threshold);
-            for (auto v : points_to_remove)
-                cloud->delete_vertex(v);
-            cloud->garbage_collection();
-            std::cout << "removed too-close points. num points: " << cloud->n_vertices() << std::endl;
-        }
-        else {
+        // load point_cloud, remove duplicated points and compute the statistics of the tree in a single stage
+        CloudStatistics stats;
+        KdTree *kdtree = nullptr;
+        PointCloud *cloud = ingest_point_cloud(xyz_file, 0.001f, stats, &kdtree);
+        if (!cloud) {
             std::cerr << "failed to load point cloud from '" << xyz_file << "'" << std::endl;
             continue;
         }
 
         // --------------------------------------------------------------------------------------------
 
-        Skeleton *skeleton = new Skeleton();
+        skeleton->reset();
+        skeleton->set_input(stats, kdtree);   // the skeleton shares the kd-tree built while loading
+
+        // resume from the checkpoint of a previous run, or save one for the next runs
+        if (!checkpoint_folder.empty()) {
+            const std::string checkpoint_file = checkpoint_folder + "/" + file_system::base_name(cloud->name()) + ".ckpt";
+            const bool exists = file_system::is_file(checkpoint_file);
+            // with 'update', the checkpoint is first taken as that of a previous version of the points (and the
+            // updated checkpoint replaces it). It is only resumed if it cannot be updated.
+            if (exists && update && skeleton->load_previous(checkpoint_file, cloud))
+                skeleton->set_checkpoint(checkpoint_file);
+            else if (exists && skeleton->load_checkpoint(checkpoint_file, resume_stage, cloud)) {
+                std::cout << "resuming from checkpoint: " << checkpoint_file << std::endl;
+                skeleton->set_checkpoint("");
+            }
+            else
+                skeleton->set_checkpoint(checkpoint_file);
+        }
 
-        // reconstruct branches
-        {
-            SurfaceMesh *mesh_branches = new SurfaceMesh;
-            const std::string &branch_filename = file_system::base_name(cloud->name()) + "_branches.obj";
+        // reconstruct branches (only the skeleton if the branch surfaces are not requested)
+        SurfaceMesh *mesh_branches = (outputs & OUTPUT_BRANCHES) ? new SurfaceMesh : nullptr;
+        const std::string &branch_filename = file_system::base_name(cloud->name()) + "_branches.obj";
+        if (mesh_branches)
             mesh_branches->set_name(branch_filename);
-            bool status = skeleton->reconstruct_branches(cloud, mesh_branches);
-            if (!status) {
-                std::cerr << "failed in reconstructing branches" << std::endl;
-                delete cloud;
-                delete mesh_branches;
-                delete skeleton;
-                continue;
-            }
+        bool status = skeleton->reconstruct_branches(cloud, mesh_branches);
+        if (!status) {
+            std::cerr << "failed in reconstructing branches" << std::endl;
+            delete cloud;
+            delete mesh_branches;
+            continue;
+        }
+
+        // save branches model
+        if (mesh_branches) {
             // copy translation property from point_cloud to the branches model
             SurfaceMesh::ModelProperty<dvec3> prop = mesh_branches->add_model_property<dvec3>("translation");
             prop[0] = cloud->get_model_property<dvec3>("translation")[0];
@@ -164,7 +300,7 @@ int batch_reconstruct(std::vector<std::string>& point_cloud_files, const std::st
         }
 
         // reconstruct leaves
-        {
+        if (outputs & OUTPUT_LEAVES) {
             SurfaceMesh *mesh_leaves = new SurfaceMesh;
             const std::string &leaves_filename = file_system::base_name(cloud->name()) + "_leaves.obj";
             mesh_leaves->set_name(leaves_filename);
@@ -173,7 +309,6 @@ int batch_reconstruct(std::vector<std::string>& point_cloud_files, const std::st
                 std::cerr << "failed in reconstructing leaves" << std::endl;
                 delete cloud;
                 delete mesh_leaves;
-                delete skeleton;
                 continue;
             }
             // copy translation property from point_cloud to the leaves model
@@ -191,15 +326,31 @@ int batch_reconstruct(std::vector<std::string>& point_cloud_files, const std::st
 
         // --------------------------------------------------------------------------------------------
 
-        if (export_skeleton) {
-            const std::string& skeleton_file = output_folder + "/" + file_system::base_name(cloud->name()) + "_skeleton.ply";
-            save_skeleton(skeleton, cloud, skeleton_file);
+        if (outputs & OUTPUT_SKELETON) {
+            const std::string& skeleton_base = output_folder + "/" + file_system::base_name(cloud->name()) + "_skeleton";
+            bool saved = false;
+            if (skeleton_formats & SKELETON_PLY)
+                saved |= save_skeleton(skeleton, cloud, skeleton_base + ".ply");
+            if (skeleton_formats & SKELETON_BINARY)
+                saved |= save_skeleton_binary(skeleton, cloud, skeleton_base + ".skel");
+            if (saved)
+                ++count;
+        }
+
+        if (low_memory) {
+            if (skeleton->stage_memory_is_peak())
+                std::cout << "peak memory (MB) during each stage:";
+            else
+                std::cout << "change of resident memory (MB) in each stage:";
+            for (const auto& stage : skeleton->get_stage_memory())
+                std::cout << " " << stage.first << "=" << stage.second;
+            std::cout << std::endl;
         }
 
         delete cloud;
-        delete skeleton;
     }
 
+    delete skeleton;
     return count;
 }
 
@@ -218,20 +369,129 @@ int main(int argc, char *argv[]) {
         return EXIT_SUCCESS;
     } else if (argc >= 3) {
         bool export_skeleton = false;
+        int outputs = OUTPUT_BRANCHES | OUTPUT_LEAVES;
+        double lod_tolerance = 0.0;
+        bool cap_branches = false;
+        bool fit_branches = false;
+        bool low_memory = false;
+        Skeleton::Engine engine = Skeleton::ENGINE_DELAUNAY;
+        double voxel_size = 0.0;
+        int tet_slab_size = 0;
+        int skeleton_formats = SKELETON_PLY;
+        std::string checkpoint_dir;
+        ReconstructionParams params;
+        Skeleton::Stage resume_stage = Skeleton::STAGE_SIMPLIFIED;
+        bool update = false;
+        unsigned int leaf_seed = 0;
         for (int i = 0; i < argc; ++i) {
-            if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "-skeleton") == 0) {
+            if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "-skeleton") == 0)
                 export_skeleton = true;
-                break;
+            else if (strcmp(argv[i], "-outputs") == 0 && i + 1 < argc) {
+                // a comma-separated list, e.g., "skeleton,branches"
+                const std::string list(argv[++i]);
+                outputs = 0;
+                if (list.find("skeleton") != std::string::npos) outputs |= OUTPUT_SKELETON;
+                if (list.find("branches") != std::string::npos) outputs |= OUTPUT_BRANCHES;
+                if (list.find("leaves") != std::string::npos)   outputs |= OUTPUT_LEAVES;
+            }
+            else if (strcmp(argv[i], "-lod") == 0 && i + 1 < argc)
+                lod_tolerance = std::max(std::atof(argv[++i]), 0.0);
+            else if (strcmp(argv[i], "-cap") == 0 || strcmp(argv[i], "-caps") == 0)
+                cap_branches = true;
+            else if (strcmp(argv[i], "-fit-branches") == 0)
+                fit_branches = true;
+            else if (strcmp(argv[i], "-lowmem") == 0)
+                low_memory = true;
+            else if (strcmp(argv[i], "-engine") == 0 && i + 1 < argc) {
+                const std::string name(argv[++i]);
+                if (name == "voxel")
+                    engine = Skeleton::ENGINE_VOXEL;
+                else if (name != "delaunay") {
+                    std::cerr << "unknown engine '" << name << "' (expecting delaunay or voxel)" << std::endl;
+                    return EXIT_FAILURE;
+                }
+            }
+            else if (strcmp(argv[i], "-voxel") == 0 && i + 1 < argc)
+                voxel_size = std::max(std::atof(argv[++i]), 0.0);
+            else if (strcmp(argv[i], "-tet-slab") == 0 && i + 1 < argc) {
+                tet_slab_size = std::max(std::atoi(argv[++i]), 0);
+                if (tet_slab_size > 0 && tet_slab_size < Skeleton::MIN_TET_SLAB_SIZE) {
+                    std::cerr << "the tetgen slabs must have at least " << Skeleton::MIN_TET_SLAB_SIZE << " points" << std::endl;
+                    return EXIT_FAILURE;
+                }
             }
+            else if (strcmp(argv[i], "-skeleton-format") == 0 && i + 1 < argc) {
+                // "ply", "skel", or both, e.g., "skel,ply"
+                const std::string list(argv[++i]);
+                skeleton_formats = 0;
+                if (list.find("ply") != std::string::npos)  skeleton_formats |= SKELETON_PLY;
+                if (list.find("skel") != std::string::npos) skeleton_formats |= SKELETON_BINARY;
+                if (skeleton_formats == 0)
+                    skeleton_formats = SKELETON_PLY;
+            }
+            else if (strcmp(argv[i], "-preset") == 0 && i + 1 < argc) {
+                if (!ReconstructionParams::from_preset(argv[++i], params)) {
+                    std::cerr << "unknown preset '" << argv[i] << "' (expecting fast, balanced, or accurate)" << std::endl;
+                    return EXIT_FAILURE;
+                }
+            }
+            else if (strcmp(argv[i], "-checkpoint") == 0 && i + 1 < argc)
+                checkpoint_dir = argv[++i];
+            else if (strcmp(argv[i], "-resume-from") == 0 && i + 1 < argc)
+                resume_stage = (strcmp(argv[++i], "mst") == 0) ? Skeleton::STAGE_MST : Skeleton::STAGE_SIMPLIFIED;
+            else if (strcmp(argv[i], "-update") == 0)
+                update = true;
+            else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc)
+                leaf_seed = static_cast<unsigned int>(std::strtoul(argv[++i], nullptr, 10));
         }
 
-        if (export_skeleton) {
-            std::cout << "You have requested to save the reconstructed tree skeleton(s) in PLY format into the output directory." << std::endl;
+        if (export_skeleton)
+            outputs |= OUTPUT_SKELETON;
+        // whatever the preset (in any order of the arguments)
+        if (fit_branches)
+            params.fit_branches = true;
+
+        if (outputs & OUTPUT_SKELETON) {
+            const char* formats = (skeleton_formats & SKELETON_BINARY) ? ((skeleton_formats & SKELETON_PLY) ? "PLY and binary formats" : "binary format") : "PLY format";
+            std::cout << "You have requested to save the reconstructed tree skeleton(s) in " << formats << " into the output directory." << std::endl;
             std::cout << "The skeleton file(s) can be visualized using Easy3D: https://github.com/LiangliangNan/Easy3D" << std::endl;
         }
         else
             std::cout << "Tree skeleton(s) will not be saved (append '-s' or '-skeleton' in commandline to enable it)" << std::endl;
 
+        if (!(outputs & OUTPUT_BRANCHES))
+            std::cout << "Branch surfaces will not be reconstructed" << std::endl;
+        if (!(outputs & OUTPUT_LEAVES))
+            std::cout << "Leaves will not be reconstructed" << std::endl;
+        if (params.preset != "balanced")
+            std::cout << "Trees will be reconstructed with the '" << params.preset << "' preset" << std::endl;
+        if (lod_tolerance > 0)
+            std::cout << "Branch surfaces will be meshed adaptively with a tolerance of " << lod_tolerance << std::endl;
+        if (cap_branches)
+            std::cout << "Branch surfaces will be closed with end caps" << std::endl;
+        if (params.fit_branches)
+            std::cout << "The first-order branches will be fitted to cylinders" << std::endl;
+        if (leaf_seed != 0 && (outputs & OUTPUT_LEAVES))
+            std::cout << "Leaves will be generated with the seed " << leaf_seed << std::endl;
+        if (low_memory)
+            std::cout << "Intermediate results will be released as early as possible" << std::endl;
+        if (engine == Skeleton::ENGINE_VOXEL)
+            std::cout << "The skeletons will be extracted from a voxel graph (of voxel size " << (voxel_size > 0 ? std::to_string(voxel_size) : "adapted to the point density") << ")" << std::endl;
+        else if (voxel_size > 0)
+            std::cout << "The skeletons will be computed from voxels of size " << voxel_size << " and refined against all points" << std::endl;
+        if (tet_slab_size > 0)
+            std::cout << "Point clouds will be triangulated in height slabs of " << tet_slab_size << " points" << std::endl;
+        if (!checkpoint_dir.empty()) {
+            if (!file_system::is_directory(checkpoint_dir) && !file_system::create_directory(checkpoint_dir)) {
+                std::cerr << "failed creating checkpoint directory '" << checkpoint_dir << "'" << std::endl;
+                return EXIT_FAILURE;
+            }
+            std::cout << "Reconstructions will be resumed from (or checkpointed into) '" << checkpoint_dir << "' after the "
+                      << (resume_stage == Skeleton::STAGE_MST ? "MST" : "simplification") << " stage" << std::endl;
+            if (update)
+                std::cout << "The checkpoints of previous versions of the point clouds will be updated where points were added" << std::endl;
+        }
+
         std::string first_arg(argv[1]);
         std::string second_arg(argv[2]);
         if (file_system::is_file(second_arg))
@@ -240,7 +500,7 @@ int main(int argc, char *argv[]) {
             std::string output_dir = second_arg;
             if (file_system::is_file(first_arg)) {
                 std::vector<std::string> cloud_files = {first_arg};
-                return batch_reconstruct(cloud_files, output_dir, export_skeleton) > 0;
+                return batch_reconstruct(cloud_files, output_dir, outputs, params, lod_tolerance, cap_branches, low_memory, engine, voxel_size, tet_slab_size, skeleton_formats, checkpoint_dir, resume_stage, update, leaf_seed) > 0;
             } else if (file_system::is_directory(first_arg)) {
                 std::vector<std::string> entries;
                 file_system::get_directory_entries(first_arg, entries, false);
@@ -249,7 +509,7 @@ int main(int argc, char *argv[]) {
                     if (file_name.size() > 3 && file_name.substr(file_name.size() - 3) == "xyz")
                         cloud_files.push_back(first_arg + "/" + file_name);
                 }
-                return batch_reconstruct(cloud_files, output_dir, export_skeleton) > 0;
+                return batch_reconstruct(cloud_files, output_dir, outputs, params, lod_tolerance, cap_branches, low_memory, engine, voxel_size, tet_slab_size, skeleton_formats, checkpoint_dir, resume_stage, update, leaf_seed) > 0;
             } else
                 std::cerr
                         << "WARNING: unknown first argument (expecting either a point cloud file in *.xyz format or a\n"
@@ -261,15 +521,45 @@ int main(int argc, char *argv[]) {
     std::cerr << "  1) GUI mode." << std::endl;
     std::cerr << "         Command: ./AdTree" << std::endl << std::endl;
     std::cerr << "  2) Commandline single processing mode (i.e., processing a single point cloud file)." << std::endl;
-    std::cerr << "         Command: ./AdTree  <xyz_file_path>  <output_directory>  [-s|-skeleton]" << std::endl;
+    std::cerr << "         Command: ./AdTree  <xyz_file_path>  <output_directory>  [-s|-skeleton] [-outputs <list>] [-preset <name>] [-lod <tolerance>] [-cap] [-fit-branches] [-lowmem] [-engine <name>] [-voxel <size>] [-tet-slab <points>] [-skeleton-format <list>] [-checkpoint <dir>] [-resume-from <stage>] [-update] [-seed <n>]" << std::endl;
     std::cerr << "     - <xyz_file_path>: a mandatory argument specifying the path to the input point cloud file" << std::endl;
     std::cerr << "     - <output_directory>: a mandatory argument specifying where to save the results" << std::endl;
-    std::cerr << "     - [-s] or [-skeleton]: also export the skeletons (omit this argument it if you don't need skeletons)" << std::endl << std::endl;
+    std::cerr << "     - [-s] or [-skeleton]: also export the skeletons (omit this argument it if you don't need skeletons)" << std::endl;
+    std::cerr << "     - [-outputs <list>]: comma-separated models to reconstruct among skeleton,branches,leaves (default: branches,leaves)" << std::endl;
+    std::cerr << "     - [-preset <name>]: the quality/speed trade-off among fast,balanced,accurate (default: balanced)" << std::endl;
+    std::cerr << "     - [-lod <tolerance>]: adapt the resolution of the branch surfaces to their radius and curvature" << std::endl;
+    std::cerr << "     - [-cap] or [-caps]: close the branch surfaces with end caps (watertight branch models)" << std::endl;
+    std::cerr << "     - [-fit-branches]: also fit cylinders to the first-order branches (default: only with the accurate preset)" << std::endl;
+    std::cerr << "     - [-lowmem]: release the intermediate results as early as possible and report the memory of each stage" << std::endl;
+    std::cerr << "     - [-engine <name>]: the skeleton extraction among delaunay,voxel (faster, geodesic voxel graph) (default: delaunay)" << std::endl;
+    std::cerr << "     - [-voxel <size>]: compute the skeletons from voxel-subsampled points (faster for dense point clouds)" << std::endl;
+    std::cerr << "     - [-tet-slab <points>]: triangulate big point clouds in overlapping height slabs of this many points (at least 1000)," << std::endl;
+    std::cerr << "       which bounds the memory of the triangulation only (the whole point cloud is still loaded)" << std::endl;
+    std::cerr << "     - [-skeleton-format <list>]: the skeleton file formats among ply,skel (binary) (default: ply)" << std::endl;
+    std::cerr << "     - [-checkpoint <dir>]: save the skeleton stages into <dir>, and resume from there when run again" << std::endl;
+    std::cerr << "     - [-resume-from <stage>]: the checkpointed stage to resume from, mst or simplified (default: simplified)" << std::endl;
+    std::cerr << "     - [-update]: with -checkpoint, update the MST of a previous version of the point cloud where points were added" << std::endl;
+    std::cerr << "     - [-seed <n>]: the seed of the random generator of the leaves of each tree (default: 0)" << std::endl << std::endl;
     std::cerr << "  3) Commandline batch processing mode (i.e., all *.xyz files in an input directory will be processed)." << std::endl;
-    std::cerr << "         Command: ./AdTree <xyz_files_directory> <output_directory> [-s|-skeleton]" << std::endl;
+    std::cerr << "         Command: ./AdTree <xyz_files_directory> <output_directory> [-s|-skeleton] [-outputs <list>] [-preset <name>] [-lod <tolerance>] [-cap] [-fit-branches] [-lowmem] [-engine <name>] [-voxel <size>] [-tet-slab <points>] [-skeleton-format <list>] [-checkpoint <dir>] [-resume-from <stage>] [-update] [-seed <n>]" << std::endl;
     std::cerr << "     - <xyz_files_directory>: a mandatory argument specifying the directory containing the input point cloud files" << std::endl;
     std::cerr << "     - <output_directory>: a mandatory argument specifying where to save the results" << std::endl;
-    std::cerr << "     - [-s] or [-skeleton]: also export the skeletons (omit this argument it if you don't need skeletons)" << std::endl << std::endl;
+    std::cerr << "     - [-s] or [-skeleton]: also export the skeletons (omit this argument it if you don't need skeletons)" << std::endl;
+    std::cerr << "     - [-outputs <list>]: comma-separated models to reconstruct among skeleton,branches,leaves (default: branches,leaves)" << std::endl;
+    std::cerr << "     - [-preset <name>]: the quality/speed trade-off among fast,balanced,accurate (default: balanced)" << std::endl;
+    std::cerr << "     - [-lod <tolerance>]: adapt the resolution of the branch surfaces to their radius and curvature" << std::endl;
+    std::cerr << "     - [-cap] or [-caps]: close the branch surfaces with end caps (watertight branch models)" << std::endl;
+    std::cerr << "     - [-fit-branches]: also fit cylinders to the first-order branches (default: only with the accurate preset)" << std::endl;
+    std::cerr << "     - [-lowmem]: release the intermediate results as early as possible and report the memory of each stage" << std::endl;
+    std::cerr << "     - [-engine <name>]: the skeleton extraction among delaunay,voxel (faster, geodesic voxel graph) (default: delaunay)" << std::endl;
+    std::cerr << "     - [-voxel <size>]: compute the skeletons from voxel-subsampled points (faster for dense point clouds)" << std::endl;
+    std::cerr << "     - [-tet-slab <points>]: triangulate big point clouds in overlapping height slabs of this many points (at least 1000)," << std::endl;
+    std::cerr << "       which bounds the memory of the triangulation only (the whole point cloud is still loaded)" << std::endl;
+    std::cerr << "     - [-skeleton-format <list>]: the skeleton file formats among ply,skel (binary) (default: ply)" << std::endl;
+    std::cerr << "     - [-checkpoint <dir>]: save the skeleton stages into <dir>, and resume from there when run again" << std::endl;
+    std::cerr << "     - [-resume-from <stage>]: the checkpointed stage to resume from, mst or simplified (default: simplified)" << std::endl;
+    std::cerr << "     - [-update]: with -checkpoint, update the MST of a previous version of the point cloud where points were added" << std::endl;
+    std::cerr << "     - [-seed <n>]: the seed of the random generator of the leaves of each tree (default: 0)" << std::endl << std::endl;
 
     return EXIT_FAILURE;
 }
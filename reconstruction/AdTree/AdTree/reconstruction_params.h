@@ -0,0 +1,98 @@
+#ifndef ADTREE_RECONSTRUCTION_PARAMS_H
+#define ADTREE_RECONSTRUCTION_PARAMS_H
+
+/*
+*	Copyright (C) 2019 by
+*       Shenglan Du (dushenglan940128@163.com)
+*       Liangliang Nan (liangliang.nan@gmail.com)
+*       3D Geoinformation, TU Delft, https://3d.bk.tudelft.nl
+*
+*	This file is part of AdTree, which implements the 3D tree
+*   reconstruction method described in the following paper:
+*   -------------------------------------------------------------------------------------
+*       Shenglan Du, Roderik Lindenbergh, Hugo Ledoux, Jantien Stoter, and Liangliang Nan.
+*       AdTree: Accurate, Detailed, and Automatic Modeling of Laser-Scanned Trees.
+*       Remote Sensing. 2019, 11(18), 2074.
+*   -------------------------------------------------------------------------------------
+*   Please consider citing the above paper if you use the code/program (or part of it).
+*
+*	AdTree is free software; you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License Version 3
+*	as published by the Free Software Foundation.
+*
+*	AdTree is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <string>
+
+// This header has no dependencies, such that the tools driving AdTree can report the parameters of a preset.
+
+
+// the constants of the reconstruction that trade quality for speed (see Skeleton::set_params())
+struct ReconstructionParams
+{
+    std::string preset;            // the name of the preset the parameters come from
+
+    double subtree_threshold;      // the MST edges whose subtree is shorter than this ratio of their parent's are removed
+    double centralize_range;       // the points within this ratio of the bounding distance to the root are centralized
+    double line_query_factor;      // the points within this factor of the radius to an edge are assigned to it
+    int    min_fitting_points;     // the trunk (and a branch) is fitted to a cylinder only if it has more points
+    int    smoothing_slices;       // the number of samples of the smoothed skeleton per unit of length
+    int    surface_slices;         // the number of vertices of the cross-sections of the branch surfaces
+    bool   fit_branches;           // also fit cylinders to the first-order branches (otherwise only to the trunk)
+
+    // the original constants of AdTree
+    ReconstructionParams()
+        : preset("balanced")
+        , subtree_threshold(0.019)
+        , centralize_range(0.5)
+        , line_query_factor(3.5)
+        , min_fitting_points(20)
+        , smoothing_slices(20)
+        , surface_slices(10)
+        , fit_branches(false)
+    {
+    }
+
+    // the parameters of a named preset:
+    //  - "fast": coarser skeletons and surfaces, e.g., for previews;
+    //  - "balanced": the defaults;
+    //  - "accurate": keeps smaller branches, samples the skeletons and surfaces more densely, and fits the
+    //    first-order branches to cylinders.
+    // Returns false (and leaves 'params' unchanged) for an unknown name.
+    static bool from_preset(const std::string& name, ReconstructionParams& params) {
+        ReconstructionParams p;
+        if (name == "fast") {
+            p.subtree_threshold = 0.03;
+            p.centralize_range = 0.3;
+            p.line_query_factor = 3.0;
+            p.min_fitting_points = 30;
+            p.smoothing_slices = 10;
+            p.surface_slices = 6;
+        }
+        else if (name == "accurate") {
+            p.subtree_threshold = 0.01;
+            p.centralize_range = 0.6;
+            p.line_query_factor = 4.0;
+            p.min_fitting_points = 12;
+            p.smoothing_slices = 40;
+            p.surface_slices = 16;
+            p.fit_branches = true;
+        }
+        else if (name != "balanced")
+            return false;
+        p.preset = name;
+        params = p;
+        return true;
+    }
+};
+
+
+#endif
@@ -27,25 +27,217 @@
 */
 
 #include "skeleton.h"
+#include "skeleton_traversal.h"
 #include "cylinder.h"
 
 #include <easy3d/core/point_cloud.h>
 #include <easy3d/core/surface_mesh.h>
-#include <easy3d/core/random.h>
 #include <easy3d/core/principal_axes.h>
 #include <3rd_party/tetgen/tetgen.h>
 
 #include <iostream>
+#include <fstream>
 #include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__APPLE__)
+#include <sys/resource.h>
+#include <mach/mach.h>
+#else
+#include <sys/resource.h>
+#endif
 
 
 using namespace boost;
 using namespace easy3d;
 
+
+namespace {
+    // number of threads available to the parallel loops (1 without OpenMP)
+    inline int num_threads() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    // a uniform random number in [0, 1) from the top 24 bits of the generator. Unlike the standard
+    // distributions, this gives the same sequence with all standard libraries.
+    inline float random_unit(std::mt19937& rng) {
+        return static_cast<float>(rng() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // index of the calling thread in a parallel region (0 without OpenMP)
+    inline int thread_id() {
+#ifdef _OPENMP
+        return omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
+
+#ifdef __linux__
+    // a field of /proc/self/status in MB, e.g., "VmRSS:" or "VmHWM:" (negative if unknown)
+    double proc_status_memory(const std::string& field) {
+        std::ifstream input("/proc/self/status");
+        std::string line;
+        while (std::getline(input, line)) {
+            if (line.compare(0, field.size(), field) == 0)
+                return std::atof(line.c_str() + field.size()) / 1024.0;   // in KB
+        }
+        return -1.0;
+    }
+#endif
+
+    // resets the peak resident memory of the process to the current one (see peak_memory()). Returns false
+    // if this is not supported, which is the case except on Linux.
+    bool reset_peak_memory() {
+#ifdef __linux__
+        std::ofstream output("/proc/self/clear_refs");
+        output << "5";
+        output.close();
+        return !output.fail() && proc_status_memory("VmHWM:") >= 0;
+#else
+        return false;
+#endif
+    }
+
+    // the current resident memory of the process, in MB (0 if unknown)
+    double current_memory() {
+#if defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return counters.WorkingSetSize / (1024.0 * 1024.0);
+        return 0.0;
+#elif defined(__APPLE__)
+        mach_task_basic_info_data_t info;
+        mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+        if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS)
+            return 0.0;
+        return info.resident_size / (1024.0 * 1024.0);
+#elif defined(__linux__)
+        return std::max(proc_status_memory("VmRSS:"), 0.0);
+#else
+        return 0.0;
+#endif
+    }
+
+    // the peak resident memory of the process since the last reset_peak_memory() (or since its start), in MB
+    // (0 if unknown)
+    double peak_memory() {
+#ifdef __linux__
+        const double peak = proc_status_memory("VmHWM:");
+        if (peak >= 0)
+            return peak;
+#endif
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+        return 0.0;
+#else
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0.0;
+#ifdef __APPLE__
+        return usage.ru_maxrss / (1024.0 * 1024.0);  // in bytes
+#else
+        return usage.ru_maxrss / 1024.0;             // in KB
+#endif
+#endif
+    }
+
+    // subsamples the cloud to the centroids of the points in each (non-empty) voxel, in the order of
+    // the first point of the voxels. Returns false if the voxels are too small to pack their coordinates.
+    bool voxel_subsample(const PointCloud* cloud, double voxelSize, PointCloud* result) {
+        const std::vector<vec3>& points = cloud->points();
+        if (points.empty() || !(voxelSize > 0))
+            return false;
+        Box3 box;
+        for (const auto& p : points)
+            box.add_point(p);
+        const vec3 pMin = box.min();
+        const int bits = 21;
+        for (int k = 0; k < 3; ++k) {
+            if (box.range(k) / voxelSize >= static_cast<double>((1 << bits) - 1))
+                return false;
+        }
+
+        std::unordered_map<std::uint64_t, std::size_t> voxels;
+        std::vector<dvec3> sums;
+        std::vector<int> counts;
+        for (const auto& p : points) {
+            std::uint64_t key = 0;
+            for (int k = 0; k < 3; ++k)
+                key = (key << bits) | static_cast<std::uint64_t>(std::floor((p[k] - pMin[k]) / voxelSize));
+            auto pos = voxels.insert(std::make_pair(key, sums.size()));
+            if (pos.second) {
+                sums.push_back(dvec3(0, 0, 0));
+                counts.push_back(0);
+            }
+            sums[pos.first->second] += dvec3(p.x, p.y, p.z);
+            ++counts[pos.first->second];
+        }
+
+        result->clear();
+        for (std::size_t i = 0; i < sums.size(); ++i) {
+            const dvec3 c = sums[i] / counts[i];
+            result->add_vertex(vec3(static_cast<float>(c.x), static_cast<float>(c.y), static_cast<float>(c.z)));
+        }
+        return true;
+    }
+
+    // rotates v around the unit axis by the angle with the given cosine and sine. This is
+    // mat4::rotation(axis, angle) * v evaluated in the same order, without building the matrix.
+    inline vec3 rotate(const vec3& axis, float c, float s, const vec3& v) {
+        const float rc = 1.0f - c;
+        const float x = axis.x, y = axis.y, z = axis.z;
+        // identity * c + cross-product matrix * s + tensor product * rc
+        const float m00 = c + (x * x) * rc;
+        const float m01 = (-z * s) + (x * y) * rc;
+        const float m02 = (y * s) + (x * z) * rc;
+        const float m10 = (z * s) + (y * x) * rc;
+        const float m11 = c + (y * y) * rc;
+        const float m12 = (-x * s) + (y * z) * rc;
+        const float m20 = (-y * s) + (z * x) * rc;
+        const float m21 = (x * s) + (z * y) * rc;
+        const float m22 = c + (z * z) * rc;
+        return vec3(0.0f + m00 * v.x + m01 * v.y + m02 * v.z,
+                    0.0f + m10 * v.x + m11 * v.y + m12 * v.z,
+                    0.0f + m20 * v.x + m21 * v.y + m22 * v.z);
+    }
+}
+
 Skeleton::Skeleton() 
-    : Points_(nullptr)
-    , KDtree_(nullptr)
+    : KDtree_(nullptr)
     , quiet_(true)
+    , fit_branches_(false)
+    , lod_tolerance_(0.0)
+    , cap_branches_(false)
+    , leaf_seed_(0)
+    , has_input_stats_(false)
+    , release_intermediates_(false)
+    , stage_memory_peak_(false)
+    , memory_mark_(0)
+    , voxel_size_(0.0)
+    , tet_slab_size_(0)
+    , engine_(ENGINE_DELAUNAY)
+    , resume_stage_(STAGE_NONE)
 {
 	TrunkRadius_ = 0;
 	TreeHeight_ = 0;
@@ -58,13 +250,50 @@ Skeleton::~Skeleton()
 {
 	if (KDtree_)
 		delete KDtree_;
-	if (Points_)
-		delete Points_;
 	if (VecLeaves_.size() > 0)
 		VecLeaves_.clear();
 }
 
 
+void Skeleton::reset()
+{
+	if (KDtree_)
+		delete KDtree_;
+	KDtree_ = nullptr;
+	has_input_stats_ = false;
+
+	// clear() keeps the capacity of the vectors (and the vertex storage of the graphs)
+	Points_.clear();
+	EdgePoints_.clear();
+	delaunay_.clear();
+	MST_.clear();
+	simplified_skeleton_.clear();
+	smoothed_skeleton_.clear();
+	branches_.clear();
+	VecLeaves_.clear();
+
+	stage_memory_.clear();
+	resume_stage_ = STAGE_NONE;
+	previous_ = PreviousTree();
+	RootV_ = 0;
+	SimplifiedRootV_ = 0;
+	RootPos_ = Vector3D(0, 0, 0);
+	TrunkRadius_ = 0;
+	TreeHeight_ = 0;
+	BoundingDistance_ = 0;
+}
+
+
+void Skeleton::set_input(const CloudStatistics& stats, KdTree* kdtree)
+{
+	input_stats_ = stats;
+	has_input_stats_ = true;
+	if (KDtree_ && KDtree_ != kdtree)
+		delete KDtree_;
+	KDtree_ = kdtree;
+}
+
+
 bool Skeleton::build_delaunay(const PointCloud* cloud)
 {
 	//initialize
@@ -75,7 +304,7 @@ bool Skeleton::build_delaunay(const PointCloud* cloud)
         std::cout << "read vertices into the delaunay..." << std::endl;
 	int nPoints = cloud->n_vertices();
 	PointCloud::VertexProperty<vec3> points = cloud->get_vertex_property<vec3>("v:point");
-    std::vector<Vector3D> newVertices = centralize_main_points(const_cast<PointCloud*>(cloud));
+    const std::vector<Vector3D>& newVertices = centralize_main_points(const_cast<PointCloud*>(cloud));
 	for (int i = 0; i < nPoints; i++)
 	{
 		SGraphVertexProp pV;
@@ -88,6 +317,15 @@ bool Skeleton::build_delaunay(const PointCloud* cloud)
 	// Generate graph edges
     if (!quiet_)
         std::cout << "generate delaunay edges..." << std::endl;
+	if (tet_slab_size_ > 0 && nPoints > tet_slab_size_)
+	{
+		if (add_slab_delaunay_edges(cloud))
+		{
+			compute_delaunay_weight();
+			return true;
+		}
+		std::cerr << "the points could not be triangulated in slabs, they are triangulated at once" << std::endl;
+	}
 	tetgenio tet_in, tet_out;
 	tet_in.numberofpoints = nPoints;
 	tet_in.pointlist = new REAL[tet_in.numberofpoints * 3];
@@ -120,6 +358,108 @@ bool Skeleton::build_delaunay(const PointCloud* cloud)
 }
 
 
+bool Skeleton::add_slab_delaunay_edges(const PointCloud* cloud)
+{
+	//the points are partitioned into height slabs of tet_slab_size_ points, each extended by 10% on both sides
+	//such that neighboring slabs overlap. The Delaunay edges of a slab are reduced to its minimum spanning
+	//tree (Kruskal's algorithm, with the squared lengths as weights). This only bounds the memory of the
+	//triangulation (the tetrahedra and the edges of one slab at a time): the points, the kd-tree and the
+	//graph of all the points are still in memory.
+	const std::vector<vec3>& points = cloud->points();
+	const int nPoints = static_cast<int>(points.size());
+	std::vector<int> order(nPoints);
+	for (int i = 0; i < nPoints; i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&points](int a, int b) { return points[a].z < points[b].z; });
+
+	const int overlap = std::max(tet_slab_size_ / 10, 1);
+	struct SlabEdge { float weight; int a, b; };
+	std::vector<SlabEdge> slabEdges;
+	std::vector<int> parent;
+	std::vector< std::pair<int, int> > treeEdges;
+	auto find_root = [&parent](int i) -> int {
+		while (parent[i] != i)
+			i = parent[i] = parent[parent[i]];
+		return i;
+	};
+
+	//the minimum spanning tree of the points [first, last) of the order, false if they cannot be triangulated
+	auto add_slab = [&](int first, int last) -> bool {
+		const int nSlab = last - first;
+		if (nSlab < 4)
+			return false;
+		tetgenio tet_in, tet_out;
+		tet_in.numberofpoints = nSlab;
+		tet_in.pointlist = new REAL[nSlab * 3];
+		for (int i = 0; i < nSlab; i++)
+		{
+			const vec3& p = points[order[first + i]];
+			tet_in.pointlist[i * 3 + 0] = p.x;
+			tet_in.pointlist[i * 3 + 1] = p.y;
+			tet_in.pointlist[i * 3 + 2] = p.z;
+		}
+		const std::string str("Q");
+		try {
+			tetrahedralize(const_cast<char*>(str.c_str()), &tet_in, &tet_out);
+		}
+		catch (int) {	// e.g., all the points of the slab are coplanar
+			return false;
+		}
+		if (tet_out.numberoftetrahedra == 0)
+			return false;
+
+		//the edges of the tetrahedra (between local indices), each once
+		slabEdges.clear();
+		for (long nTet = 0; nTet < tet_out.numberoftetrahedra; nTet++)
+		{
+			long tet_first = nTet * tet_out.numberofcorners;
+			for (long i = tet_first; i < tet_first + tet_out.numberofcorners; i++)
+				for (long j = i + 1; j < tet_first + tet_out.numberofcorners; j++)
+				{
+					const int a = std::min(tet_out.tetrahedronlist[i], tet_out.tetrahedronlist[j]);
+					const int b = std::max(tet_out.tetrahedronlist[i], tet_out.tetrahedronlist[j]);
+					SlabEdge e = { points[order[first + a]].distance2(points[order[first + b]]), a, b };
+					slabEdges.push_back(e);
+				}
+		}
+		std::sort(slabEdges.begin(), slabEdges.end(), [](const SlabEdge& e1, const SlabEdge& e2) {
+			return e1.weight < e2.weight || (e1.weight == e2.weight && (e1.a < e2.a || (e1.a == e2.a && e1.b < e2.b)));
+		});
+
+		parent.resize(nSlab);
+		for (int i = 0; i < nSlab; i++)
+			parent[i] = i;
+		for (const SlabEdge& e : slabEdges)
+		{
+			const int ra = find_root(e.a), rb = find_root(e.b);
+			if (ra == rb)
+				continue;
+			parent[ra] = rb;
+			treeEdges.push_back(std::make_pair(order[first + e.a], order[first + e.b]));
+		}
+		return true;
+	};
+
+	//a slab that cannot be triangulated (e.g., a flat ground) is merged with the next one
+	for (int begin = 0; begin < nPoints; )
+	{
+		int size = tet_slab_size_;
+		while (!add_slab(std::max(begin - overlap, 0), std::min(begin + size + overlap, nPoints)))
+		{
+			if (begin + size >= nPoints)
+				return false;
+			size += tet_slab_size_;
+		}
+		begin += size;
+	}
+	std::vector<SlabEdge>().swap(slabEdges);
+
+	for (const auto& e : treeEdges)
+		add_edge(vertex(e.first, delaunay_), vertex(e.second, delaunay_), delaunay_);
+	return true;
+}
+
+
 bool Skeleton::extract_mst()
 {
 	//initialize
@@ -146,8 +486,10 @@ bool Skeleton::extract_mst()
 	//Find the spanning tree edges with minimum sum distance
     if (!quiet_)
         std::cout << "compute the shortest spanning tree..." << std::endl;
-    std::vector<double> distances(num_vertices(delaunay_));
-    std::vector<SGraphVertexDescriptor> vecParent(num_vertices(delaunay_));
+    std::vector<double>& distances = workspace_.distances;
+    std::vector<SGraphVertexDescriptor>& vecParent = workspace_.parents;
+    distances.assign(num_vertices(delaunay_), 0.0);
+    vecParent.assign(num_vertices(delaunay_), 0);
     dijkstra_shortest_paths(delaunay_, RootV_, weight_map(get(&SGraphEdgeProp::nWeight, delaunay_))
 		.distance_map(&distances[0])
 		.predecessor_map(&(vecParent[0])));
@@ -160,7 +502,6 @@ bool Skeleton::extract_mst()
 			SGraphEdgeProp pEdge;
 			pEdge.nWeight = 0.0;
 			pEdge.nRadius = 0.0;
-			pEdge.vecPoints.clear();
             add_edge(vertex(nP, MST_), vertex(vecParent.at(nP), MST_), pEdge, MST_);
 		}
         MST_[vertex(nP, MST_)].nParent = vecParent.at(nP);
@@ -181,7 +522,7 @@ bool Skeleton::simplify_skeleton()
 {
     if (!quiet_)
         std::cout << "step 1: eliminate unimportant small edges" << std::endl;
-    keep_main_skeleton(&MST_, 0.019);
+    keep_main_skeleton(&MST_, params_.subtree_threshold);
 
     if (!quiet_)
         std::cout << "step 2: iteratively merge collapsed edges" << std::endl;
@@ -202,117 +543,215 @@ bool Skeleton::smooth_skeleton()
     }
 
     smoothed_skeleton_.clear();
+    branches_.clear();
     if (!quiet_)
         std::cout << "smoothing skeleton..." << std::endl;
 
     // get paths
     std::vector<Path> pathList;
     get_graph_for_smooth(pathList);
+    const int nPaths = static_cast<int>(pathList.size());
+
+    // the order of a path is one more than the order of the path it starts from (the paths are
+    // listed after the ones they start from, and the first one is the trunk)
+    std::vector<int> vertexOrder(num_vertices(simplified_skeleton_), 0);
+    std::vector<int> pathOrder(nPaths, 0);
+    for (int n_path = 0; n_path < nPaths; ++n_path)
+    {
+        const Path& currentPath = pathList[n_path];
+        pathOrder[n_path] = (n_path == 0) ? 0 : vertexOrder[currentPath.front()] + 1;
+        for (std::size_t n_node = 1; n_node < currentPath.size(); ++n_node)
+            vertexOrder[currentPath[n_node]] = pathOrder[n_path];
+    }
+
+    // fit a hermite curve to each edge of the paths
+    std::vector< std::vector<HermiteSegment> > segments(nPaths);
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int n_path = 0; n_path < nPaths; ++n_path)
+        fit_hermite_segments(pathList[n_path], segments[n_path]);
 
-    // for each path get its coordinates and generate a smooth curve
-    for (std::size_t n_path = 0; n_path < pathList.size(); ++n_path)
+    // the sample parameters t = n / nSamples of all the sample counts, computed once
+    int maxSamples = 0;
+    for (int n_path = 0; n_path < nPaths; ++n_path)
     {
-        Path currentPath = pathList[n_path];
-        std::vector<vec3> interpolatedPoints;
-        std::vector<double> interpolatedRadii;
-        static int numOfSlices = 20;
-        std::vector<int> numOfSlicesCurrent;
-        // retrieve the current path and its vertices
-        for (std::size_t n_node = 0; n_node < currentPath.size() - 1; ++n_node)
+        for (std::size_t i = 0; i < segments[n_path].size(); ++i)
+            maxSamples = std::max(maxSamples, segments[n_path][i].nSamples);
+    }
+    std::vector<int> tableBegin(maxSamples + 1, -1);
+    std::vector<float> parameters;
+    for (int n_path = 0; n_path < nPaths; ++n_path)
+    {
+        for (std::size_t i = 0; i < segments[n_path].size(); ++i)
         {
-            SGraphVertexDescriptor sourceV = currentPath[n_node];
-            SGraphVertexDescriptor targetV = currentPath[n_node + 1];
-            vec3 pSource = simplified_skeleton_[sourceV].cVert;
-            vec3 pTarget = simplified_skeleton_[targetV].cVert;
-            float branchlength = easy3d::distance(pSource, pTarget);
-            numOfSlicesCurrent.push_back(std::max(static_cast<int>(branchlength * numOfSlices), 2));
-
-            // compute the tangents
-            vec3 tangentOfSorce;
-            vec3 tangentOfTarget;
-            // if the source vertex is the root
-            if (sourceV == simplified_skeleton_[sourceV].nParent)
-                tangentOfSorce = (pTarget - pSource).normalize();
-            else
-            {
-                SGraphVertexDescriptor parentOfSource = simplified_skeleton_[sourceV].nParent;
-                tangentOfSorce = (pTarget - simplified_skeleton_[parentOfSource].cVert).normalize();
-            }
-            // if the target vertex is leaf
-            if ((out_degree(targetV, simplified_skeleton_) == 1) && (targetV != simplified_skeleton_[targetV].nParent))
-                tangentOfTarget = (pTarget - pSource).normalize();
-            else
-            {
-                SGraphVertexDescriptor childOfTarget = currentPath[n_node + 2];
-                tangentOfTarget = (simplified_skeleton_[childOfTarget].cVert - pSource).normalize();
-            }
+            const int nSamples = segments[n_path][i].nSamples;
+            if (tableBegin[nSamples] >= 0)
+                continue;
+            tableBegin[nSamples] = static_cast<int>(parameters.size());
+            for (int n = 0; n < nSamples; ++n)
+                parameters.push_back(static_cast<float>(static_cast<double>(n) / nSamples));
+        }
+    }
 
-            tangentOfSorce *= branchlength;
-            tangentOfTarget *= branchlength;
-
-            //fit hermite curve
-            vec3 A = tangentOfTarget + tangentOfSorce + 2 * (pSource - pTarget);
-            vec3 B = 3 * (pTarget - pSource) - 2 * tangentOfSorce - tangentOfTarget;
-            vec3 C = tangentOfSorce;
-            vec3 D = pSource;
-            SGraphEdgeDescriptor currentE = edge(sourceV, targetV, simplified_skeleton_).first;
-            double sourceRadius = simplified_skeleton_[currentE].nRadius;
-            double targetRadius = sourceRadius;
-            SGraphVertexDescriptor ParentVert = simplified_skeleton_[sourceV].nParent;
-            if (ParentVert != sourceV)
-            {
-                SGraphEdgeDescriptor ParentEdge = edge(ParentVert, sourceV, simplified_skeleton_).first;
-                sourceRadius = simplified_skeleton_[ParentEdge].nRadius;
-            }
-            double deltaOfRadius = (sourceRadius - targetRadius) / numOfSlicesCurrent[numOfSlicesCurrent.size() - 1];
-            //generate interpolated points
-            for (std::size_t n = 0; n < numOfSlicesCurrent[numOfSlicesCurrent.size() - 1]; ++n)
+    // sample the curves of each path into a branch
+    branches_.resize(nPaths);
+#pragma omp parallel
+    {
+        std::vector<float> x, y, z;
+#pragma omp for schedule(dynamic, 16)
+        for (int n_path = 0; n_path < nPaths; ++n_path)
+        {
+            Branch& branch = branches_[n_path];
+            branch.order = pathOrder[n_path];
+            const std::vector<HermiteSegment>& pathSegments = segments[n_path];
+            for (std::size_t i = 0; i < pathSegments.size(); ++i)
             {
-                double t = static_cast<double>(static_cast<double>(n) / numOfSlicesCurrent[numOfSlicesCurrent.size() - 1]);
-                vec3 point = A * t*t*t + B * t*t + C * t + D;
-
-                if (n == 0) {
-                    interpolatedPoints.push_back(point);
-                    interpolatedRadii.push_back(sourceRadius - n * deltaOfRadius);
+                //the components of all the samples are evaluated in separate loops, which the compiler can
+                //vectorize. It is A * t*t*t + B * t*t + C * t + D with vec3, in the same order of operations.
+                const HermiteSegment& segment = pathSegments[i];
+                const int nSamples = segment.nSamples;
+                const float* t = parameters.data() + tableBegin[nSamples];
+                x.resize(nSamples);
+                y.resize(nSamples);
+                z.resize(nSamples);
+                float* out[3] = { x.data(), y.data(), z.data() };
+                for (int k = 0; k < 3; ++k)
+                {
+                    const float a = segment.A[k], b = segment.B[k], c = segment.C[k], d = segment.D[k];
+                    float* values = out[k];
+                    for (int n = 0; n < nSamples; ++n)
+                        values[n] = ((a * t[n]) * t[n]) * t[n] + (b * t[n]) * t[n] + c * t[n] + d;
                 }
-                else {
-                    const vec3& prev = interpolatedPoints.back();
-                    if (distance2(prev, point) > epsilon<float>() * 10) { // in case of duplicated points (tiny cylinder)
-                        interpolatedPoints.push_back(point);
-                        interpolatedRadii.push_back(sourceRadius - n * deltaOfRadius);
+
+                for (int n = 0; n < nSamples; ++n)
+                {
+                    const vec3 point(x[n], y[n], z[n]);
+                    bool keep = branch.points.empty();
+                    if (!keep && n == 0)    // the start of an edge is only dropped if it coincides with the previous point
+                        keep = easy3d::distance(branch.points.back(), point) >= epsilon<float>();
+                    else if (!keep)         // in case of duplicated points (tiny cylinder)
+                        keep = distance2(branch.points.back(), point) > epsilon<float>() * 10;
+                    if (keep) {
+                        branch.points.push_back(point);
+                        branch.radii.push_back(segment.sourceRadius - n * segment.deltaOfRadius);
                     }
                 }
             }
+
+            //push back the last vertex
+            const vec3& point = simplified_skeleton_[pathList[n_path].back()].cVert;
+            if (!branch.points.empty() && distance2(branch.points.back(), point) > epsilon<float>() * 10) { // in case of duplicated points (tiny cylinder)
+                branch.points.push_back(point);
+                branch.radii.push_back(0);
+            }
         }
-        //push back the last vertex
-        SGraphVertexDescriptor endV = currentPath.back();
-        const vec3& prev = interpolatedPoints.back();
-        const vec3& point = simplified_skeleton_[endV].cVert;
-        if (distance2(prev, point) > epsilon<float>() * 10) { // in case of duplicated points (tiny cylinder)
-            interpolatedPoints.push_back(point);
-            interpolatedRadii.push_back(0);
-        }
+    }
+
+    // too few points to construct a cylinder
+    std::size_t nBranches = 0;
+    for (std::size_t i = 0; i < branches_.size(); ++i)
+    {
+        if (branches_[i].points.size() < 2)
+            continue;
+        if (nBranches != i)
+            std::swap(branches_[nBranches], branches_[i]);
+        ++nBranches;
+    }
+    branches_.resize(nBranches);
+
+    return true;
+}
+
 
-		if (interpolatedPoints.size() < 2)
-			continue; // Too few points to construct a cylinder
-
-        // add vertices
-        std::vector<SGraphVertexDescriptor> vertices;
-        for (std::size_t np = 0; np < interpolatedPoints.size(); np++) {
-            SGraphVertexProp vp;
-            vp.cVert = interpolatedPoints[np];
-            vp.radius = interpolatedRadii[np];
-            SGraphVertexDescriptor v = add_vertex(vp, smoothed_skeleton_);
-            vertices.push_back(v);
+void Skeleton::fit_hermite_segments(const Path& currentPath, std::vector<HermiteSegment>& segments) const
+{
+    const int numOfSlices = params_.smoothing_slices;
+    // retrieve the current path and its vertices
+    for (std::size_t n_node = 0; n_node < currentPath.size() - 1; ++n_node)
+    {
+        SGraphVertexDescriptor sourceV = currentPath[n_node];
+        SGraphVertexDescriptor targetV = currentPath[n_node + 1];
+        vec3 pSource = simplified_skeleton_[sourceV].cVert;
+        vec3 pTarget = simplified_skeleton_[targetV].cVert;
+        float branchlength = easy3d::distance(pSource, pTarget);
+
+        // compute the tangents
+        vec3 tangentOfSorce;
+        vec3 tangentOfTarget;
+        // if the source vertex is the root
+        if (sourceV == simplified_skeleton_[sourceV].nParent)
+            tangentOfSorce = (pTarget - pSource).normalize();
+        else
+        {
+            SGraphVertexDescriptor parentOfSource = simplified_skeleton_[sourceV].nParent;
+            tangentOfSorce = (pTarget - simplified_skeleton_[parentOfSource].cVert).normalize();
+        }
+        // if the target vertex is leaf
+        if ((out_degree(targetV, simplified_skeleton_) == 1) && (targetV != simplified_skeleton_[targetV].nParent))
+            tangentOfTarget = (pTarget - pSource).normalize();
+        else
+        {
+            SGraphVertexDescriptor childOfTarget = currentPath[n_node + 2];
+            tangentOfTarget = (simplified_skeleton_[childOfTarget].cVert - pSource).normalize();
         }
 
-        // add edges
-        for (std::size_t np = 0; np < vertices.size() - 1; np++) {
-            add_edge(vertices[np], vertices[np + 1], SGraphEdgeProp(), smoothed_skeleton_);
+        tangentOfSorce *= branchlength;
+        tangentOfTarget *= branchlength;
+
+        //fit hermite curve
+        HermiteSegment segment;
+        const vec3 A = tangentOfTarget + tangentOfSorce + 2 * (pSource - pTarget);
+        const vec3 B = 3 * (pTarget - pSource) - 2 * tangentOfSorce - tangentOfTarget;
+        segment.A = A;
+        segment.B = B;
+        segment.C = tangentOfSorce;
+        segment.D = pSource;
+        SGraphEdgeDescriptor currentE = edge(sourceV, targetV, simplified_skeleton_).first;
+        double sourceRadius = simplified_skeleton_[currentE].nRadius;
+        double targetRadius = sourceRadius;
+        SGraphVertexDescriptor ParentVert = simplified_skeleton_[sourceV].nParent;
+        if (ParentVert != sourceV)
+        {
+            SGraphEdgeDescriptor ParentEdge = edge(ParentVert, sourceV, simplified_skeleton_).first;
+            sourceRadius = simplified_skeleton_[ParentEdge].nRadius;
         }
+        if (lod_tolerance_ > 0) {
+            //the chord error of n uniform samples of the curve is bounded by max|P''| / (8 n^2), where
+            //|P''| = |6At + 2B| is maximal at one of the ends. On the surface, it is scaled by (1 + r * curvature).
+            const double secondDerivative = std::max(length(2 * B), length(6 * A + 2 * B));
+            const double curvature = secondDerivative / std::max(branchlength * branchlength, epsilon<float>());
+            const double radius = std::max(sourceRadius, targetRadius);
+            const double error = secondDerivative * (1.0 + radius * curvature) / (8.0 * lod_tolerance_);
+            segment.nSamples = std::max(static_cast<int>(std::ceil(std::sqrt(error))), 1);
+        }
+        else
+            segment.nSamples = std::max(static_cast<int>(branchlength * numOfSlices), 2);
+        segment.sourceRadius = sourceRadius;
+        segment.deltaOfRadius = (sourceRadius - targetRadius) / segment.nSamples;
+        segments.push_back(segment);
     }
+}
 
-    return true;
+
+const Graph* Skeleton::get_smoothed_skeleton() const
+{
+    //the graph of the branches is only needed to display or save the skeleton, so it is built on demand
+    if (num_vertices(smoothed_skeleton_) == 0)
+    {
+        for (std::size_t i = 0; i < branches_.size(); ++i)
+        {
+            const Branch& branch = branches_[i];
+            for (std::size_t np = 0; np < branch.points.size(); np++) {
+                SGraphVertexProp vp;
+                vp.cVert = branch.points[np];
+                vp.radius = branch.radii[np];
+                vp.order = branch.order;
+                SGraphVertexDescriptor v = add_vertex(vp, smoothed_skeleton_);
+                if (np > 0)
+                    add_edge(v - 1, v, SGraphEdgeProp(), smoothed_skeleton_);
+            }
+        }
+    }
+    return &smoothed_skeleton_;
 }
 
 
@@ -330,6 +769,12 @@ bool Skeleton::compute_branch_radius()
         std::cout << "step 3: adjust the radius for all left branches" << std::endl;
     compute_all_edges_radius(TrunkRadius_);
 
+    if (fit_branches_) {
+        if (!quiet_)
+            std::cout << "step 4: fit accurate radius to the first-order branches" << std::endl;
+        fit_first_order_branches();
+    }
+
     if (!quiet_)
         std::cout << "finish the branches inflation!" << std::endl;
 	return true;
@@ -348,11 +793,12 @@ bool Skeleton::add_leaves()
 	std::size_t nLeaves = leafVertices.size();
 	if (VecLeaves_.size() > 0)
 		VecLeaves_.clear();
-	//generate leaves for each leaf vertex
+	//generate leaves for each leaf vertex, with a generator of this reconstruction only
+	std::mt19937 rng(leaf_seed_);
 	for (std::size_t i = 0; i < nLeaves; i++)
 	{
 		SGraphVertexDescriptor currentLeafVertex = leafVertices.at(i);
-        generate_leaves(currentLeafVertex, 0.05);
+        generate_leaves(currentLeafVertex, 0.05, rng);
 	}
 
     if (!quiet_)
@@ -366,51 +812,63 @@ void Skeleton::keep_main_skeleton(Graph *i_Graph, double subtree_Threshold)
 	//initialize
     simplified_skeleton_.clear();
 
-	//read vertices into the fine graph
-	std::pair<SGraphVertexIterator, SGraphVertexIterator> vp = vertices(*i_Graph);
-	for (SGraphVertexIterator cIter = vp.first; cIter != vp.second; ++cIter)
+	//find the main edges with sufficient subtree length. Only the subtrees of the kept vertices are
+	//considered, in the same order as a depth-first traversal of the kept edges.
+	SkeletonTraversal traversal(*i_Graph, RootV_);
+	std::vector<unsigned char> kept(num_vertices(*i_Graph), 0);
+	std::vector<SGraphEdgeDescriptor>& keptEdges = workspace_.keptEdges;
+	keptEdges.clear();
+	kept[RootV_] = 1;
+	traversal.for_each_top_down([&](SGraphVertexDescriptor currentV) {
+		if (!kept[currentV])
+			return;
+		for (const SGraphVertexDescriptor* child = traversal.children_begin(currentV); child != traversal.children_end(currentV); ++child)
+		{
+			double child2Current = std::sqrt((*i_Graph)[currentV].cVert.distance2((*i_Graph)[*child].cVert));
+			double subtreeRatio = ((*i_Graph)[*child].lengthOfSubtree + child2Current) / (*i_Graph)[currentV].lengthOfSubtree;
+			if (subtreeRatio >= subtree_Threshold)
+			{
+				keptEdges.push_back(edge(*child, currentV, (*i_Graph)).first);
+				kept[*child] = 1;
+			}
+		}
+	});
+
+	//read only the kept vertices into the fine graph. They keep their order, so the later stages visit
+	//them in the same order as if all the vertices were there.
+	std::vector<SGraphVertexDescriptor>& index = workspace_.keptIndex;
+	index.assign(num_vertices(*i_Graph), 0);
+	SGraphVertexDescriptor nKept = 0;
+	for (SGraphVertexDescriptor v = 0; v < kept.size(); ++v)
 	{
+		if (kept[v])
+			index[v] = nKept++;
+	}
+	for (SGraphVertexDescriptor v = 0; v < kept.size(); ++v)
+	{
+		if (!kept[v])
+			continue;
 		SGraphVertexProp pV;
-		pV.cVert = (*i_Graph)[*cIter].cVert;
-		pV.nParent = (*i_Graph)[*cIter].nParent;
-		pV.lengthOfSubtree = (*i_Graph)[*cIter].lengthOfSubtree;
+		pV.cVert = (*i_Graph)[v].cVert;
+		pV.nParent = index[(*i_Graph)[v].nParent];
+		pV.lengthOfSubtree = (*i_Graph)[v].lengthOfSubtree;
         add_vertex(pV, simplified_skeleton_);
 	}
+	SimplifiedRootV_ = index[RootV_];
 
-	//read main edges with sufficient subtree length
-	std::vector<SGraphVertexDescriptor> stack;
-	stack.push_back(RootV_);
-	while (true)
+	for (std::size_t i = 0; i < keptEdges.size(); ++i)
 	{
-		SGraphVertexDescriptor currentV = stack.back();
-		stack.pop_back();
-		std::pair<SGraphAdjacencyIterator, SGraphAdjacencyIterator> aj = adjacent_vertices(currentV, *i_Graph);
-		for (SGraphAdjacencyIterator aIter = aj.first; aIter != aj.second; ++aIter)
-		{
-			if (*aIter != (*i_Graph)[currentV].nParent)
-			{
-				double child2Current = std::sqrt((*i_Graph)[currentV].cVert.distance2((*i_Graph)[*aIter].cVert));
-				double subtreeRatio = ((*i_Graph)[*aIter].lengthOfSubtree + child2Current) / (*i_Graph)[currentV].lengthOfSubtree;
-				if (subtreeRatio >= subtree_Threshold)
-				{
-					SGraphEdgeProp pEdge;
-					SGraphEdgeDescriptor sEdge = edge(*aIter, currentV, (*i_Graph)).first;
-					pEdge.nWeight = (*i_Graph)[sEdge].nWeight;
-					pEdge.nRadius = (*i_Graph)[sEdge].nRadius;
-					pEdge.vecPoints = (*i_Graph)[sEdge].vecPoints;
-					SGraphVertexDescriptor dSource = source(sEdge, *i_Graph);
-					SGraphVertexDescriptor dTarget = target(sEdge, *i_Graph);
-                    add_edge(dSource, dTarget, pEdge, simplified_skeleton_);
-					stack.push_back(*aIter);
-				}
-			}
-		}
-		if (stack.size() == 0)
-			break;
+		const SGraphEdgeDescriptor sEdge = keptEdges[i];
+		SGraphEdgeProp pEdge;
+		pEdge.nWeight = (*i_Graph)[sEdge].nWeight;
+		pEdge.nRadius = (*i_Graph)[sEdge].nRadius;
+		pEdge.nPointsBegin = (*i_Graph)[sEdge].nPointsBegin;
+		pEdge.nPointsCount = (*i_Graph)[sEdge].nPointsCount;
+		add_edge(index[source(sEdge, *i_Graph)], index[target(sEdge, *i_Graph)], pEdge, simplified_skeleton_);
 	}
 
 	//update the length of subtree and weights for all vertices and edges
-    compute_length_of_subtree(&simplified_skeleton_, RootV_);
+    compute_length_of_subtree(&simplified_skeleton_, SimplifiedRootV_);
     compute_graph_edges_weight(&simplified_skeleton_);
     compute_all_edges_radius(TrunkRadius_);
 	return;
@@ -419,41 +877,53 @@ void Skeleton::keep_main_skeleton(Graph *i_Graph, double subtree_Threshold)
 
 void Skeleton::merge_collapsed_edges()
 {
-	//start checking collapsed edges all over the graph
-    std::pair<SGraphVertexIterator, SGraphVertexIterator> vp = vertices(simplified_skeleton_);
-	bool bChange = true;
+	//start checking collapsed edges all over the graph. A vertex is checked again only if a
+	//merge changed its neighborhood; the vertices are visited in the same order as repeated
+	//sweeps over the whole graph would do, so the result does not depend on the worklist.
+	std::set<SGraphVertexDescriptor> currentSweep, nextSweep;
+	std::pair<SGraphVertexIterator, SGraphVertexIterator> vp = vertices(simplified_skeleton_);
+	currentSweep.insert(vp.first, vp.second);
+	std::vector<SGraphVertexDescriptor> affected;
 	int numComplex = 0;
-	while (bChange)
+	while (!currentSweep.empty())
 	{
-		bChange = false;
-		for (SGraphVertexIterator cIter = vp.first; cIter != vp.second; ++cIter)
+		while (!currentSweep.empty())
 		{
-			SGraphVertexDescriptor dVertex = *cIter;
+			SGraphVertexDescriptor dVertex = *currentSweep.begin();
+			currentSweep.erase(currentSweep.begin());
+			affected.clear();
+			bool bChange = false;
 			//if the current vertex has multiple children vertices
-            if ((out_degree(dVertex, simplified_skeleton_) > 2) ||
-            ((simplified_skeleton_[dVertex].nParent == dVertex) && (out_degree(dVertex, simplified_skeleton_) > 1)))
+			if ((out_degree(dVertex, simplified_skeleton_) > 2) ||
+			((simplified_skeleton_[dVertex].nParent == dVertex) && (out_degree(dVertex, simplified_skeleton_) > 1)))
 			{
-                if (check_overlap_child_vertex(&simplified_skeleton_, dVertex))
-				{
-					bChange = true;
-					numComplex++;
-				}
+				bChange = check_overlap_child_vertex(&simplified_skeleton_, dVertex, &affected);
 			}
 			//if the current vertex has only one single child vertex
-            else if ((out_degree(dVertex, simplified_skeleton_) == 2) &&
-            (simplified_skeleton_[dVertex].nParent != dVertex))
+			else if ((out_degree(dVertex, simplified_skeleton_) == 2) &&
+			(simplified_skeleton_[dVertex].nParent != dVertex))
 			{
-                if (check_single_child_vertex(&simplified_skeleton_, dVertex))
+				bChange = check_single_child_vertex(&simplified_skeleton_, dVertex, &affected);
+			}
+
+			if (bChange)
+			{
+				numComplex++;
+				//vertices after the current one are still visited in this sweep, the others in the next one
+				for (std::size_t i = 0; i < affected.size(); ++i)
 				{
-					bChange = true;
-					numComplex++;
+					if (affected[i] > dVertex)
+						currentSweep.insert(affected[i]);
+					else
+						nextSweep.insert(affected[i]);
 				}
 			}
 		}
+		currentSweep.swap(nextSweep);
 	}
 
 	//update the length of subtree and weights for all vertices and edges
-    compute_length_of_subtree(&simplified_skeleton_, RootV_);
+    compute_length_of_subtree(&simplified_skeleton_, SimplifiedRootV_);
     compute_graph_edges_weight(&simplified_skeleton_);
     compute_all_edges_radius(TrunkRadius_);
 
@@ -461,7 +931,7 @@ void Skeleton::merge_collapsed_edges()
 }
 
 
-bool Skeleton::check_overlap_child_vertex(Graph* i_Graph, SGraphVertexDescriptor i_dVertex)
+bool Skeleton::check_overlap_child_vertex(Graph* i_Graph, SGraphVertexDescriptor i_dVertex, std::vector<SGraphVertexDescriptor>* o_affected)
 {
 	//initialize
 	double nMinMergeValue = DBL_MAX;
@@ -483,16 +953,32 @@ bool Skeleton::check_overlap_child_vertex(Graph* i_Graph, SGraphVertexDescriptor
 			vecChilds.push_back(currentV);
 	}
 
+	//cache the direction, length and radius of the edges to the children
+	std::vector<vec3> vecDirs(vecChilds.size());
+	std::vector<double> vecLengths(vecChilds.size());
+	std::vector<double> vecRadii(vecChilds.size());
+	for (std::size_t i = 0; i < vecChilds.size(); i++)
+	{
+		vecDirs[i] = (*i_Graph)[vecChilds[i]].cVert - (*i_Graph)[i_dVertex].cVert;
+		vecLengths[i] = vecDirs[i].length();
+		vecDirs[i].normalize();
+		vecRadii[i] = (*i_Graph)[edge(vecChilds[i], i_dVertex, (*i_Graph)).first].nRadius;
+	}
+
 	//traverse the children vertices and find all possible pairs
 	for (int i = 0; i < vecChilds.size() - 1; i++)
 	{
 		for (int j = i + 1; j < vecChilds.size(); j++)
 		{
 			//get the current children pair and compute the merge value
+			double alpha = dot(vecDirs[i], vecDirs[j]);
+			//if the angle is too large, then don't merge for this moment
+			if (!(alpha > 0.9))
+				continue;
 			SGraphVertexDescriptor vi = vecChilds[i];
 			SGraphVertexDescriptor vj = vecChilds[j];
-            double merge_i2j = compute_merge_value(i_Graph, vi, vj);
-            double merge_j2i = compute_merge_value(i_Graph, vj, vi);
+            double merge_i2j = compute_merge_value(vecLengths[i], vecLengths[j], alpha, vecRadii[j]);
+            double merge_j2i = compute_merge_value(vecLengths[j], vecLengths[i], alpha, vecRadii[i]);
 
 			//check and identify the pair with least similarity value
 			if (merge_i2j < merge_j2i && merge_i2j < nMinMergeValue)
@@ -513,12 +999,22 @@ bool Skeleton::check_overlap_child_vertex(Graph* i_Graph, SGraphVertexDescriptor
 	//if the merge value is too large, then don't merge
 	if (nMinMergeValue > 1.0) 
 		return false;
-	else
-        return merge_vertices(i_Graph, sourceV, targetV, 0.5, 0.5);
+
+	//the merge changes the two vertices and all their neighbors
+	if (o_affected)
+	{
+		o_affected->push_back(sourceV);
+		o_affected->push_back(targetV);
+		std::pair<SGraphAdjacencyIterator, SGraphAdjacencyIterator> adjList = adjacent_vertices(sourceV, *i_Graph);
+		o_affected->insert(o_affected->end(), adjList.first, adjList.second);
+		adjList = adjacent_vertices(targetV, *i_Graph);
+		o_affected->insert(o_affected->end(), adjList.first, adjList.second);
+	}
+	return merge_vertices(i_Graph, sourceV, targetV, 0.5, 0.5);
 }
 
 
-bool Skeleton::check_single_child_vertex(Graph* i_Graph, SGraphVertexDescriptor i_dVertex)
+bool Skeleton::check_single_child_vertex(Graph* i_Graph, SGraphVertexDescriptor i_dVertex, std::vector<SGraphVertexDescriptor>* o_affected)
 {
 	//find the only child of the current vertex
 	SGraphVertexDescriptor childV;
@@ -549,6 +1045,13 @@ bool Skeleton::check_single_child_vertex(Graph* i_Graph, SGraphVertexDescriptor
 		return false;
 	else
 	{
+		if (o_affected)
+		{
+			o_affected->push_back(i_dVertex);
+			o_affected->push_back(childV);
+			o_affected->push_back(parentV);
+		}
+
 		//clear the current vertex
 		(*i_Graph)[childV].nParent = parentV;
 		(*i_Graph)[parentV].lengthOfSubtree = (*i_Graph)[childV].lengthOfSubtree + (pParent - pChild).length();
@@ -685,27 +1188,29 @@ void Skeleton::compute_root_vertex(Graph* i_Graph)
 
 void Skeleton::compute_length_of_subtree(Graph* i_Graph, SGraphVertexDescriptor i_dVertex)
 {
-	(*i_Graph)[i_dVertex].lengthOfSubtree = 0.0;
-	std::pair<SGraphAdjacencyIterator, SGraphAdjacencyIterator> adjacency = adjacent_vertices(i_dVertex, *i_Graph);
-	for (SGraphAdjacencyIterator cIter = adjacency.first; cIter != adjacency.second; ++cIter)
-	{
-		if (*cIter != (*i_Graph)[i_dVertex].nParent)
+	//the children of a vertex are processed before the vertex itself
+	SkeletonTraversal traversal(*i_Graph, i_dVertex);
+	const bool isMST = (i_Graph == &MST_);
+	const bool isSimplified = (i_Graph == &simplified_skeleton_);
+	traversal.for_each_bottom_up([&](SGraphVertexDescriptor currentV) {
+		double lengthOfSubtree = 0.0;
+		vec3 pCurrent = (*i_Graph)[currentV].cVert;
+		for (const SGraphVertexDescriptor* child = traversal.children_begin(currentV); child != traversal.children_end(currentV); ++child)
 		{
-            compute_length_of_subtree(i_Graph, *cIter);
-			vec3 pChild = (*i_Graph)[*cIter].cVert;
-			vec3 pCurrent = (*i_Graph)[i_dVertex].cVert;
+			vec3 pChild = (*i_Graph)[*child].cVert;
 			double distance = std::sqrt(pCurrent.distance2(pChild));
-			double child_Length = (*i_Graph)[*cIter].lengthOfSubtree + distance;
-            if (i_Graph == &MST_)
-				(*i_Graph)[i_dVertex].lengthOfSubtree += child_Length;
+			double child_Length = (*i_Graph)[*child].lengthOfSubtree + distance;
+			if (isMST)
+				lengthOfSubtree += child_Length;
 			//for fine graph, a different way is used to compute the length to better represent the radius
-            else if (i_Graph == &simplified_skeleton_)
+			else if (isSimplified)
 			{
-				if ((*i_Graph)[i_dVertex].lengthOfSubtree < child_Length)
-					(*i_Graph)[i_dVertex].lengthOfSubtree = child_Length;
+				if (lengthOfSubtree < child_Length)
+					lengthOfSubtree = child_Length;
 			}
 		}
-	}
+		(*i_Graph)[currentV].lengthOfSubtree = lengthOfSubtree;
+	}, num_vertices(*i_Graph) > 100000);
 
 	return;
 }
@@ -728,7 +1233,7 @@ void Skeleton::compute_all_edges_radius(double trunkRadius)
 {
 	//find the trunk edge
 	SGraphEdgeDescriptor trunkE;
-    std::pair<SGraphOutEdgeIterator, SGraphOutEdgeIterator> listAdj = out_edges(RootV_, simplified_skeleton_);
+    std::pair<SGraphOutEdgeIterator, SGraphOutEdgeIterator> listAdj = out_edges(SimplifiedRootV_, simplified_skeleton_);
 	for (SGraphOutEdgeIterator eIter = listAdj.first; eIter != listAdj.second; ++eIter)
 	{
 		trunkE = *eIter;
@@ -762,7 +1267,12 @@ double Skeleton::compute_merge_value(Graph* i_Graph, SGraphVertexDescriptor i_dS
 	dirTarget.normalize();
 	double alpha = dot(dirSource, dirTarget);
 	double nRadiusTarget = (*i_Graph)[edge(i_dTarget, parentV, (*i_Graph)).first].nRadius;
-	
+	return compute_merge_value(nLengthSource, nLengthTarget, alpha, nRadiusTarget);
+}
+
+
+double Skeleton::compute_merge_value(double nLengthSource, double nLengthTarget, double alpha, double nRadiusTarget)
+{
 	//if the angle is smaller than 25 degrees
 	if (alpha > 0.9)
 		if(nLengthSource/nLengthTarget >= 0.5 && nLengthSource / nLengthTarget <= 2)
@@ -772,87 +1282,144 @@ double Skeleton::compute_merge_value(Graph* i_Graph, SGraphVertexDescriptor i_dS
 }
 
 
-std::vector<Vector3D> Skeleton::centralize_main_points(PointCloud* cloud)
+const std::vector<Vector3D>& Skeleton::centralize_main_points(PointCloud* cloud)
 {
     if (!quiet_)
         std::cout << "start centralizing the main-branch points" << std::endl;
 	
 	//retrive the points from the raw point cloud
-	int nPt = cloud->n_vertices();
-	if (Points_)
-		delete Points_;
-	Points_ = new Vector3D[nPt];
-	PointCloud::VertexProperty<vec3> pts = cloud->get_vertex_property<vec3>("v:point");
-	int Count = 0;
-	for (auto v : cloud->vertices())
+	load_points(cloud);
+	int nPt = static_cast<int>(Points_.size());
+
+    obtain_initial_radius(cloud);
+
+	//only the points not far from the root will be centralized
+	double epsilon = params_.centralize_range;
+	std::vector<double>& queryThreshold = workspace_.queryThreshold;
+	std::vector<unsigned char>& toCentralize = workspace_.toCentralize;
+	queryThreshold.resize(nPt);
+	toCentralize.resize(nPt);
+	for (int i = 0; i < nPt; i++)
 	{
-		Points_[Count].x = pts[v].x;
-		Points_[Count].y = pts[v].y;
-		Points_[Count].z = pts[v].z;
-		Count++;
+		double distance = (Points_[i] - RootPos_).normalize();
+		queryThreshold[i] = TrunkRadius_ * (1 - distance / BoundingDistance_); //get the query distance
+		toCentralize[i] = (distance != 0 && distance < epsilon * BoundingDistance_);
 	}
-	KDtree_ = new KdTree(Points_, nPt, 16);
 
-	//compute the density of each point 
-	std::vector<double> densityList;
-	std::vector<Vector3D> vertices;
-    obtain_initial_radius(cloud);
+	//compute the density of each point. The neighbours of the points to be centralized are
+	//kept in a compressed (CSR) list, so that each point is queried only once.
+	std::vector<double>& densityList = workspace_.densityList;
+	std::vector<int>& neighbourBegin = workspace_.neighbourBegin;
+	std::vector<int>& localOwner = workspace_.localOwner;
+	std::vector<int>& localBegin = workspace_.localBegin;
+	std::vector< std::vector<int> >& localNeighbours = workspace_.localNeighbours;
+	densityList.assign(nPt, 0.0);
+	neighbourBegin.assign(nPt + 1, 0);
+	localOwner.assign(nPt, 0);
+	localBegin.assign(nPt, 0);
+	localNeighbours.resize(std::max(static_cast<int>(localNeighbours.size()), num_threads()));
+#pragma omp parallel
+	{
+		KdTreeQuery query;
+		const int tid = thread_id();
+		std::vector<int>& local = localNeighbours[tid];
+		local.clear();
+#pragma omp for schedule(dynamic, 256)
+		for (int i = 0; i < nPt; i++)
+		{
+			double threshold = queryThreshold[i];
+			KDtree_->queryRange(query, Points_[i], threshold, true);
+			int neighbourSize = query.getNOfFoundNeighbours();
+			if (threshold != 0)
+				densityList[i] = neighbourSize / threshold;
+			if (toCentralize[i])
+			{
+				localOwner[i] = tid;
+				localBegin[i] = static_cast<int>(local.size());
+				neighbourBegin[i + 1] = neighbourSize;
+				for (int np = 0; np < neighbourSize; np++)
+					local.push_back(query.getNeighbourPositionIndex(np));
+			}
+		}
+	}
+	for (int i = 0; i < nPt; i++)
+		neighbourBegin[i + 1] += neighbourBegin[i];
+	std::vector<int>& neighbourIndices = workspace_.neighbourIndices;
+	neighbourIndices.resize(neighbourBegin[nPt]);
+#pragma omp parallel for schedule(dynamic, 256)
 	for (int i = 0; i < nPt; i++)
 	{
-		Vector3D pCurrent = Points_[i];
-		double density = 0.0;
-		double distance = (pCurrent - RootPos_).normalize();
-		double threshold = TrunkRadius_ * (1 - distance / BoundingDistance_); //get the query distance
-		KDtree_->queryRange(pCurrent, threshold, true);
-		int neighbourSize = KDtree_->getNOfFoundNeighbours();
-		if (threshold != 0) 
-			density = neighbourSize / threshold;
-		densityList.push_back(density);
+		const int* first = localNeighbours[localOwner[i]].data() + localBegin[i];
+		std::copy(first, first + (neighbourBegin[i + 1] - neighbourBegin[i]), neighbourIndices.begin() + neighbourBegin[i]);
 	}
 
 	// for each point, check if it will be centralized or not
-	double epsilon = 0.5;
+	std::vector<Vector3D>& vertices = workspace_.centralized;
+	vertices.assign(Points_.begin(), Points_.end());
+#pragma omp parallel for schedule(dynamic, 256)
 	for (int j = 0; j < nPt; j++)
 	{
-		Vector3D pCurrent = Points_[j];
-		double distance = (pCurrent - RootPos_).normalize();
-        if (distance != 0) // the point is not the root
-        {
-            //the point doesn't lie far from the root
-            if (distance < epsilon * BoundingDistance_) {
-                double ptDensity = densityList[j];
-                double dendiff = 0.0;
-                Vector3D pSum(0, 0, 0);
-                double threshold = TrunkRadius_ * (1 - distance / BoundingDistance_);
-                KDtree_->queryRange(pCurrent, threshold, true);
-                int neighbourSize = KDtree_->getNOfFoundNeighbours();
-                for (int np = 0; np < neighbourSize; np++) {
-                    int pointIndex = KDtree_->getNeighbourPositionIndex(np);
-                    double currentDensity = densityList[pointIndex];
-                    Vector3D pCurrent = Points_[pointIndex];
-                    pSum += pCurrent;
-                    dendiff += abs(currentDensity - ptDensity);
-                }
-                // compute average
-                dendiff = dendiff / neighbourSize;
-                // (looks weird but we do need this) kind of normalization
-                dendiff = dendiff / neighbourSize;
-                pSum = pSum / neighbourSize;
-                if (dendiff < 0.6) {
-                    vertices.push_back(pSum);
-                    continue;
-                }
-            }
+		if (!toCentralize[j])
+			continue;
+		double ptDensity = densityList[j];
+		double dendiff = 0.0;
+		Vector3D pSum(0, 0, 0);
+		int neighbourSize = neighbourBegin[j + 1] - neighbourBegin[j];
+		for (int np = neighbourBegin[j]; np < neighbourBegin[j + 1]; np++) {
+			int pointIndex = neighbourIndices[np];
+			double currentDensity = densityList[pointIndex];
+			Vector3D pCurrent = Points_[pointIndex];
+			pSum += pCurrent;
+			dendiff += abs(currentDensity - ptDensity);
 		}
-		vertices.push_back(pCurrent);
+		// compute average
+		dendiff = dendiff / neighbourSize;
+		// (looks weird but we do need this) kind of normalization
+		dendiff = dendiff / neighbourSize;
+		pSum = pSum / neighbourSize;
+		if (dendiff < 0.6)
+			vertices[j] = pSum;
 	}
 
 	return vertices;
 }
 
 
+void Skeleton::load_points(const PointCloud* cloud)
+{
+	int nPt = cloud->n_vertices();
+	Points_.resize(nPt);
+	PointCloud::VertexProperty<vec3> pts = cloud->get_vertex_property<vec3>("v:point");
+	int Count = 0;
+	for (auto v : cloud->vertices())
+	{
+		Points_[Count].x = pts[v].x;
+		Points_[Count].y = pts[v].y;
+		Points_[Count].z = pts[v].z;
+		Count++;
+	}
+	if (!KDtree_)	// not shared from the loading stage
+		KDtree_ = new KdTree(Points_.data(), nPt, 16);
+}
+
+
 void Skeleton::obtain_initial_radius(PointCloud* cloud)
 {
+	//already computed while loading the points
+	if (has_input_stats_) {
+		RootPos_ = Vector3D(input_stats_.lowest.x, input_stats_.lowest.y, input_stats_.lowest.z);
+		TreeHeight_ = input_stats_.height;
+		BoundingDistance_ = input_stats_.bounding_distance;
+		TrunkRadius_ = std::max((input_stats_.trunk_max_x - input_stats_.trunk_min_x), (input_stats_.trunk_max_y - input_stats_.trunk_min_y)) / 2.0;
+		if (!quiet_) {
+			std::cout << "the root vertex coordinate is:" << std::endl;
+			std::cout << RootPos_.x << " " << RootPos_.y << " " << RootPos_.z << "\n" << std::endl;
+			std::cout << "the initial radius is:" << std::endl;
+			std::cout << TrunkRadius_ << "\n" << std::endl;
+		}
+		return;
+	}
+
 	//get the lowest root point from the point cloud
 	vec3 pLowest(0, 0, FLT_MAX), pOther;
 	PointCloud::VertexProperty<vec3> points = cloud->get_vertex_property<vec3>("v:point");
@@ -927,87 +1494,102 @@ void Skeleton::assign_points_to_edges()
 		return;
 	}
 
-	//for each edge, find its corresponding points
-	SGraphEdgeDescriptor currentE;
+	//for each edge, find its corresponding points. The edges are processed in parallel and
+	//the points of all edges are collected in one array (CSR layout) in the order of the edges.
     std::pair<SGraphEdgeIterator, SGraphEdgeIterator> ep = edges(simplified_skeleton_);
-	for (SGraphEdgeIterator eIter = ep.first; eIter != ep.second; ++eIter)
+	std::vector<SGraphEdgeDescriptor> edgeList(ep.first, ep.second);
+	const int nEdges = static_cast<int>(edgeList.size());
+	std::vector<int> localOwner(nEdges, 0), localBegin(nEdges, 0), localCount(nEdges, 0);
+	std::vector< std::vector<int> > localPoints(num_threads());
+#pragma omp parallel
 	{
-		//extract two end vertices of the current edge
-		currentE = *eIter;
-        simplified_skeleton_[currentE].vecPoints.clear();
-        double currentR = simplified_skeleton_[currentE].nRadius;
-		SGraphVertexDescriptor sourceV, targetV;
-        if (source(currentE, simplified_skeleton_) == simplified_skeleton_[target(currentE, simplified_skeleton_)].nParent)
-		{
-            sourceV = source(currentE, simplified_skeleton_);
-            targetV = target(currentE, simplified_skeleton_);
-		}
-		else
-		{
-            sourceV = target(currentE, simplified_skeleton_);
-            targetV = source(currentE, simplified_skeleton_);
-		}
-        Vector3D pSource(simplified_skeleton_[sourceV].cVert.x, simplified_skeleton_[sourceV].cVert.y, simplified_skeleton_[sourceV].cVert.z);
-        Vector3D pTarget(simplified_skeleton_[targetV].cVert.x, simplified_skeleton_[targetV].cVert.y, simplified_skeleton_[targetV].cVert.z);
-		//query neighbor points from the kd tree
-		KDtree_->queryLineIntersection(pSource, pTarget, 3.5 * currentR, true, true);
-		int neighbourSize = KDtree_->getNOfFoundNeighbours();
-		for (int i = 0; i < neighbourSize; i++)
+		KdTreeQuery query;
+		const int tid = thread_id();
+		std::vector<int>& local = localPoints[tid];
+		std::vector<float> px, py, pz;
+		std::vector<unsigned char> inside;
+#pragma omp for schedule(dynamic, 16)
+		for (int ne = 0; ne < nEdges; ne++)
 		{
-			//get the current neighbor point and check if it lies within the cylinder
-			int ptIndex = KDtree_->getNeighbourPositionIndex(i);
-			Vector3D pCurrent = Points_[ptIndex];
-			Vector3D cDirPoint = pCurrent - pSource;
+			//extract two end vertices of the current edge
+			SGraphEdgeDescriptor currentE = edgeList[ne];
+			double currentR = simplified_skeleton_[currentE].nRadius;
+			SGraphVertexDescriptor sourceV, targetV;
+			if (source(currentE, simplified_skeleton_) == simplified_skeleton_[target(currentE, simplified_skeleton_)].nParent)
+			{
+				sourceV = source(currentE, simplified_skeleton_);
+				targetV = target(currentE, simplified_skeleton_);
+			}
+			else
+			{
+				sourceV = target(currentE, simplified_skeleton_);
+				targetV = source(currentE, simplified_skeleton_);
+			}
+			Vector3D pSource(simplified_skeleton_[sourceV].cVert.x, simplified_skeleton_[sourceV].cVert.y, simplified_skeleton_[sourceV].cVert.z);
+			Vector3D pTarget(simplified_skeleton_[targetV].cVert.x, simplified_skeleton_[targetV].cVert.y, simplified_skeleton_[targetV].cVert.z);
+			//query neighbor points from the kd tree
+			KDtree_->queryLineIntersection(query, pSource, pTarget, params_.line_query_factor * currentR, true, true);
+			int neighbourSize = query.getNOfFoundNeighbours();
+
+			//gather the candidates relative to the source
+			px.resize(neighbourSize);
+			py.resize(neighbourSize);
+			pz.resize(neighbourSize);
+			inside.resize(neighbourSize);
+			for (int i = 0; i < neighbourSize; i++)
+			{
+				const Vector3D& pCurrent = Points_[query.getNeighbourPositionIndex(i)];
+				px[i] = pCurrent.x - pSource.x;
+				py[i] = pCurrent.y - pSource.y;
+				pz[i] = pCurrent.z - pSource.z;
+			}
+
+			//check if the candidates lie within the cylinder, i.e., the angle to the axis is smaller
+			//than 90 and the projection is less than the axis length. This loop has no branches
+			//and is vectorized by the compiler.
 			Vector3D cDirCylinder = pTarget - pSource;
-			double nLengthPoint = cDirPoint.normalize();
-			double nLengthCylinder = cDirCylinder.normalize();
-			double cosAlpha = Vector3D::dotProduct(cDirCylinder, cDirPoint);
-			//if the angle is smaller than 90 and the projection is less than the axis length
-			if (cosAlpha >= 0 && nLengthPoint * cosAlpha <= nLengthCylinder)
-                simplified_skeleton_[currentE].vecPoints.push_back(ptIndex);
+			const double nLengthCylinder = cDirCylinder.normalize();
+			const float cx = cDirCylinder.x, cy = cDirCylinder.y, cz = cDirCylinder.z;
+			for (int i = 0; i < neighbourSize; i++)
+			{
+				const float nLengthPoint = static_cast<float>(std::sqrt(static_cast<double>(px[i] * px[i] + py[i] * py[i] + pz[i] * pz[i])));
+				const float rezLength = (nLengthPoint == 0.0f) ? 1.0f : 1.0f / nLengthPoint; // see Vector3D::normalize()
+				const float cosAlpha = cx * (px[i] * rezLength) + cy * (py[i] * rezLength) + cz * (pz[i] * rezLength);
+				inside[i] = (cosAlpha >= 0) & (static_cast<double>(nLengthPoint) * cosAlpha <= nLengthCylinder);
+			}
+
+			localOwner[ne] = tid;
+			localBegin[ne] = static_cast<int>(local.size());
+			for (int i = 0; i < neighbourSize; i++)
+			{
+				if (inside[i])
+					local.push_back(query.getNeighbourPositionIndex(i));
+			}
+			localCount[ne] = static_cast<int>(local.size()) - localBegin[ne];
 		}
 	}
 
-	return;
-}
-
-
-void Skeleton::fit_trunk()
-{
-	//find the trunk edge
-	SGraphEdgeDescriptor trunkE;
-    std::pair<SGraphOutEdgeIterator, SGraphOutEdgeIterator> listAdj = out_edges(RootV_, simplified_skeleton_);
-	for (SGraphOutEdgeIterator eIter = listAdj.first; eIter != listAdj.second; ++eIter)
+	std::size_t nAssigned = 0;
+	for (int ne = 0; ne < nEdges; ne++)
 	{
-		trunkE = *eIter;
-		break;
+		simplified_skeleton_[edgeList[ne]].nPointsBegin = nAssigned;
+		simplified_skeleton_[edgeList[ne]].nPointsCount = localCount[ne];
+		nAssigned += localCount[ne];
 	}
-
-	//if the points attached are not enough, then don't conduct fitting
-    std::size_t pCount = simplified_skeleton_[trunkE].vecPoints.size();
-	if (pCount <= 20)
+	EdgePoints_.resize(nAssigned);
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int ne = 0; ne < nEdges; ne++)
 	{
-        if (!quiet_)
-            std::cout << "the least squares fails because of not enough points!" << std::endl;
-		return;
+		const int* first = localPoints[localOwner[ne]].data() + localBegin[ne];
+		std::copy(first, first + localCount[ne], EdgePoints_.begin() + simplified_skeleton_[edgeList[ne]].nPointsBegin);
 	}
 
-	//construct the initial cylinder
-	SGraphVertexDescriptor sourceV, targetV;
-    if (source(trunkE, simplified_skeleton_) == simplified_skeleton_[target(trunkE, simplified_skeleton_)].nParent)
-	{
-        sourceV = source(trunkE, simplified_skeleton_);
-        targetV = target(trunkE, simplified_skeleton_);
-	}
-	else
-	{
-        sourceV = target(trunkE, simplified_skeleton_);
-        targetV = source(trunkE, simplified_skeleton_);
-	}
-    //Vector3D pSource(simplified_skeleton_[sourceV].cVert.x, simplified_skeleton_[sourceV].cVert.y, simplified_skeleton_[sourceV].cVert.z);
-    //Vector3D pTarget(simplified_skeleton_[targetV].cVert.x, simplified_skeleton_[targetV].cVert.y, simplified_skeleton_[targetV].cVert.z);
-    //Cylinder currentC = Cylinder(pSource, pTarget, simplified_skeleton_[trunkE].nRadius);
+	return;
+}
+
 
+Cylinder Skeleton::initial_edge_cylinder(SGraphEdgeDescriptor i_Edge, std::vector< std::vector<double> >& o_ptlist, Vector3D& o_pSource, Vector3D& o_pTarget) const
+{
 	//initialize the mean, the point cloud matrix
 	Vector3D pTop(0.0, 0.0, -FLT_MAX);
 	Vector3D pBottom(0.0, 0.0, FLT_MAX);
@@ -1015,10 +1597,12 @@ void Skeleton::fit_trunk()
 	PrincipalAxes<3, double> pca;
 	pca.begin();
 	//extract the corresponding point cloud
-	std::vector< std::vector<double> > ptlist;
+	std::size_t pCount = simplified_skeleton_[i_Edge].nPointsCount;
+	o_ptlist.clear();
+	o_ptlist.reserve(pCount);
 	for (int np = 0; np < pCount; np++)
 	{
-        int npIndex = simplified_skeleton_[trunkE].vecPoints.at(np);
+        int npIndex = EdgePoints_.at(simplified_skeleton_[i_Edge].nPointsBegin + np);
 		const Vector3D& pt = Points_[npIndex];
         pca.add_point(dvec3(pt.x, pt.y, pt.z));
 
@@ -1027,7 +1611,7 @@ void Skeleton::fit_trunk()
 		ptemp.push_back(pt.y);
 		ptemp.push_back(pt.z);
 		ptemp.push_back(1.0); //weights are set to 1
-		ptlist.push_back(ptemp);
+		o_ptlist.push_back(ptemp);
 		if (pt.z < pBottom.z)
 			pBottom = pt;
 		if (pt.z > pTop.z)
@@ -1048,41 +1632,87 @@ void Skeleton::fit_trunk()
 	float nLengthBottom = cDirBottom.normalize();
 	double cosineTop = Vector3D::dotProduct(cDir, cDirTop);
 	double cosineBottom = Vector3D::dotProduct(cDir, cDirBottom);
-	Vector3D pSource = pMean + nLengthBottom * cosineBottom * cDir;
-	Vector3D pTarget = pMean + nLengthTop * cosineTop * cDir;
-	Cylinder currentC = Cylinder(pSource, pTarget, simplified_skeleton_[trunkE].nRadius);
+	o_pSource = pMean + nLengthBottom * cosineBottom * cDir;
+	o_pTarget = pMean + nLengthTop * cosineTop * cDir;
+	return Cylinder(o_pSource, o_pTarget, simplified_skeleton_[i_Edge].nRadius);
+}
+
+
+void Skeleton::update_fitting_weights(Cylinder& i_Cylinder, std::vector< std::vector<double> >& io_ptlist)
+{
+	Vector3D pSourceAdjust = i_Cylinder.GetAxisPosition1();
+	Vector3D pTargetAdjust = i_Cylinder.GetAxisPosition2();
+	double radiusAdjust = i_Cylinder.GetRadius();
+
+	double maxDis = -DBL_MAX;
+	std::vector<double> disList;
+	for (std::size_t np = 0; np < io_ptlist.size(); np++)
+	{
+		Vector3D pt(io_ptlist[np][0], io_ptlist[np][1], io_ptlist[np][2]);
+		//Compute the distance from current pt to the line formed by source and target vertex
+		double dis = (Vector3D::crossProduct(pt - pSourceAdjust, pt - pTargetAdjust)).normalize()
+			         / ((pSourceAdjust - pTargetAdjust).normalize());
+		//Substract the distance with the radius
+		dis = abs(dis - radiusAdjust);
+		if (dis > maxDis) maxDis = dis;
+		disList.push_back(dis);
+	}
+
+	//update the weights
+	for (std::size_t np = 0; np < io_ptlist.size(); np++)
+		io_ptlist[np][3] = 1.0 - disList[np] / maxDis;
+}
+
+
+void Skeleton::fit_trunk()
+{
+	//find the trunk edge
+	SGraphEdgeDescriptor trunkE;
+    std::pair<SGraphOutEdgeIterator, SGraphOutEdgeIterator> listAdj = out_edges(SimplifiedRootV_, simplified_skeleton_);
+	for (SGraphOutEdgeIterator eIter = listAdj.first; eIter != listAdj.second; ++eIter)
+	{
+		trunkE = *eIter;
+		break;
+	}
+
+	//if the points attached are not enough, then don't conduct fitting
+    std::size_t pCount = simplified_skeleton_[trunkE].nPointsCount;
+	if (pCount <= static_cast<std::size_t>(params_.min_fitting_points))
+	{
+        if (!quiet_)
+            std::cout << "the least squares fails because of not enough points!" << std::endl;
+		return;
+	}
+
+	//construct the initial cylinder
+	SGraphVertexDescriptor sourceV, targetV;
+    if (source(trunkE, simplified_skeleton_) == simplified_skeleton_[target(trunkE, simplified_skeleton_)].nParent)
+	{
+        sourceV = source(trunkE, simplified_skeleton_);
+        targetV = target(trunkE, simplified_skeleton_);
+	}
+	else
+	{
+        sourceV = target(trunkE, simplified_skeleton_);
+        targetV = source(trunkE, simplified_skeleton_);
+	}
+	std::vector< std::vector<double> > ptlist;
+	Vector3D pSource, pTarget;
+	Cylinder currentC = initial_edge_cylinder(trunkE, ptlist, pSource, pTarget);
 
 	//non linear leastsquares adjustment
-	if (currentC.LeastSquaresFit(ptlist.begin(), ptlist.end())) 
+	CylinderFitWorkspace workspace;
+	if (currentC.LeastSquaresFit(ptlist.begin(), ptlist.end(), workspace))
 	{
 		Vector3D pSourceAdjust = currentC.GetAxisPosition1();
 		Vector3D pTargetAdjust = currentC.GetAxisPosition2();
 		double radiusAdjust = currentC.GetRadius();
 
 		//prepare for the weighted non linear least squares
-		currentC.SetAxisPosition1(pSourceAdjust);
-		currentC.SetAxisPosition2(pTargetAdjust);
-		currentC.SetRadius(radiusAdjust);
-		double maxDis = -DBL_MAX;
-		std::vector<double> disList;
-		for (int np = 0; np < pCount; np++)
-		{
-			Vector3D pt(ptlist[np][0], ptlist[np][1], ptlist[np][2]);
-			//Compute the distance from current pt to the line formed by source and target vertex
-			double dis = (Vector3D::crossProduct(pt - pSourceAdjust, pt - pTargetAdjust)).normalize()
-				         / ((pSourceAdjust - pTargetAdjust).normalize());
-			//Substract the distance with the radius
-			dis = abs(dis - radiusAdjust);
-			if (dis > maxDis) maxDis = dis;
-			disList.push_back(dis);
-		}
-		
-		//update the weights
-		for (int np = 0; np < pCount; np++)
-			ptlist[np][3] = 1.0 - disList[np] / maxDis;
-		
+		update_fitting_weights(currentC, ptlist);
+
 		//conduct the second round of weighted least squares
-		if (currentC.LeastSquaresFit(ptlist.begin(), ptlist.end()))
+		if (currentC.LeastSquaresFit(ptlist.begin(), ptlist.end(), workspace))
 		{
             if (!quiet_)
                 std::cout << "successfully conduct the non linear least squares!" << std::endl;
@@ -1118,6 +1748,80 @@ void Skeleton::fit_trunk()
 }
 
 
+void Skeleton::fit_first_order_branches()
+{
+	//the main stem follows the child with the longest subtree from the root. The first edge of
+	//every other branch leaving the stem is a first-order branch.
+	SkeletonTraversal traversal(simplified_skeleton_, SimplifiedRootV_);
+	std::vector<SGraphEdgeDescriptor> branchEdges;
+	std::vector<SGraphVertexDescriptor> branchStarts;
+	SGraphVertexDescriptor stemV = SimplifiedRootV_;
+	while (traversal.num_children(stemV) > 0)
+	{
+		const SGraphVertexDescriptor* nextStem = traversal.children_begin(stemV);
+		for (const SGraphVertexDescriptor* child = traversal.children_begin(stemV); child != traversal.children_end(stemV); ++child)
+		{
+			if (simplified_skeleton_[*child].lengthOfSubtree > simplified_skeleton_[*nextStem].lengthOfSubtree)
+				nextStem = child;
+		}
+		for (const SGraphVertexDescriptor* child = traversal.children_begin(stemV); child != traversal.children_end(stemV); ++child)
+		{
+			SGraphEdgeDescriptor currentE = edge(stemV, *child, simplified_skeleton_).first;
+			//too few points for a reliable fitting
+			if (child != nextStem && simplified_skeleton_[currentE].nPointsCount > static_cast<std::size_t>(params_.min_fitting_points))
+			{
+				branchEdges.push_back(currentE);
+				branchStarts.push_back(*child);
+			}
+		}
+		stemV = *nextStem;
+	}
+	if (branchEdges.empty())
+		return;
+
+	//fit all branches at once (two rounds as for the trunk, the second weighted)
+	std::vector<Cylinder> cylinders(branchEdges.size());
+	std::vector< std::vector< std::vector<double> > > ptlists(branchEdges.size());
+	for (std::size_t i = 0; i < branchEdges.size(); i++)
+	{
+		Vector3D pSource, pTarget;
+		cylinders[i] = initial_edge_cylinder(branchEdges[i], ptlists[i], pSource, pTarget);
+	}
+	std::vector<bool> fitted = Cylinder::LeastSquaresFitBatch(cylinders, ptlists);
+	std::vector<Cylinder> weightedCylinders = cylinders;
+	for (std::size_t i = 0; i < branchEdges.size(); i++)
+	{
+		if (fitted[i])
+			update_fitting_weights(cylinders[i], ptlists[i]);
+	}
+	std::vector<bool> weightedFitted = Cylinder::LeastSquaresFitBatch(weightedCylinders, ptlists);
+
+	//rescale the radii of each branch such that its first edge has the fitted radius. Implausible
+	//results (e.g., a branch thicker than the trunk) are ignored.
+	int numFitted = 0;
+	for (std::size_t i = 0; i < branchEdges.size(); i++)
+	{
+		if (!fitted[i])
+			continue;
+		double radius = weightedFitted[i] ? weightedCylinders[i].GetRadius() : cylinders[i].GetRadius();
+		double currentR = simplified_skeleton_[branchEdges[i]].nRadius;
+		if (!(radius > 0.0 && radius < TrunkRadius_ && currentR > 0.0))
+			continue;
+		double ratio = radius / currentR;
+		simplified_skeleton_[branchEdges[i]].nRadius = radius;
+		SkeletonTraversal subtree(simplified_skeleton_, branchStarts[i]);
+		subtree.for_each_top_down([&](SGraphVertexDescriptor currentV) {
+			for (const SGraphVertexDescriptor* child = subtree.children_begin(currentV); child != subtree.children_end(currentV); ++child)
+				simplified_skeleton_[edge(currentV, *child, simplified_skeleton_).first].nRadius *= ratio;
+		});
+		++numFitted;
+	}
+
+    if (!quiet_)
+        std::cout << "fitted " << numFitted << " of " << branchEdges.size() << " first-order branches" << std::endl;
+}
+
+
 std::vector<SGraphVertexDescriptor> Skeleton::find_end_vertices()
 {
 	std::vector<SGraphVertexDescriptor> endVertices;
@@ -1136,8 +1840,17 @@ std::vector<SGraphVertexDescriptor> Skeleton::find_end_vertices()
 }
 
 
-void Skeleton::generate_leaves(SGraphVertexDescriptor i_LeafVertex, double leafsize_Factor)
+void Skeleton::generate_leaves(SGraphVertexDescriptor i_LeafVertex, double leafsize_Factor, std::mt19937& rng)
 {
+	//the numbers are drawn one per statement, in the same order on all compilers
+	auto random_float = [&rng]() { return random_unit(rng); };
+	auto random_direction = [&random_float]() {
+		const float x = (random_float() - 0.5f) / 0.5f;
+		const float y = (random_float() - 0.5f) / 0.5f;
+		const float z = (random_float() - 0.5f) / 0.5f;
+		return vec3(x, y, z);
+	};
+
 	//generate a random density number
     int density = ceil(random_float() * 10);
     double radius = 0.2 / log((float)num_edges(simplified_skeleton_));
@@ -1152,7 +1865,7 @@ void Skeleton::generate_leaves(SGraphVertexDescriptor i_LeafVertex, double leafs
 	for (int i = 0; i < density; ++i)
 	{
 		//generate a random leaf position
-        vec3 dirLeaf((random_float() - 0.5) / 0.5, (random_float() - 0.5) / 0.5, (random_float() - 0.5) / 0.5);
+        vec3 dirLeaf = random_direction();
 		dirLeaf = dirLeaf.normalize();
         double l = random_float() * radius;
 		vec3 pLeaf = pEnd + dirLeaf * l;
@@ -1164,7 +1877,7 @@ void Skeleton::generate_leaves(SGraphVertexDescriptor i_LeafVertex, double leafs
 		newleaf.cPos = pLeaf;
 		newleaf.cDir = dirLeaf;
 		//generate a random normal vector direction
-        vec3 delta((random_float() - 0.5) / 0.5, (random_float() - 0.5) / 0.5, (random_float() - 0.5) / 0.5);
+        vec3 delta = random_direction();
         newleaf.cNormal = (normal + random_float()*delta*0.5).normalize();
 		newleaf.pSource = i_LeafVertex;
 		newleaf.nLength = BoundingDistance_ * leafsize_Factor;
@@ -1179,10 +1892,11 @@ void Skeleton::generate_leaves(SGraphVertexDescriptor i_LeafVertex, double leafs
 void Skeleton::get_graph_for_smooth(std::vector<Path> &pathList)
 {
 	pathList.clear();
+	SkeletonTraversal traversal(simplified_skeleton_, SimplifiedRootV_);
 	Path currentPath;
 	int cursor = 0;
 	//insert the root vertex to the current path
-	currentPath.push_back(RootV_);
+	currentPath.push_back(SimplifiedRootV_);
 	pathList.push_back(currentPath);
 	//retrieve the path list
 	while (cursor < pathList.size())
@@ -1190,7 +1904,7 @@ void Skeleton::get_graph_for_smooth(std::vector<Path> &pathList)
 		currentPath = pathList[cursor];
 		SGraphVertexDescriptor endV = currentPath.back();
 		// if the current path has reached the leaf
-        if ((out_degree(endV, simplified_skeleton_) == 1) && (endV != simplified_skeleton_[endV].nParent))
+        if (traversal.num_children(endV) == 0)
 			cursor++;
 		else
 		{
@@ -1199,25 +1913,21 @@ void Skeleton::get_graph_for_smooth(std::vector<Path> &pathList)
 			int isUsed = -1;
 			SGraphVertexDescriptor fatestChild;
 			std::vector<SGraphVertexDescriptor> notFastestChildren;
-            std::pair<SGraphAdjacencyIterator, SGraphAdjacencyIterator> adjacencies = adjacent_vertices(endV, simplified_skeleton_);
-			for (SGraphAdjacencyIterator cIter = adjacencies.first; cIter != adjacencies.second; ++cIter)
+			for (const SGraphVertexDescriptor* cIter = traversal.children_begin(endV); cIter != traversal.children_end(endV); ++cIter)
 			{
-                if (*cIter != simplified_skeleton_[endV].nParent)
+                SGraphEdgeDescriptor currentE = edge(endV, *cIter, simplified_skeleton_).first;
+                double radius = simplified_skeleton_[currentE].nRadius;
+				if (maxR < radius)
 				{
-                    SGraphEdgeDescriptor currentE = edge(endV, *cIter, simplified_skeleton_).first;
-                    double radius = simplified_skeleton_[currentE].nRadius;
-					if (maxR < radius)
-					{
-						maxR = radius;
-						if (isUsed > -1)
-							notFastestChildren.push_back(fatestChild);
-						else
-							isUsed = 0;
-						fatestChild = *cIter;
-					}
+					maxR = radius;
+					if (isUsed > -1)
+						notFastestChildren.push_back(fatestChild);
 					else
-						notFastestChildren.push_back(*cIter);
+						isUsed = 0;
+					fatestChild = *cIter;
 				}
+				else
+					notFastestChildren.push_back(*cIter);
 			}
 			// organize children vertices into a new path
 			for (int nChild = 0; nChild < notFastestChildren.size(); ++nChild)
@@ -1236,27 +1946,154 @@ void Skeleton::get_graph_for_smooth(std::vector<Path> &pathList)
 }
 
 
+void Skeleton::refine_vertex_positions(const std::vector<Vector3D>& finePoints, const KdTree* fineTree)
+{
+	//each vertex is moved by the difference between the centroids of the full-resolution and the voxel points
+	//around it, which removes the bias of the voxel centroids while keeping the vertex inside the branch
+	const float sqrRadius = static_cast<float>(voxel_size_ * voxel_size_);
+	std::pair<SGraphVertexIterator, SGraphVertexIterator> vp = vertices(simplified_skeleton_);
+	std::vector<SGraphVertexDescriptor> vertexList(vp.first, vp.second);
+	const int nVertices = static_cast<int>(vertexList.size());
+#pragma omp parallel
+	{
+		KdTreeQuery query;
+#pragma omp for schedule(dynamic, 64)
+		for (int nv = 0; nv < nVertices; nv++)
+		{
+			SGraphVertexDescriptor currentV = vertexList[nv];
+			if (currentV == SimplifiedRootV_ || out_degree(currentV, simplified_skeleton_) == 0)
+				continue;
+			const vec3& p = simplified_skeleton_[currentV].cVert;
+			const Vector3D pCurrent(p.x, p.y, p.z);
+
+			fineTree->queryRange(query, pCurrent, sqrRadius, true);
+			const int nFine = query.getNOfFoundNeighbours();
+			Vector3D fineSum(0, 0, 0);
+			for (int np = 0; np < nFine; np++)
+				fineSum += finePoints[query.getNeighbourPositionIndex(np)];
+
+			KDtree_->queryRange(query, pCurrent, sqrRadius, true);
+			const int nCoarse = query.getNOfFoundNeighbours();
+			Vector3D coarseSum(0, 0, 0);
+			for (int np = 0; np < nCoarse; np++)
+				coarseSum += Points_[query.getNeighbourPositionIndex(np)];
+
+			if (nFine > 0 && nCoarse > 0)
+			{
+				const Vector3D offset = fineSum / nFine - coarseSum / nCoarse;
+				simplified_skeleton_[currentV].cVert += vec3(offset.x, offset.y, offset.z);
+			}
+		}
+	}
+}
+
+
+void Skeleton::start_stage_memory() {
+    stage_memory_peak_ = reset_peak_memory();
+    memory_mark_ = current_memory();
+}
+
+
+void Skeleton::record_stage_memory(const char* stage) {
+    if (stage_memory_peak_) {
+        stage_memory_.push_back(std::make_pair(std::string(stage), peak_memory()));
+        reset_peak_memory();
+    }
+    else {
+        const double memory = current_memory();
+        stage_memory_.push_back(std::make_pair(std::string(stage), memory - memory_mark_));
+        memory_mark_ = memory;
+    }
+}
+
+
 bool Skeleton::reconstruct_branches(const PointCloud* cloud, SurfaceMesh* mesh) {
     if (!cloud) {
         std::cout << "point cloud does not exist" << std::endl;
         return false;
     }
 
-    if (!build_delaunay(cloud)) {
-        std::cerr << "failed Delaunay Triangulation" << std::endl;
-        return false;
+    stage_memory_.clear();
+    start_stage_memory();
+
+    //with a voxel size, the topology of the skeleton is computed from the voxel centroids, and the skeleton is
+    //then refined against the full-resolution points (the kd-tree shared from the loading stage is of them)
+    PointCloud coarse;
+    std::unique_ptr<KdTree> fullTree;
+    const bool multiResolution = engine_ == ENGINE_DELAUNAY && voxel_size_ > 0 && voxel_subsample(cloud, voxel_size_, &coarse) && coarse.n_vertices() < cloud->n_vertices();
+    if (multiResolution) {
+        if (!quiet_)
+            std::cout << "skeletonizing " << coarse.n_vertices() << " voxel centroids of " << cloud->n_vertices() << " points" << std::endl;
+        fullTree.reset(KDtree_);
+        KDtree_ = nullptr;
     }
 
-    //extract the minimum spanning tree
-    if (!extract_mst()) {
-        std::cerr << "failed extracting MST" << std::endl;
-        return false;
+    //the stages until the one loaded from a checkpoint (see load_checkpoint()) are skipped
+    const Stage resumeStage = resume_stage_;
+    resume_stage_ = STAGE_NONE;
+    if (resumeStage == STAGE_NONE && engine_ == ENGINE_VOXEL) {
+        if (!build_voxel_skeleton(cloud)) {
+            std::cerr << "failed building the voxel skeleton" << std::endl;
+            return false;
+        }
+        if (!checkpoint_file_.empty())
+            save_checkpoint(STAGE_MST, cloud);
+        record_stage_memory("voxel graph");
     }
+    else if (resumeStage == STAGE_NONE) {
+        //the MST of the previous version of the points is updated if possible (see load_previous())
+        bool updated = false;
+        if (!previous_.points.empty()) {
+            updated = !multiResolution && update_mst(cloud);
+            previous_ = PreviousTree();
+        }
+
+        if (!updated && !build_delaunay(multiResolution ? &coarse : cloud)) {
+            std::cerr << "failed Delaunay Triangulation" << std::endl;
+            return false;
+        }
+        if (!updated)
+            record_stage_memory("delaunay");
+
+        //extract the minimum spanning tree
+        if (!updated && !extract_mst()) {
+            std::cerr << "failed extracting MST" << std::endl;
+            return false;
+        }
+        if (!checkpoint_file_.empty())
+            save_checkpoint(STAGE_MST, cloud);
+        if (release_intermediates_)
+            Graph().swap(delaunay_);
+        record_stage_memory("mst");
+    }
+    else    // the later stages still need the points (copied while building the Delaunay graph otherwise)
+        load_points(multiResolution ? &coarse : cloud);
 
     //simplify the tree skeleton
-    if (!simplify_skeleton()) {
-        std::cerr << "failed skeleton simplification" << std::endl;
-        return false;
+    if (resumeStage < STAGE_SIMPLIFIED) {
+        if (!simplify_skeleton()) {
+            std::cerr << "failed skeleton simplification" << std::endl;
+            return false;
+        }
+        if (!checkpoint_file_.empty())
+            save_checkpoint(STAGE_SIMPLIFIED, cloud);
+    }
+    if (release_intermediates_)
+        Graph().swap(MST_);
+    record_stage_memory("simplification");
+
+    //switch to the full-resolution points for refining the vertices and fitting the radii
+    if (multiResolution) {
+        std::vector<Vector3D> fullPoints(cloud->n_vertices());
+        const std::vector<vec3>& points = cloud->points();
+        for (std::size_t i = 0; i < points.size(); ++i)
+            fullPoints[i] = Vector3D(points[i].x, points[i].y, points[i].z);
+        if (!fullTree)
+            fullTree.reset(new KdTree(fullPoints.data(), static_cast<unsigned int>(fullPoints.size()), 16));
+        refine_vertex_positions(fullPoints, fullTree.get());
+        delete KDtree_;
+        KDtree_ = fullTree.release();
+        Points_.swap(fullPoints);
     }
 
     //generate branches
@@ -1264,90 +2101,35 @@ bool Skeleton::reconstruct_branches(const PointCloud* cloud, SurfaceMesh* mesh)
         std::cerr << "failed computing branch radius" << std::endl;
         return false;
     }
+    if (release_intermediates_) {   // the points are no longer needed
+        delete KDtree_;
+        KDtree_ = nullptr;
+        std::vector<Vector3D>().swap(Points_);
+        std::vector<int>().swap(EdgePoints_);
+        workspace_ = Workspace();
+    }
+    record_stage_memory("radius");
 
     //smooth branches
     if (!smooth_skeleton()) {
         std::cerr << "failed smoothing branches" << std::endl;
         return false;
     }
+    record_stage_memory("smoothing");
 
-    //extract surface model
-    if (!extract_branch_surfaces(mesh)) {
+    //extract surface model (not needed if only the skeleton is requested)
+    if (mesh && !extract_branch_surfaces(mesh)) {
         std::cerr << "failed extracting branches" << std::endl;
         return false;
     }
+    if (mesh)
+        record_stage_memory("surfaces");
 
     return true;
 }
 
 
-std::vector<Skeleton::Branch> Skeleton::get_branches_parameters() const {
-    std::vector<Skeleton::Branch> branches;
-
-    Graph& graph = *(const_cast<Graph*>(&smoothed_skeleton_));
-
-    if (boost::num_edges(smoothed_skeleton_) == 0)
-        return branches;
-
-    //-----------------------------------------------------------------------
-    //  traverse all the vertices of a graph
-    //-----------------------------------------------------------------------
-    std::pair<SGraphVertexIterator, SGraphVertexIterator> vi = boost::vertices(graph);
-    for (SGraphVertexIterator vit = vi.first; vit != vi.second; ++vit) {
-        SGraphVertexDescriptor cur_vd = *vit;
-        SGraphVertexProp& vp = graph[cur_vd];
-        vp.visited = false;
-    }
-
-    for (SGraphVertexIterator vit = vi.first; vit != vi.second; ++vit) {
-         SGraphVertexDescriptor cur_vd = *vit;
-         SGraphVertexProp& vp = graph[cur_vd];
-		 auto deg = boost::degree(cur_vd, graph);
-         if (vp.visited)
-             continue;
-         if (deg != 1)
-             continue;
-
-         Branch branch;
-         vp.visited = true;
-
-         if (branch.points.empty() || easy3d::distance(branch.points.back(), vp.cVert) >= epsilon<float>()) {
-             branch.points.push_back(vp.cVert);
-             branch.radii.push_back(vp.radius);
-         }
-
-         bool reached_end = false;
-         do {
-             std::pair<SGraphAdjacencyIterator, SGraphAdjacencyIterator> adj_v_iter = boost::adjacent_vertices(cur_vd, smoothed_skeleton_);
-             for (SGraphAdjacencyIterator ait = adj_v_iter.first; ait != adj_v_iter.second; ++ait) {
-                 SGraphVertexDescriptor next_vd = *ait;
-
-                 SGraphVertexProp& next_vp = graph[next_vd];
-                 if (!next_vp.visited) {
-
-                     if (branch.points.empty() || easy3d::distance(branch.points.back(), next_vp.cVert) >= epsilon<float>()) {
-                         branch.points.push_back(next_vp.cVert);
-                         branch.radii.push_back(next_vp.radius);
-                     }
-
-                     cur_vd = next_vd;
-                     next_vp.visited = true;
-
-                     if (boost::degree(cur_vd, graph) == 1) {
-                         reached_end = true;
-                         break;
-                     }
-                 }
-             }
-         } while (!reached_end);
-
-         branches.push_back(branch);
-    }
-
-    return branches;
-}
-
-void Skeleton::add_generalized_cylinder_to_model(SurfaceMesh *mesh, const Branch& branch, int slices)
+void Skeleton::compute_generalized_cylinder(const Branch& branch, const std::vector<float>& cosines, const std::vector<float>& sines, vec3* vertices) const
 {
     const std::vector<double> &radius = branch.radii;
     const std::vector<vec3> &points = branch.points;
@@ -1357,8 +2139,7 @@ void Skeleton::add_generalized_cylinder_to_model(SurfaceMesh *mesh, const Branch
         return;
     }
 
-    typedef  std::vector<SurfaceMesh::Vertex> CrossSection;
-    std::vector< CrossSection > crosssections;
+    const std::size_t slices = cosines.size();
     vec3 perp;
     for (std::size_t np = 0; np < points.size() - 1; np++)
     {
@@ -1369,7 +2150,8 @@ void Skeleton::add_generalized_cylinder_to_model(SurfaceMesh *mesh, const Branch
                       << "\ts: " << s << ";  t: " << t << std::endl;
         double r = radius[np];
 
-        //find a vector perpendicular to the direction
+        //find a vector perpendicular to the direction. It is propagated along the branch by projecting
+        //the previous one onto the new cross-section, so the frame does not twist between sections
         const vec3 offset = t - s;
         const vec3 axis = normalize(offset);
         if (np == 0) {
@@ -1393,43 +2175,17 @@ void Skeleton::add_generalized_cylinder_to_model(SurfaceMesh *mesh, const Branch
         }
 
         const vec3 p = s + perp * r;
-        const double angle_interval = 2.0 * M_PI / slices;
+        const vec3 v = p - s;
         //find the points for all slices
-        CrossSection cs;
-        for (int sli = 0; sli < slices; ++sli) {
-            double angle = sli * angle_interval;
-            const vec3 a = s + mat4::rotation(axis, static_cast<float>(angle)) * (p - s);
-            SurfaceMesh::Vertex v = mesh->add_vertex(a);
-            cs.push_back(v);
-        }
-        crosssections.push_back(cs);
-    }
-
-#if 0
-    // the last vertex
-    const vec3& t = points.back();
-    SurfaceMesh::Vertex v = mesh->add_vertex(t);
-    CrossSection cs;
-    for (int sli = 0; sli < slices; ++sli)
-        cs.push_back(v);
-    crosssections.push_back(cs);
-#endif
-
-    if (crosssections.size() < 2)
-        return;
-
-    for (std::size_t nx = 0; nx < crosssections.size() - 1; ++nx) {
-        const CrossSection& cs_curr = crosssections[nx];
-        const CrossSection& cs_next = crosssections[nx+1];
-        for (std::size_t ny = 0; ny < cs_curr.size(); ++ny) {
-            mesh->add_triangle(cs_curr[ny], cs_curr[(ny+1) % cs_curr.size()], cs_next[ny]);
-            mesh->add_triangle(cs_next[ny], cs_curr[(ny+1) % cs_curr.size()], cs_next[(ny+1) % cs_curr.size()]);
-        }
+        vec3* cs = vertices + np * slices;
+        for (std::size_t sli = 0; sli < slices; ++sli)
+            cs[sli] = s + rotate(axis, cosines[sli], sines[sli], v);
     }
 }
 
 
 bool Skeleton::reconstruct_leaves(SurfaceMesh *mesh) {
+    start_stage_memory();
     if (!add_leaves())
         return false;
 
@@ -1454,6 +2210,7 @@ bool Skeleton::reconstruct_leaves(SurfaceMesh *mesh) {
         mesh->add_triangle(va, vb, vc);
         mesh->add_triangle(va, vc, vd);
     }
+    record_stage_memory("leaves");
 
     return true;
 }
@@ -1465,11 +2222,101 @@ bool Skeleton::extract_branch_surfaces(SurfaceMesh* result)
     if (branches.empty())
         return false;
 
-    static const int slices = 10;
-    for (const auto& branch : branches)
-        add_generalized_cylinder_to_model(result, branch, slices);
+    const int slices = params_.surface_slices;
+    const int minSlices = 3, maxSlices = std::max(32, slices);
+
+    //the number of slices of each branch. With a tolerance, it is the smallest one for which the polygon
+    //deviates at most the tolerance from the largest cross-section, i.e., r * (1 - cos(pi / n)) <= tolerance
+    const std::size_t nBranches = branches.size();
+    std::vector<int> branchSlices(nBranches, slices);
+    if (lod_tolerance_ > 0) {
+        for (std::size_t i = 0; i < nBranches; ++i) {
+            const std::vector<double>& radii = branches[i].radii;
+            const double r = radii.empty() ? 0.0 : *std::max_element(radii.begin(), radii.end());
+            int n = minSlices;
+            if (r > lod_tolerance_)
+                n = static_cast<int>(std::ceil(M_PI / std::acos(1.0 - lod_tolerance_ / r)));
+            branchSlices[i] = std::min(std::max(n, minSlices), maxSlices);
+        }
+    }
+
+    //the cross-sections with the same number of slices use the same set of angles
+    std::vector< std::vector<float> > cosines(maxSlices + 1), sines(maxSlices + 1);
+    for (std::size_t i = 0; i < nBranches; ++i) {
+        const int n = branchSlices[i];
+        if (!cosines[n].empty())
+            continue;
+        cosines[n].resize(n);
+        sines[n].resize(n);
+        const double angle_interval = 2.0 * M_PI / n;
+        for (int sli = 0; sli < n; ++sli) {
+            const float angle = static_cast<float>(sli * angle_interval);
+            cosines[n][sli] = std::cos(angle);
+            sines[n][sli] = std::sin(angle);
+        }
+    }
+
+    //each branch with n points has (n - 1) cross-sections. The prefix sum of their vertex counts gives
+    //the position of every branch in the vertex array, so the branches can be meshed independently
+    std::vector<std::size_t> offsets(nBranches + 1, 0);
+    std::size_t nCaps = 0, nEdges = 0, nFaces = 0;
+    for (std::size_t i = 0; i < nBranches; ++i) {
+        const std::size_t n = branchSlices[i];
+        const std::size_t nSections = branches[i].points.size() < 2 ? 0 : branches[i].points.size() - 1;
+        offsets[i + 1] = offsets[i] + nSections * n;
+        if (nSections >= 2) {
+            nEdges += n * (3 * nSections - 2);
+            nFaces += 2 * n * (nSections - 1);
+            if (cap_branches_) { // a polygon at the start and a cone to the tip
+                ++nCaps;
+                nEdges += (n - 3) + n;
+                nFaces += (n - 2) + n;
+            }
+        }
+    }
+
+    std::vector<vec3> vertices(offsets.back());
+#pragma omp parallel for schedule(dynamic, 16)
+    for (long i = 0; i < static_cast<long>(nBranches); ++i) {
+        const int n = branchSlices[i];
+        compute_generalized_cylinder(branches[i], cosines[n], sines[n], vertices.data() + offsets[i]);
+    }
+
+    //connect the cross-sections in the original branch order
+    const int base = static_cast<int>(result->n_vertices());
+    result->reserve(static_cast<unsigned int>(result->n_vertices() + vertices.size() + nCaps),
+                    static_cast<unsigned int>(result->n_edges() + nEdges),
+                    static_cast<unsigned int>(result->n_faces() + nFaces));
+    for (const auto& p : vertices)
+        result->add_vertex(p);
+    for (std::size_t i = 0; i < nBranches; ++i) {
+        const int n = branchSlices[i];
+        const std::size_t nSections = (offsets[i + 1] - offsets[i]) / n;
+        for (std::size_t nx = 0; nx + 1 < nSections; ++nx) {
+            const int curr = base + static_cast<int>(offsets[i] + nx * n);
+            const int next = curr + n;
+            for (int ny = 0; ny < n; ++ny) {
+                const int ny1 = (ny + 1) % n;
+                result->add_triangle(SurfaceMesh::Vertex(curr + ny), SurfaceMesh::Vertex(curr + ny1), SurfaceMesh::Vertex(next + ny));
+                result->add_triangle(SurfaceMesh::Vertex(next + ny), SurfaceMesh::Vertex(curr + ny1), SurfaceMesh::Vertex(next + ny1));
+            }
+        }
+
+        //close the tube: the first cross-section is triangulated as a fan (facing backwards along the
+        //axis) and the last one is connected to the tip of the branch, so the surface is watertight
+        if (cap_branches_ && nSections >= 2) {
+            const int first = base + static_cast<int>(offsets[i]);
+            for (int ny = 1; ny + 1 < n; ++ny)
+                result->add_triangle(SurfaceMesh::Vertex(first), SurfaceMesh::Vertex(first + ny + 1), SurfaceMesh::Vertex(first + ny));
+
+            const int last = base + static_cast<int>(offsets[i + 1]) - n;
+            const SurfaceMesh::Vertex tip = result->add_vertex(branches[i].points.back());
+            for (int ny = 0; ny < n; ++ny)
+                result->add_triangle(SurfaceMesh::Vertex(last + ny), SurfaceMesh::Vertex(last + (ny + 1) % n), tip);
+        }
+    }
 
-    // remove isolated vertices
+    // remove isolated vertices (the single cross-section of branches with only two points)
     for (auto v : result->vertices()) {
         if (result->is_isolated(v))
             result->delete_vertex(v);
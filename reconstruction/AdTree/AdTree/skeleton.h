@@ -30,17 +30,25 @@
 */
 
 
+#include <string>
+#include <random>
+
 #include <boost/graph/adjacency_list.hpp>
 #include <boost/graph/dijkstra_shortest_paths.hpp>
 #include <3rd_party/kd_tree/Vector3D.h>
 #include <3rd_party/kd_tree/KdTree.h>
 #include <easy3d/core/types.h>
 
+#include "ingest.h"
+#include "reconstruction_params.h"
+
 namespace easy3d {
 	class PointCloud;
     class SurfaceMesh;
 }
 
+class Cylinder;
+
 //define the vertex and edge properties
 struct SGraphVertexProp
 {
@@ -49,6 +57,7 @@ struct SGraphVertexProp
 	double lengthOfSubtree;
 
     double radius; // used only by the smoothed skeleton
+    int    order;  // the branch order (0 for the trunk), used only by the smoothed skeleton
     bool   visited;
 };
 
@@ -56,7 +65,9 @@ struct SGraphEdgeProp
 {
 	double nWeight;
 	double nRadius;
-	std::vector<int> vecPoints;
+	// the points assigned to the edge: Skeleton::EdgePoints_[nPointsBegin, nPointsBegin + nPointsCount)
+	std::size_t nPointsBegin = 0;
+	std::size_t nPointsCount = 0;
 };
 
 
@@ -93,22 +104,104 @@ public:
 	Skeleton();
 	~Skeleton();
 
+    // reconstruct the skeleton and, if 'result' is not null, the surfaces of the branches
     bool reconstruct_branches(const easy3d::PointCloud* cloud, easy3d::SurfaceMesh* result);
     bool reconstruct_leaves(easy3d::SurfaceMesh* result);
 
+    // clear the results for reconstructing another tree. The settings are kept, and so is the memory of
+    // the points, the graphs and the working buffers, which is reused by the next reconstruction.
+    void reset();
+
     /*-------------------------------------------------------------*/
     /*------------ retrieve the intermediate results --------------*/
     /*-------------------------------------------------------------*/
-    const Graph& get_delaunay() const { return delaunay_; }
-    const Graph& get_mst() const { return MST_; }
-    const Graph& get_simplified_skeleton() const { return simplified_skeleton_; }
-    const Graph& get_smoothed_skeleton() const { return smoothed_skeleton_; }
-
+    // the Delaunay graph and the MST are nullptr once released (see set_release_intermediates())
+    const Graph* get_delaunay() const { return release_intermediates_ ? nullptr : &delaunay_; }
+    const Graph* get_mst() const { return release_intermediates_ ? nullptr : &MST_; }
+    const Graph* get_simplified_skeleton() const { return &simplified_skeleton_; }
+    // the graph of the branches, built from them when it is first requested
+    const Graph* get_smoothed_skeleton() const;
+
+    // the smoothed branches (one for each path of the simplified skeleton, the trunk first)
     struct Branch {
         std::vector<easy3d::vec3> points;
         std::vector<double>       radii;
+        int                       order;   // 0 for the trunk, and one more than the branch it starts from
+    };
+    const std::vector<Branch>& get_branches_parameters() const { return branches_; }
+
+    // the constants trading quality for speed (see ReconstructionParams::from_preset())
+    void set_params(const ReconstructionParams& params) { params_ = params; }
+    const ReconstructionParams& params() const { return params_; }
+
+    // also fit cylinders to the first-order branches (by default only the trunk is fitted, see
+    // ReconstructionParams::fit_branches)
+    void set_fit_branches(bool b) { fit_branches_ = b; }
+
+    // adapt the number of slices and samples of the branch surfaces to their radius and curvature, such
+    // that the surfaces deviate at most 'tolerance' from the smooth ones (0 uses the fixed resolution)
+    void set_lod_tolerance(double tolerance) { lod_tolerance_ = tolerance; }
+
+    // close every branch surface with end caps, so the branch model is watertight without hole filling
+    void set_cap_branches(bool b) { cap_branches_ = b; }
+
+    // the seed of the random generator of the leaves. Each reconstruct_leaves() starts a new generator from it,
+    // so the leaves of a tree do not depend on other reconstructions (the same for all trees by default)
+    void set_leaf_seed(unsigned int seed) { leaf_seed_ = seed; }
+
+    // use the statistics and the kd-tree computed while loading the points (see ingest_point_cloud()) instead of
+    // recomputing them. They must be of the same points, in the same order. The skeleton takes the ownership of
+    // the kd-tree.
+    void set_input(const CloudStatistics& stats, KdTree* kdtree);
+
+    // free the Delaunay graph, the MST and the points (with their kd-tree) as soon as the later stages no
+    // longer need them, which lowers the peak memory of a reconstruction
+    void set_release_intermediates(bool b) { release_intermediates_ = b; }
+
+    // compute the topology of the skeleton from the centroids of the points in voxels of the given size, and
+    // refine the vertices and fit the radii against the full-resolution points (0 uses all the points).
+    // With ENGINE_VOXEL, this is the size of the voxel graph (0 adapts it to the density of the points).
+    void set_voxel_size(double size) { voxel_size_ = size; }
+
+    // the methods computing the initial tree graph (the MST) from the points
+    enum Engine {
+        ENGINE_DELAUNAY = 0,    // the shortest paths over the Delaunay graph of the (centralized) points
+        ENGINE_VOXEL    = 1     // the geodesic distance bins of a voxel graph, linear in the number of voxels
     };
-    std::vector<Branch> get_branches_parameters() const;
+    void set_engine(Engine engine) { engine_ = engine; }
+
+    // for clouds of more than 'size' points, triangulate overlapping height slabs of 'size' points (at least
+    // MIN_TET_SLAB_SIZE) and keep only the minimum spanning tree of each slab (0 triangulates all points at once).
+    // This only bounds the memory of tetgen: the points and the graph of the whole cloud are still in memory.
+    enum { MIN_TET_SLAB_SIZE = 1000 };
+    void set_tet_slab_size(int size) { tet_slab_size_ = (size > 0 && size < MIN_TET_SLAB_SIZE) ? MIN_TET_SLAB_SIZE : std::max(size, 0); }
+
+    // the stages of the reconstruction whose state can be saved in a checkpoint file
+    enum Stage {
+        STAGE_NONE       = 0,
+        STAGE_MST        = 1,   // after extracting the MST
+        STAGE_SIMPLIFIED = 2    // after simplifying the skeleton
+    };
+
+    // save the state after the MST extraction and again after the simplification (the graphs, the root vertex,
+    // the initial trunk radius, the tree height and the bounding distance) into 'file_name' while reconstructing
+    void set_checkpoint(const std::string& file_name) { checkpoint_file_ = file_name; }
+
+    // load the state after 'stage' from a checkpoint file saved for the same points (and voxel size), such that
+    // the next reconstruct_branches() only runs the later stages. Call it after reset() and set_input().
+    // Returns false if the file cannot be read, does not have the stage, or was saved for other points.
+    bool load_checkpoint(const std::string& file_name, Stage stage, const easy3d::PointCloud* cloud);
+
+    // load the MST from a checkpoint file saved for a previous version of the points (e.g., before the scans of
+    // another campaign were merged into the cloud), such that the next reconstruct_branches() only recomputes
+    // the MST around the points that were added or removed. It falls back to the full reconstruction if the
+    // root moved or most points changed. Only for ENGINE_DELAUNAY without voxel size (in both reconstructions).
+    bool load_previous(const std::string& file_name, const easy3d::PointCloud* cloud);
+
+    // the memory (in MB) of each stage of the last reconstruction: the peak resident memory of the process during
+    // the stage if stage_memory_is_peak() (only on Linux), otherwise the change of its resident memory in the stage.
+    const std::vector< std::pair<std::string, double> >& get_stage_memory() const { return stage_memory_; }
+    bool stage_memory_is_peak() const { return stage_memory_peak_; }
 
 private:
 
@@ -118,9 +211,20 @@ private:
 	//build the initial delaunay graph from input point cloud
     bool build_delaunay(const easy3d::PointCloud* cloud);
 
+	//the same for big clouds: the union of the minimum spanning trees of overlapping height slabs. Returns false
+	//(without adding edges) if the points cannot be triangulated in slabs.
+    bool add_slab_delaunay_edges(const easy3d::PointCloud* cloud);
+
 	//extract the minimum spanning tree from delaunay graph
     bool extract_mst();
 
+	//the same with ENGINE_VOXEL: a vertex for each connected set of voxels of the same geodesic distance bin
+    bool build_voxel_skeleton(const easy3d::PointCloud* cloud);
+
+	//update the MST of the previous points (see load_previous()): only the changed points and their neighbors are
+	//triangulated and connected to the unchanged tree. Returns false if it has to be recomputed from scratch.
+    bool update_mst(const easy3d::PointCloud* cloud);
+
     //simplify the MST
     bool simplify_skeleton();
 
@@ -144,11 +248,12 @@ private:
 	//remove similar or collapsed edges in an iteratively fashion
     void merge_collapsed_edges();
 
-	//check if the child vertices of the current vertex can be merged
-    bool check_overlap_child_vertex(Graph* i_Graph, SGraphVertexDescriptor i_dVertex);
+	//check if the child vertices of the current vertex can be merged.
+	//if a merge happens, the vertices whose neighborhood changed are appended to o_affected
+    bool check_overlap_child_vertex(Graph* i_Graph, SGraphVertexDescriptor i_dVertex, std::vector<SGraphVertexDescriptor>* o_affected = nullptr);
 
 	//check if the child vertices of the current vertex can be merged
-    bool check_single_child_vertex(Graph* i_Graph, SGraphVertexDescriptor i_dVertex);
+    bool check_single_child_vertex(Graph* i_Graph, SGraphVertexDescriptor i_dVertex, std::vector<SGraphVertexDescriptor>* o_affected = nullptr);
 
 	//merge from source vertex to target vertex
     bool merge_vertices(Graph* i_Graph, SGraphVertexDescriptor i_dSource, SGraphVertexDescriptor i_dTarget, double i_wSource, double i_wTarget);
@@ -164,7 +269,7 @@ private:
 	//find and assign the root vertex in the input graph
     void compute_root_vertex(Graph* i_Graph);
 
-	//compute the length of subtree for each vertex using a recursive method
+	//compute the length of subtree for each vertex below the given vertex (iteratively, see SkeletonTraversal)
     void compute_length_of_subtree(Graph* i_Graph, SGraphVertexDescriptor i_dVertex);
 
 	//compute weights of edges according to the subtreelength of the end vertices
@@ -176,28 +281,53 @@ private:
 	//compute the merge value between the source vertex and the target vertex
     double compute_merge_value(Graph* i_Graph, SGraphVertexDescriptor i_dSource, SGraphVertexDescriptor i_dTarget);
 
+	//the same from the length of the two edges, the cosine of their angle and the radius of the target edge
+    double compute_merge_value(double nLengthSource, double nLengthTarget, double alpha, double nRadiusTarget);
+
 
 
 	/*-------------------------------------------------------------*/
 	/*--------------method for point cloud processing -------------*/
 	/*-------------------------------------------------------------*/
 	//identify and centralize main branch points according to the density
-    std::vector<Vector3D> centralize_main_points(easy3d::PointCloud* cloud);
+    const std::vector<Vector3D>& centralize_main_points(easy3d::PointCloud* cloud);
+
+	//copy the points and build their kd-tree (unless it was shared from the loading stage)
+    void load_points(const easy3d::PointCloud* cloud);
 
 	//compute to get the initial guess for trunk radius from the raw points
     void obtain_initial_radius(easy3d::PointCloud* cloud);
 
+	//save the state after the given stage into the checkpoint file
+    bool save_checkpoint(Stage stage, const easy3d::PointCloud* cloud) const;
+
+	//start measuring the memory of the next stage, and record it when the stage is done (see get_stage_memory())
+    void start_stage_memory();
+    void record_stage_memory(const char* stage);
+
 
 
 	/*-------------------------------------------------------------*/
 	/*------------------method for branch fitting -----------------*/
 	/*-------------------------------------------------------------*/
+	//refine the vertices of the simplified skeleton (computed from the voxel centroids) against the full-resolution points
+    void refine_vertex_positions(const std::vector<Vector3D>& finePoints, const KdTree* fineTree);
+
 	//assign points to branch edges
     void assign_points_to_edges();
 
 	//fit accurate cylinder to the trunk
     void fit_trunk();
 
+	//fit accurate cylinders to the first edge of the branches attached to the main stem
+    void fit_first_order_branches();
+
+	//collect the points of an edge and compute the initial cylinder from their principal axis
+    Cylinder initial_edge_cylinder(SGraphEdgeDescriptor i_Edge, std::vector< std::vector<double> >& o_ptlist, Vector3D& o_pSource, Vector3D& o_pTarget) const;
+
+	//set the weights of the points according to their distance to the fitted cylinder
+    static void update_fitting_weights(Cylinder& i_Cylinder, std::vector< std::vector<double> >& io_ptlist);
+
 
 
 	/*-------------------------------------------------------------*/
@@ -207,7 +337,7 @@ private:
     std::vector<SGraphVertexDescriptor> find_end_vertices();
 
 	//generate random leaves for each leaf vertex
-    void generate_leaves(SGraphVertexDescriptor i_LeafVertex, double leafsize_Factor);
+    void generate_leaves(SGraphVertexDescriptor i_LeafVertex, double leafsize_Factor, std::mt19937& rng);
 
 
 
@@ -217,38 +347,101 @@ private:
 	//find path for smoothing the graph
 	void get_graph_for_smooth(std::vector<Path> &pathList);
 
+	// the hermite curve A * t^3 + B * t^2 + C * t + D of an edge of a path, sampled at t = n / nSamples
+	struct HermiteSegment {
+		easy3d::vec3 A, B, C, D;
+		double sourceRadius;
+		double deltaOfRadius;
+		int    nSamples;
+	};
+	//fit the hermite curves to the edges of a path
+	void fit_hermite_segments(const Path& currentPath, std::vector<HermiteSegment>& segments) const;
+
 
     /*-------------------------------------------------------------*/
     /*------------ method for surface extraction ------------------*/
     /*-------------------------------------------------------------*/
-    // mesh a generalized cylinder to a surface mesh
-    void add_generalized_cylinder_to_model(
-            easy3d::SurfaceMesh* mesh,
-            const Branch& points,
-            int slices);
+    // compute the cross-section vertices of a generalized cylinder, one cross-section of
+    // cosines.size() vertices for each but the last point of the branch
+    void compute_generalized_cylinder(
+            const Branch& branch,
+            const std::vector<float>& cosines,
+            const std::vector<float>& sines,
+            easy3d::vec3* vertices) const;
 
 private:
 	/*store points and kd index*/
-	Vector3D* Points_;
+	std::vector<Vector3D> Points_;
 	KdTree* KDtree_;
 
+	/*indices of the points assigned to the edges of the simplified skeleton*/
+	std::vector<int> EdgePoints_;
+
 	/*store initial and fine skeleton*/
     Graph   delaunay_;
     Graph   MST_;
     Graph   simplified_skeleton_;
-    Graph   smoothed_skeleton_;
+    mutable Graph smoothed_skeleton_;	// only built on demand (see get_smoothed_skeleton())
+    std::vector<Branch> branches_;
 
 	/*store leaves*/
 	std::vector<Leaf> VecLeaves_;
 
 	/*store important vertex and geometrical attributes*/
 	SGraphVertexDescriptor RootV_;
+	SGraphVertexDescriptor SimplifiedRootV_;	// the simplified skeleton only has the kept vertices of the MST
 	Vector3D RootPos_;
 	double TrunkRadius_;
 	double TreeHeight_;
 	double BoundingDistance_;
 
     bool   quiet_;
+    ReconstructionParams params_;
+    bool   fit_branches_;
+    double lod_tolerance_;
+    bool   cap_branches_;
+    unsigned int leaf_seed_;
+
+    bool            has_input_stats_;
+    CloudStatistics input_stats_;
+
+    // the working buffers of the pipeline, kept to be reused by the next reconstruction (see reset())
+    struct Workspace {
+        std::vector<double>             queryThreshold;
+        std::vector<unsigned char>      toCentralize;
+        std::vector<double>             densityList;
+        std::vector<int>                neighbourBegin;
+        std::vector<int>                localOwner;
+        std::vector<int>                localBegin;
+        std::vector< std::vector<int> > localNeighbours;
+        std::vector<int>                neighbourIndices;
+        std::vector<Vector3D>           centralized;
+        std::vector<double>             distances;
+        std::vector<SGraphVertexDescriptor> parents;
+        std::vector<SGraphEdgeDescriptor>   keptEdges;
+        std::vector<SGraphVertexDescriptor> keptIndex;
+    };
+    Workspace workspace_;
+
+    bool release_intermediates_;
+    std::vector< std::pair<std::string, double> > stage_memory_;
+    bool   stage_memory_peak_;
+    double memory_mark_;    // the resident memory at the start of the current stage
+
+    double voxel_size_;
+    int    tet_slab_size_;
+    Engine engine_;
+
+    std::string checkpoint_file_;
+    Stage       resume_stage_;   // the stage loaded from a checkpoint, cleared once the reconstruction resumes
+
+    // the MST of the previous version of the points (see load_previous()), cleared once it was updated
+    struct PreviousTree {
+        std::vector<Vector3D>    points;    // the input points, in the frame of the current point cloud
+        std::vector<std::size_t> parents;   // the parent of each point in the MST
+        std::size_t              root;
+    };
+    PreviousTree previous_;
 };
 
 #endif
@@ -0,0 +1,330 @@
+/*
+*	Copyright (C) 2019 by
+*       Shenglan Du (dushenglan940128@163.com)
+*       Liangliang Nan (liangliang.nan@gmail.com)
+*       3D Geoinformation, TU Delft, https://3d.bk.tudelft.nl
+*
+*	This file is part of AdTree, which implements the 3D tree
+*   reconstruction method described in the following paper:
+*   -------------------------------------------------------------------------------------
+*       Shenglan Du, Roderik Lindenbergh, Hugo Ledoux, Jantien Stoter, and Liangliang Nan.
+*       AdTree: Accurate, Detailed, and Automatic Modeling of Laser-Scanned Trees.
+*       Remote Sensing. 2019, 11(18), 2074.
+*   -------------------------------------------------------------------------------------
+*   Please consider citing the above paper if you use the code/program (or part of it).
+*
+*	AdTree is free software; you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License Version 3
+*	as published by the Free Software Foundation.
+*
+*	AdTree is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "skeleton.h"
+
+#include <easy3d/core/point_cloud.h>
+
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+
+
+using namespace easy3d;
+
+
+// The checkpoint file (native byte order, not meant to be shared between machines):
+//   char[8] "ADTCKPT", uint32 version (1), uint32 stage, uint32 engine, uint64 number of input points,
+//   uint64 hash of the input points (FNV-1a of their translation and coordinates), double voxel size, int32 tetgen slab size, double centralization range, double subtree threshold (see ReconstructionParams),
+//   uint64 root vertex, double[3] root position, double trunk radius, tree height, bounding distance,
+//   the MST, the simplified skeleton and its uint64 root vertex if the stage is STAGE_SIMPLIFIED (it only has
+//   the kept vertices of the MST), double[3] translation of the input
+//   points, and the input points (float[3] each, relative to the translation) to update the MST later.
+// Each graph is stored as uint64 n, n x {float[3] position, uint64 parent, double subtree length},
+// uint64 m, m x {uint64 source, uint64 target, double weight, double radius}, with the edges in the order
+// of boost::edges(), so the loaded graphs are traversed in the same order as the saved ones.
+
+namespace {
+
+	const char kMagic[8] = { 'A', 'D', 'T', 'C', 'K', 'P', 'T', '\0' };
+	const std::uint32_t kVersion = 1;
+
+	template <typename T>
+	void write_value(std::ostream& output, const T& value) {
+		output.write(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	template <typename T>
+	bool read_value(std::istream& input, T& value) {
+		input.read(reinterpret_cast<char*>(&value), sizeof(T));
+		return !input.fail();
+	}
+
+	void write_graph(std::ostream& output, const Graph& graph) {
+		write_value<std::uint64_t>(output, num_vertices(graph));
+		std::pair<SGraphVertexIterator, SGraphVertexIterator> vp = vertices(graph);
+		for (SGraphVertexIterator vIter = vp.first; vIter != vp.second; ++vIter) {
+			const SGraphVertexProp& v = graph[*vIter];
+			write_value(output, v.cVert);
+			write_value<std::uint64_t>(output, v.nParent);
+			write_value(output, v.lengthOfSubtree);
+		}
+
+		write_value<std::uint64_t>(output, num_edges(graph));
+		std::pair<SGraphEdgeIterator, SGraphEdgeIterator> ep = edges(graph);
+		for (SGraphEdgeIterator eIter = ep.first; eIter != ep.second; ++eIter) {
+			write_value<std::uint64_t>(output, source(*eIter, graph));
+			write_value<std::uint64_t>(output, target(*eIter, graph));
+			write_value(output, graph[*eIter].nWeight);
+			write_value(output, graph[*eIter].nRadius);
+		}
+	}
+
+	bool read_graph(std::istream& input, Graph& graph) {
+		graph.clear();
+		std::uint64_t nVertices = 0;
+		if (!read_value(input, nVertices))
+			return false;
+		for (std::uint64_t i = 0; i < nVertices; ++i) {
+			SGraphVertexProp pV;
+			std::uint64_t parent = 0;
+			if (!read_value(input, pV.cVert) || !read_value(input, parent) || !read_value(input, pV.lengthOfSubtree))
+				return false;
+			pV.nParent = static_cast<std::size_t>(parent);
+			add_vertex(pV, graph);
+		}
+
+		std::uint64_t nEdges = 0;
+		if (!read_value(input, nEdges))
+			return false;
+		for (std::uint64_t i = 0; i < nEdges; ++i) {
+			std::uint64_t s = 0, t = 0;
+			SGraphEdgeProp pEdge;
+			if (!read_value(input, s) || !read_value(input, t) || !read_value(input, pEdge.nWeight) || !read_value(input, pEdge.nRadius))
+				return false;
+			if (s >= nVertices || t >= nVertices)
+				return false;
+			add_edge(vertex(s, graph), vertex(t, graph), pEdge, graph);
+		}
+		return true;
+	}
+
+
+	// the fixed-size part of the checkpoint file
+	struct Header {
+		std::uint32_t stage;
+		std::uint32_t engine;
+		std::uint64_t nPoints;
+		std::uint64_t pointsHash;
+		double voxelSize;
+		std::int32_t slabSize;
+		double centralizeRange;
+		double subtreeThreshold;
+	};
+
+	bool read_header(std::istream& input, const std::string& file_name, Header& header) {
+		char magic[sizeof(kMagic)];
+		std::uint32_t version = 0;
+		input.read(magic, sizeof(magic));
+		if (input.fail() || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0 || !read_value(input, version) || version != kVersion) {
+			std::cerr << "\'" << file_name << "\' is not a checkpoint file of this version" << std::endl;
+			return false;
+		}
+		if (!read_value(input, header.stage) || !read_value(input, header.engine) || !read_value(input, header.nPoints) ||
+			!read_value(input, header.pointsHash) || !read_value(input, header.voxelSize) || !read_value(input, header.slabSize) || !read_value(input, header.centralizeRange) || !read_value(input, header.subtreeThreshold)) {
+			std::cerr << "failed to read checkpoint file \'" << file_name << "\'" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	dvec3 translation_of(const PointCloud* cloud) {
+		PointCloud::ModelProperty<dvec3> prop = cloud->get_model_property<dvec3>("translation");
+		return prop ? prop[0] : dvec3(0, 0, 0);
+	}
+
+	// identifies the input points, so a checkpoint is not resumed for other points of the same number
+	std::uint64_t points_hash(const PointCloud* cloud) {
+		std::uint64_t hash = 14695981039346656037ull;
+		const auto add = [&hash](const void* data, std::size_t size) {
+			const unsigned char* bytes = static_cast<const unsigned char*>(data);
+			for (std::size_t i = 0; i < size; ++i) {
+				hash ^= bytes[i];
+				hash *= 1099511628211ull;
+			}
+		};
+		const dvec3 translation = translation_of(cloud);
+		add(&translation, sizeof(translation));
+		const std::vector<vec3>& points = cloud->points();
+		add(points.data(), points.size() * sizeof(vec3));
+		return hash;
+	}
+
+}
+
+
+bool Skeleton::save_checkpoint(Stage stage, const PointCloud* cloud) const
+{
+	std::ofstream output(checkpoint_file_.c_str(), std::ios::binary);
+	if (output.fail()) {
+		std::cerr << "could not open checkpoint file \'" << checkpoint_file_ << "\'" << std::endl;
+		return false;
+	}
+
+	output.write(kMagic, sizeof(kMagic));
+	write_value(output, kVersion);
+	write_value<std::uint32_t>(output, stage);
+	write_value<std::uint32_t>(output, engine_);
+	write_value<std::uint64_t>(output, cloud->n_vertices());
+	write_value(output, points_hash(cloud));
+	write_value(output, voxel_size_);
+	write_value<std::int32_t>(output, tet_slab_size_);
+	write_value(output, params_.centralize_range);
+	write_value(output, params_.subtree_threshold);
+	write_value<std::uint64_t>(output, RootV_);
+	write_value<double>(output, RootPos_.x);
+	write_value<double>(output, RootPos_.y);
+	write_value<double>(output, RootPos_.z);
+	write_value(output, TrunkRadius_);
+	write_value(output, TreeHeight_);
+	write_value(output, BoundingDistance_);
+
+	write_graph(output, MST_);
+	if (stage == STAGE_SIMPLIFIED) {
+		write_graph(output, simplified_skeleton_);
+		write_value<std::uint64_t>(output, SimplifiedRootV_);
+	}
+
+	const dvec3 translation = translation_of(cloud);
+	write_value(output, translation.x);
+	write_value(output, translation.y);
+	write_value(output, translation.z);
+	const std::vector<vec3>& points = cloud->points();
+	output.write(reinterpret_cast<const char*>(points.data()), points.size() * sizeof(vec3));
+
+	if (output.fail()) {
+		std::cerr << "failed to save checkpoint into file \'" << checkpoint_file_ << "\'" << std::endl;
+		return false;
+	}
+	if (!quiet_)
+		std::cout << "checkpoint saved to: " << checkpoint_file_ << std::endl;
+	return true;
+}
+
+
+bool Skeleton::load_checkpoint(const std::string& file_name, Stage stage, const PointCloud* cloud)
+{
+	std::ifstream input(file_name.c_str(), std::ios::binary);
+	if (input.fail()) {
+		std::cerr << "could not open checkpoint file \'" << file_name << "\'" << std::endl;
+		return false;
+	}
+
+	Header header;
+	if (!read_header(input, file_name, header))
+		return false;
+	if (header.stage < static_cast<std::uint32_t>(stage)) {
+		std::cerr << "checkpoint \'" << file_name << "\' was saved before the requested stage" << std::endl;
+		return false;
+	}
+	if (header.nPoints != cloud->n_vertices() || header.pointsHash != points_hash(cloud) || header.voxelSize != voxel_size_ || header.slabSize != tet_slab_size_ || header.engine != static_cast<std::uint32_t>(engine_)) {
+		std::cerr << "checkpoint \'" << file_name << "\' was saved for other points, another voxel or slab size, or another engine" << std::endl;
+		return false;
+	}
+	//the MST depends on the centralization, and the simplified skeleton also on the subtree threshold
+	if (header.centralizeRange != params_.centralize_range || (stage == STAGE_SIMPLIFIED && header.subtreeThreshold != params_.subtree_threshold)) {
+		std::cerr << "checkpoint \'" << file_name << "\' was saved with other reconstruction parameters" << std::endl;
+		return false;
+	}
+
+	std::uint64_t root = 0, simplifiedRoot = 0;
+	double rootX = 0, rootY = 0, rootZ = 0;
+	bool ok = read_value(input, root) && read_value(input, rootX) && read_value(input, rootY) && read_value(input, rootZ) &&
+		read_value(input, TrunkRadius_) && read_value(input, TreeHeight_) && read_value(input, BoundingDistance_) &&
+		read_graph(input, MST_);
+	if (ok && stage == STAGE_SIMPLIFIED)
+		ok = read_graph(input, simplified_skeleton_) && read_value(input, simplifiedRoot) && simplifiedRoot < num_vertices(simplified_skeleton_);
+	if (!ok || root >= num_vertices(MST_)) {
+		std::cerr << "failed to read checkpoint file \'" << file_name << "\'" << std::endl;
+		MST_.clear();
+		simplified_skeleton_.clear();
+		return false;
+	}
+	RootV_ = static_cast<SGraphVertexDescriptor>(root);
+	SimplifiedRootV_ = static_cast<SGraphVertexDescriptor>(simplifiedRoot);
+	RootPos_ = Vector3D(rootX, rootY, rootZ);
+
+	resume_stage_ = stage;
+	if (!quiet_)
+		std::cout << "resuming from checkpoint: " << file_name << std::endl;
+	return true;
+}
+
+
+bool Skeleton::load_previous(const std::string& file_name, const PointCloud* cloud)
+{
+	std::ifstream input(file_name.c_str(), std::ios::binary);
+	if (input.fail()) {
+		std::cerr << "could not open checkpoint file \'" << file_name << "\'" << std::endl;
+		return false;
+	}
+
+	//the vertices of the MST are the input points only if they were triangulated without subsampling
+	Header header;
+	if (!read_header(input, file_name, header))
+		return false;
+	if (header.stage < STAGE_MST || header.engine != ENGINE_DELAUNAY || header.voxelSize != 0.0 || engine_ != ENGINE_DELAUNAY || voxel_size_ != 0.0) {
+		std::cerr << "checkpoint \'" << file_name << "\' cannot be updated (it needs the Delaunay engine without voxel size)" << std::endl;
+		return false;
+	}
+	//the unchanged part of the MST is kept, so it must come from the same graph (triangulated at once or in slabs)
+	if (header.slabSize != tet_slab_size_) {
+		std::cerr << "checkpoint \'" << file_name << "\' was saved with another slab size" << std::endl;
+		return false;
+	}
+	if (header.centralizeRange != params_.centralize_range) {
+		std::cerr << "checkpoint \'" << file_name << "\' was saved with other reconstruction parameters" << std::endl;
+		return false;
+	}
+
+	//the graphs are followed by the translation and the input points. The root position, the trunk radius, the
+	//tree height and the bounding distance are those of the current points.
+	std::uint64_t root = 0;
+	double state[6];
+	std::uint64_t simplifiedRoot = 0;
+	Graph mst, simplified;
+	bool ok = read_value(input, root) && read_value(input, state) && read_graph(input, mst) &&
+		(header.stage < STAGE_SIMPLIFIED || (read_graph(input, simplified) && read_value(input, simplifiedRoot)));
+	double translation[3] = { 0, 0, 0 };
+	ok = ok && read_value(input, translation) && num_vertices(mst) == header.nPoints && root < header.nPoints;
+	std::vector<vec3> points(ok ? header.nPoints : 0);
+	if (ok) {
+		input.read(reinterpret_cast<char*>(points.data()), points.size() * sizeof(vec3));
+		ok = !input.fail();
+	}
+	if (!ok) {
+		std::cerr << "failed to read checkpoint file \'" << file_name << "\'" << std::endl;
+		return false;
+	}
+
+	//the previous points in the frame of the current ones
+	const dvec3 current = translation_of(cloud);
+	const dvec3 offset(translation[0] - current.x, translation[1] - current.y, translation[2] - current.z);
+	previous_.points.resize(points.size());
+	previous_.parents.resize(points.size());
+	for (std::size_t i = 0; i < points.size(); ++i) {
+		previous_.points[i] = Vector3D(points[i].x + offset.x, points[i].y + offset.y, points[i].z + offset.z);
+		previous_.parents[i] = mst[vertex(i, mst)].nParent;
+	}
+	previous_.root = static_cast<std::size_t>(root);
+
+	if (!quiet_)
+		std::cout << "updating the MST of " << points.size() << " previous points from: " << file_name << std::endl;
+	return true;
+}
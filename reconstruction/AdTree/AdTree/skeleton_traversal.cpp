@@ -0,0 +1,85 @@
+/*
+*	Copyright (C) 2019 by
+*       Shenglan Du (dushenglan940128@163.com)
+*       Liangliang Nan (liangliang.nan@gmail.com)
+*       3D Geoinformation, TU Delft, https://3d.bk.tudelft.nl
+*
+*	This file is part of AdTree, which implements the 3D tree
+*   reconstruction method described in the following paper:
+*   -------------------------------------------------------------------------------------
+*       Shenglan Du, Roderik Lindenbergh, Hugo Ledoux, Jantien Stoter, and Liangliang Nan.
+*       AdTree: Accurate, Detailed, and Automatic Modeling of Laser-Scanned Trees.
+*       Remote Sensing. 2019, 11(18), 2074.
+*   -------------------------------------------------------------------------------------
+*   Please consider citing the above paper if you use the code/program (or part of it).
+*
+*	AdTree is free software; you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License Version 3
+*	as published by the Free Software Foundation.
+*
+*	AdTree is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "skeleton_traversal.h"
+
+#include <algorithm>
+
+
+SkeletonTraversal::SkeletonTraversal(const Graph& graph, SGraphVertexDescriptor root)
+{
+    const std::size_t n = num_vertices(graph);
+    childBegin_.assign(n + 1, 0);
+    std::vector<std::size_t> depth(n, 0);
+    std::size_t maxDepth = 0;
+
+    //collect the children of each vertex while visiting the vertices in pre-order. The
+    //children of a vertex are stored when it is visited, so they are contiguous only after
+    //the reordering below.
+    std::vector<std::size_t> visitBegin(n, 0), visitCount(n, 0);
+    std::vector<SGraphVertexDescriptor> visitChildren;
+    std::vector<SGraphVertexDescriptor> stack;
+    stack.push_back(root);
+    while (!stack.empty())
+    {
+        SGraphVertexDescriptor currentV = stack.back();
+        stack.pop_back();
+        preOrder_.push_back(currentV);
+        visitBegin[currentV] = visitChildren.size();
+        std::pair<SGraphAdjacencyIterator, SGraphAdjacencyIterator> aj = adjacent_vertices(currentV, graph);
+        for (SGraphAdjacencyIterator aIter = aj.first; aIter != aj.second; ++aIter)
+        {
+            if (*aIter != graph[currentV].nParent)
+            {
+                visitChildren.push_back(*aIter);
+                depth[*aIter] = depth[currentV] + 1;
+                maxDepth = std::max(maxDepth, depth[*aIter]);
+                stack.push_back(*aIter);
+            }
+        }
+        visitCount[currentV] = visitChildren.size() - visitBegin[currentV];
+    }
+
+    //children in CSR layout indexed by vertex descriptor
+    for (std::size_t v = 0; v < n; ++v)
+        childBegin_[v + 1] = childBegin_[v] + visitCount[v];
+    children_.resize(visitChildren.size());
+    for (std::size_t v = 0; v < n; ++v)
+        std::copy(visitChildren.begin() + visitBegin[v], visitChildren.begin() + visitBegin[v] + visitCount[v], children_.begin() + childBegin_[v]);
+
+    //group the vertices by depth (counting sort, keeping the pre-order within a level)
+    levelBegin_.assign(maxDepth + 2, 0);
+    for (std::size_t i = 0; i < preOrder_.size(); ++i)
+        ++levelBegin_[depth[preOrder_[i]] + 1];
+    for (std::size_t l = 0; l <= maxDepth; ++l)
+        levelBegin_[l + 1] += levelBegin_[l];
+    levels_.resize(preOrder_.size());
+    std::vector<std::size_t> cursor(levelBegin_.begin(), levelBegin_.end() - 1);
+    for (std::size_t i = 0; i < preOrder_.size(); ++i)
+        levels_[cursor[depth[preOrder_[i]]]++] = preOrder_[i];
+}
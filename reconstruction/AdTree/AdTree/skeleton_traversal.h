@@ -0,0 +1,107 @@
+#ifndef ADTREE_SKELETON_TRAVERSAL_H
+#define ADTREE_SKELETON_TRAVERSAL_H
+
+/*
+*	Copyright (C) 2019 by
+*       Shenglan Du (dushenglan940128@163.com)
+*       Liangliang Nan (liangliang.nan@gmail.com)
+*       3D Geoinformation, TU Delft, https://3d.bk.tudelft.nl
+*
+*	This file is part of AdTree, which implements the 3D tree
+*   reconstruction method described in the following paper:
+*   -------------------------------------------------------------------------------------
+*       Shenglan Du, Roderik Lindenbergh, Hugo Ledoux, Jantien Stoter, and Liangliang Nan.
+*       AdTree: Accurate, Detailed, and Automatic Modeling of Laser-Scanned Trees.
+*       Remote Sensing. 2019, 11(18), 2074.
+*   -------------------------------------------------------------------------------------
+*   Please consider citing the above paper if you use the code/program (or part of it).
+*
+*	AdTree is free software; you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License Version 3
+*	as published by the Free Software Foundation.
+*
+*	AdTree is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "skeleton.h"
+
+#include <vector>
+
+
+//iterative traversal of a skeleton tree (MST or simplified skeleton) from its root vertex.
+//the children of a vertex are its adjacent vertices except its parent (nParent), in the
+//adjacency order of the graph. Only the vertices reachable from the root are visited.
+class SkeletonTraversal
+{
+public:
+    SkeletonTraversal(const Graph& graph, SGraphVertexDescriptor root);
+
+    //vertices in depth-first pre-order: a vertex comes before all vertices of its subtree.
+    //this is the order of a stack-based traversal that pushes the children in adjacency order
+    const std::vector<SGraphVertexDescriptor>& pre_order() const { return preOrder_; }
+
+    //number of children of a visited vertex
+    std::size_t num_children(SGraphVertexDescriptor v) const { return childBegin_[v + 1] - childBegin_[v]; }
+
+    //the children of a visited vertex
+    const SGraphVertexDescriptor* children_begin(SGraphVertexDescriptor v) const { return children_.data() + childBegin_[v]; }
+    const SGraphVertexDescriptor* children_end(SGraphVertexDescriptor v) const { return children_.data() + childBegin_[v + 1]; }
+
+    //calls fn(v) for all visited vertices such that the children of a vertex are processed
+    //before the vertex itself (post-order). If parallel is true, the vertices of the same depth
+    //are processed concurrently (deepest level first), so fn must only write to v.
+    template <typename Fn>
+    void for_each_bottom_up(Fn fn, bool parallel = false) const;
+
+    //calls fn(v) for all visited vertices in pre-order
+    template <typename Fn>
+    void for_each_top_down(Fn fn) const;
+
+private:
+    std::vector<SGraphVertexDescriptor> preOrder_;
+
+    //children of each vertex in CSR layout, indexed by vertex descriptor
+    std::vector<std::size_t> childBegin_;
+    std::vector<SGraphVertexDescriptor> children_;
+
+    //visited vertices grouped by their depth (CSR layout)
+    std::vector<std::size_t> levelBegin_;
+    std::vector<SGraphVertexDescriptor> levels_;
+};
+
+
+template <typename Fn>
+void SkeletonTraversal::for_each_bottom_up(Fn fn, bool parallel) const
+{
+    if (!parallel) {
+        for (std::size_t i = preOrder_.size(); i-- > 0; )
+            fn(preOrder_[i]);
+        return;
+    }
+
+    for (std::size_t l = levelBegin_.size() - 1; l-- > 0; ) {
+        const long first = static_cast<long>(levelBegin_[l]);
+        const long last = static_cast<long>(levelBegin_[l + 1]);
+        //small levels (e.g. along a long stem) are not worth a parallel region
+#pragma omp parallel for if (last - first >= 512)
+        for (long i = first; i < last; ++i)
+            fn(levels_[i]);
+    }
+}
+
+
+template <typename Fn>
+void SkeletonTraversal::for_each_top_down(Fn fn) const
+{
+    for (std::size_t i = 0; i < preOrder_.size(); ++i)
+        fn(preOrder_[i]);
+}
+
+#endif
@@ -0,0 +1,283 @@
+/*
+*	Copyright (C) 2019 by
+*       Shenglan Du (dushenglan940128@163.com)
+*       Liangliang Nan (liangliang.nan@gmail.com)
+*       3D Geoinformation, TU Delft, https://3d.bk.tudelft.nl
+*
+*	This file is part of AdTree, which implements the 3D tree
+*   reconstruction method described in the following paper:
+*   -------------------------------------------------------------------------------------
+*       Shenglan Du, Roderik Lindenbergh, Hugo Ledoux, Jantien Stoter, and Liangliang Nan.
+*       AdTree: Accurate, Detailed, and Automatic Modeling of Laser-Scanned Trees.
+*       Remote Sensing. 2019, 11(18), 2074.
+*   -------------------------------------------------------------------------------------
+*   Please consider citing the above paper if you use the code/program (or part of it).
+*
+*	AdTree is free software; you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License Version 3
+*	as published by the Free Software Foundation.
+*
+*	AdTree is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "skeleton.h"
+
+#include <easy3d/core/point_cloud.h>
+#include <3rd_party/tetgen/tetgen.h>
+
+#include <iostream>
+#include <queue>
+#include <functional>
+#include <cfloat>
+
+
+using namespace easy3d;
+
+
+namespace {
+
+	// the number of nearest neighbors of a changed point whose paths to the root are recomputed as well
+	const unsigned int kNeighbors = 16;
+
+}
+
+
+bool Skeleton::update_mst(const PointCloud* cloud)
+{
+	MST_.clear();
+
+	//the centralization is linear in the number of points (unlike the Delaunay graph), so it is redone for all of them
+	const std::vector<Vector3D>& centralized = centralize_main_points(const_cast<PointCloud*>(cloud));
+	const int nPoints = static_cast<int>(Points_.size());
+	const int nPrevious = static_cast<int>(previous_.points.size());
+
+	//match the points to the previous ones, which only differ by rounding errors (the duplicates are removed
+	//at a much larger distance)
+	const float tolerance = static_cast<float>(1e-5 * BoundingDistance_);
+	KdTree previousTree(previous_.points.data(), nPrevious, 16);
+	std::vector<int> match(nPoints, -1);
+#pragma omp parallel
+	{
+		KdTreeQuery query;
+#pragma omp for schedule(dynamic, 256)
+		for (int i = 0; i < nPoints; i++)
+		{
+			previousTree.queryPosition(query, Points_[i]);
+			if (query.getNOfFoundNeighbours() > 0 && query.getSquaredDistance(0) <= tolerance * tolerance)
+				match[i] = query.getNeighbourPositionIndex(0);
+		}
+	}
+	std::vector<int> current(nPrevious, -1);
+	for (int i = 0; i < nPoints; i++)
+	{
+		if (match[i] < 0)
+			continue;
+		if (current[match[i]] < 0)
+			current[match[i]] = i;
+		else
+			match[i] = -1;
+	}
+
+	//the MST keeps the root of the previous one
+	for (int i = 0; i < nPoints; i++)
+	{
+		SGraphVertexProp pV;
+		pV.cVert = vec3(centralized[i].x, centralized[i].y, centralized[i].z);
+		pV.nParent = 0;
+		pV.lengthOfSubtree = 0.0;
+		add_vertex(pV, MST_);
+	}
+	compute_root_vertex(&MST_);
+	if (match[RootV_] < 0 || static_cast<std::size_t>(match[RootV_]) != previous_.root)
+	{
+		if (!quiet_)
+			std::cout << "the root changed, the MST is recomputed" << std::endl;
+		return false;
+	}
+
+	//the weights of the Delaunay graph
+	auto weight = [this](int a, int b) -> double {
+		return MST_[vertex(a, MST_)].cVert.distance2(MST_[vertex(b, MST_)].cVert);
+	};
+
+	//the changed points: the new ones, and the ones whose parent was removed
+	std::vector<int> parent(nPoints, -1);
+	std::vector<int> changed;
+	for (int i = 0; i < nPoints; i++)
+	{
+		if (match[i] >= 0)
+			parent[i] = current[previous_.parents[match[i]]];
+		if (parent[i] < 0 && i != static_cast<int>(RootV_))
+			changed.push_back(i);
+	}
+	parent[RootV_] = static_cast<int>(RootV_);
+	if (changed.size() * 2 > static_cast<std::size_t>(nPoints))
+	{
+		if (!quiet_)
+			std::cout << "most points changed, the MST is recomputed" << std::endl;
+		return false;
+	}
+
+	//only the changed points and their neighbors are triangulated
+	int nLocal = 0;
+	if (!changed.empty())
+	{
+		//the points whose paths are recomputed: the changed points and their nearest neighbors
+		std::vector<unsigned char> relaxed(nPoints, 0), isLocal(nPoints, 0);
+		std::vector<int> local;
+		auto add_neighbors = [&](std::size_t first, std::size_t last) {
+			KdTreeQuery query;
+			query.setNOfNeighbours(kNeighbors);
+			for (std::size_t i = first; i < last; i++)
+			{
+				KDtree_->queryPosition(query, Points_[local[i]]);
+				for (unsigned int np = 0; np < query.getNOfFoundNeighbours(); np++)
+				{
+					const int index = query.getNeighbourPositionIndex(np);
+					if (!isLocal[index])
+					{
+						isLocal[index] = 1;
+						local.push_back(index);
+					}
+				}
+			}
+		};
+		for (std::size_t i = 0; i < changed.size(); i++)
+		{
+			isLocal[changed[i]] = 1;
+			local.push_back(changed[i]);
+		}
+		add_neighbors(0, changed.size());
+		const std::size_t nRegion = local.size();
+		for (std::size_t i = 0; i < nRegion; i++)
+			relaxed[local[i]] = (local[i] != static_cast<int>(RootV_));
+
+		//the distances from the root along the unchanged tree (with the same weights as the Delaunay graph). The
+		//anchored points are those whose whole path to the root is kept.
+		std::vector<double> distance(nPoints, -1.0);
+		std::vector<unsigned char> anchored(nPoints, 0);
+		distance[RootV_] = 0.0;
+		anchored[RootV_] = 1;
+		std::vector<int> path;
+		for (int i = 0; i < nPoints; i++)
+		{
+			int v = i;
+			while (distance[v] < 0 && !relaxed[v])
+			{
+				path.push_back(v);
+				v = parent[v];
+			}
+			const bool isAnchored = !relaxed[v] && anchored[v];
+			double d = relaxed[v] ? 0.0 : distance[v];
+			for (std::size_t k = path.size(); k-- > 0; )
+			{
+				const int u = path[k];
+				d += weight(u, parent[u]);
+				distance[u] = d;
+				anchored[u] = isAnchored;
+			}
+			path.clear();
+		}
+
+		//the ring of neighbors around the region: the anchored ones are the sources of the shortest paths, the
+		//others (below a changed point) need a new path as well
+		add_neighbors(0, nRegion);
+		for (std::size_t i = nRegion; i < local.size(); i++)
+			relaxed[local[i]] = !anchored[local[i]];
+		if (!isLocal[RootV_])
+			local.push_back(static_cast<int>(RootV_));
+
+		//the Delaunay graph of the local points
+		nLocal = static_cast<int>(local.size());
+		if (nLocal < 4)
+			return false;
+		tetgenio tet_in, tet_out;
+		tet_in.numberofpoints = nLocal;
+		tet_in.pointlist = new REAL[nLocal * 3];
+		for (int i = 0; i < nLocal; i++)
+		{
+			tet_in.pointlist[i * 3 + 0] = Points_[local[i]].x;
+			tet_in.pointlist[i * 3 + 1] = Points_[local[i]].y;
+			tet_in.pointlist[i * 3 + 2] = Points_[local[i]].z;
+		}
+		const std::string str("Q");
+		tetrahedralize(const_cast<char*>(str.c_str()), &tet_in, &tet_out);
+		std::vector< std::vector<int> > adjacency(nLocal);
+		for (long nTet = 0; nTet < tet_out.numberoftetrahedra; nTet++)
+		{
+			long tet_first = nTet * tet_out.numberofcorners;
+			for (long i = tet_first; i < tet_first + tet_out.numberofcorners; i++)
+				for (long j = i + 1; j < tet_first + tet_out.numberofcorners; j++)
+				{
+					adjacency[tet_out.tetrahedronlist[i]].push_back(tet_out.tetrahedronlist[j]);
+					adjacency[tet_out.tetrahedronlist[j]].push_back(tet_out.tetrahedronlist[i]);
+				}
+		}
+
+		//the shortest paths from the anchored points to the others
+		typedef std::pair<double, int> QueueEntry;
+		std::priority_queue<QueueEntry, std::vector<QueueEntry>, std::greater<QueueEntry> > queue;
+		std::vector<double> localDistance(nLocal, DBL_MAX);
+		for (int i = 0; i < nLocal; i++)
+		{
+			if (relaxed[local[i]])
+				continue;
+			localDistance[i] = distance[local[i]];
+			queue.push(QueueEntry(localDistance[i], i));
+		}
+		while (!queue.empty())
+		{
+			const QueueEntry top = queue.top();
+			queue.pop();
+			const int v = top.second;
+			if (top.first > localDistance[v])
+				continue;
+			for (std::size_t k = 0; k < adjacency[v].size(); k++)
+			{
+				const int u = adjacency[v][k];
+				if (!relaxed[local[u]])
+					continue;
+				const double d = localDistance[v] + weight(local[v], local[u]);
+				if (d < localDistance[u])
+				{
+					localDistance[u] = d;
+					parent[local[u]] = local[v];
+					queue.push(QueueEntry(d, u));
+				}
+			}
+		}
+		for (int i = 0; i < nLocal; i++)
+		{
+			if (relaxed[local[i]] && localDistance[i] == DBL_MAX)
+			{
+				if (!quiet_)
+					std::cout << "the changed points are not connected to the previous MST, the MST is recomputed" << std::endl;
+				return false;
+			}
+		}
+	}
+
+	//read the edges into the MST graph
+	for (int nP = 0; nP < nPoints; ++nP)
+	{
+		if (nP != parent[nP])
+		{
+			SGraphEdgeProp pEdge;
+			pEdge.nWeight = 0.0;
+			pEdge.nRadius = 0.0;
+			add_edge(vertex(nP, MST_), vertex(parent[nP], MST_), pEdge, MST_);
+		}
+		MST_[vertex(nP, MST_)].nParent = parent[nP];
+	}
+	if (!quiet_)
+		std::cout << "updated the MST: " << changed.size() << " of " << nPoints << " points changed, " << nLocal << " points triangulated" << std::endl;
+
+	compute_length_of_subtree(&MST_, RootV_);
+	return true;
+}
@@ -0,0 +1,307 @@
+/*
+*	Copyright (C) 2019 by
+*       Shenglan Du (dushenglan940128@163.com)
+*       Liangliang Nan (liangliang.nan@gmail.com)
+*       3D Geoinformation, TU Delft, https://3d.bk.tudelft.nl
+*
+*	This file is part of AdTree, which implements the 3D tree
+*   reconstruction method described in the following paper:
+*   -------------------------------------------------------------------------------------
+*       Shenglan Du, Roderik Lindenbergh, Hugo Ledoux, Jantien Stoter, and Liangliang Nan.
+*       AdTree: Accurate, Detailed, and Automatic Modeling of Laser-Scanned Trees.
+*       Remote Sensing. 2019, 11(18), 2074.
+*   -------------------------------------------------------------------------------------
+*   Please consider citing the above paper if you use the code/program (or part of it).
+*
+*	AdTree is free software; you can redistribute it and/or modify
+*	it under the terms of the GNU General Public License Version 3
+*	as published by the Free Software Foundation.
+*
+*	AdTree is distributed in the hope that it will be useful,
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*	GNU General Public License for more details.
+*
+*	You should have received a copy of the GNU General Public License
+*	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "skeleton.h"
+
+#include <easy3d/core/point_cloud.h>
+
+#include <iostream>
+#include <unordered_map>
+#include <queue>
+#include <functional>
+#include <tuple>
+#include <climits>
+#include <cstdint>
+#include <cfloat>
+#include <cmath>
+
+
+using namespace easy3d;
+
+
+namespace {
+
+	// the voxels are addressed by their integer coordinates, packed into a 64-bit key
+	const int kBits = 21;
+	const int kMaxCoordinate = (1 << kBits) - 1;
+
+	inline std::uint64_t voxel_key(int i, int j, int k) {
+		return (static_cast<std::uint64_t>(i) << (2 * kBits)) | (static_cast<std::uint64_t>(j) << kBits) | static_cast<std::uint64_t>(k);
+	}
+
+	struct Voxel {
+		int    i, j, k;
+		dvec3  sum;     // the sum of the points in the voxel
+		int    count;   // the number of points in the voxel
+		dvec3  centroid() const { return sum / count; }
+	};
+
+	// the voxel graph: a sparse hash grid with 26-connectivity
+	class VoxelGrid {
+	public:
+		VoxelGrid(const std::vector<Vector3D>& points, double cellSize) : cellSize_(cellSize), valid_(true) {
+			Vector3D pMin(FLT_MAX, FLT_MAX, FLT_MAX);
+			for (const auto& p : points) {
+				pMin.x = std::min(pMin.x, p.x);
+				pMin.y = std::min(pMin.y, p.y);
+				pMin.z = std::min(pMin.z, p.z);
+			}
+			origin_ = pMin;
+
+			index_.reserve(points.size() / 4);
+			for (const auto& p : points) {
+				int c[3];
+				if (!cell(p, c)) {
+					valid_ = false;
+					return;
+				}
+				auto pos = index_.insert(std::make_pair(voxel_key(c[0], c[1], c[2]), static_cast<int>(voxels_.size())));
+				if (pos.second) {
+					Voxel v = { c[0], c[1], c[2], dvec3(0, 0, 0), 0 };
+					voxels_.push_back(v);
+				}
+				Voxel& v = voxels_[pos.first->second];
+				v.sum += dvec3(p.x, p.y, p.z);
+				++v.count;
+			}
+		}
+
+		bool valid() const { return valid_; }
+		const std::vector<Voxel>& voxels() const { return voxels_; }
+
+		// the voxel containing p (-1 if it is empty)
+		int find(const Vector3D& p) const {
+			int c[3];
+			return cell(p, c) ? find(c[0], c[1], c[2]) : -1;
+		}
+
+		int find(int i, int j, int k) const {
+			if (i < 0 || j < 0 || k < 0 || i > kMaxCoordinate || j > kMaxCoordinate || k > kMaxCoordinate)
+				return -1;
+			auto pos = index_.find(voxel_key(i, j, k));
+			return pos == index_.end() ? -1 : pos->second;
+		}
+
+		// calls f(u) for each occupied voxel u with a Chebyshev distance in [1, radius] to voxel v
+		template <typename Function>
+		void for_each_neighbor(int v, int radius, Function f) const {
+			const Voxel& vox = voxels_[v];
+			for (int di = -radius; di <= radius; ++di) {
+				for (int dj = -radius; dj <= radius; ++dj) {
+					for (int dk = -radius; dk <= radius; ++dk) {
+						if (di == 0 && dj == 0 && dk == 0)
+							continue;
+						const int u = find(vox.i + di, vox.j + dj, vox.k + dk);
+						if (u >= 0)
+							f(u);
+					}
+				}
+			}
+		}
+
+	private:
+		bool cell(const Vector3D& p, int* c) const {
+			const double d[3] = { p.x - origin_.x, p.y - origin_.y, p.z - origin_.z };
+			for (int k = 0; k < 3; ++k) {
+				const double x = std::floor(d[k] / cellSize_);
+				if (x < 0 || x > kMaxCoordinate)
+					return false;
+				c[k] = static_cast<int>(x);
+			}
+			return true;
+		}
+
+		double cellSize_;
+		Vector3D origin_;
+		bool valid_;
+		std::vector<Voxel> voxels_;
+		std::unordered_map<std::uint64_t, int> index_;
+	};
+
+}
+
+
+bool Skeleton::build_voxel_skeleton(const PointCloud* cloud)
+{
+	MST_.clear();
+
+	//the points are still needed to fit the radii, and the statistics to find the root
+	load_points(cloud);
+	obtain_initial_radius(const_cast<PointCloud*>(cloud));
+
+	//without a given size, the voxels are as large as the average distance of a point to its 24th nearest neighbor
+	//(estimated from a sample of the points), such that they hold several points and the voxels of a sparse scan
+	//are still connected. They are at least 1% of the bounding distance.
+	double cellSize = voxel_size_;
+	if (cellSize <= 0) {
+		const unsigned int kNeighbors = 24;
+		const std::size_t nSamples = 1000;
+		const std::size_t stride = std::max<std::size_t>(Points_.size() / nSamples, 1);
+		KdTreeQuery query;
+		query.setNOfNeighbours(kNeighbors + 1);
+		double sum = 0.0;
+		std::size_t count = 0;
+		for (std::size_t i = 0; i < Points_.size(); i += stride) {
+			KDtree_->queryPosition(query, Points_[i]);
+			if (query.getNOfFoundNeighbours() == 0)
+				continue;
+			sum += std::sqrt(query.getSquaredDistance(query.getNOfFoundNeighbours() - 1));
+			++count;
+		}
+		cellSize = std::max(count > 0 ? sum / count : 0.0, 0.01 * BoundingDistance_);
+	}
+	if (!(cellSize > 0))
+		return false;
+	VoxelGrid grid(Points_, cellSize);
+	if (!grid.valid())
+		return false;
+	const std::vector<Voxel>& voxels = grid.voxels();
+	const int nVoxels = static_cast<int>(voxels.size());
+	if (!quiet_)
+		std::cout << "voxelized " << Points_.size() << " points into " << nVoxels << " voxels of size " << cellSize << std::endl;
+
+	const int rootVoxel = grid.find(RootPos_);
+	if (rootVoxel < 0)
+		return false;
+
+	//the geodesic distance of each voxel from the root voxel (Dijkstra's algorithm over the 26-neighborhood, with
+	//the distances between the centroids as weights). Small gaps (e.g., occlusions) are crossed by edges to the
+	//voxels within a Chebyshev distance of maxGap, which cost the number of empty voxels they cross. The paths
+	//cross as few empty voxels as possible first, and are the shortest among those, so a gap is only crossed if
+	//the voxels behind it are not connected otherwise. The voxels not reached are noise.
+	const int maxGap = 3;
+	std::vector<int> gaps(nVoxels, INT_MAX);
+	std::vector<double> distance(nVoxels, DBL_MAX);
+	std::vector<int> predecessor(nVoxels, -1);
+	std::vector<dvec3> centroids(nVoxels);
+	for (int v = 0; v < nVoxels; ++v)
+		centroids[v] = voxels[v].centroid();
+
+	typedef std::tuple<int, double, int> QueueEntry;	// the number of crossed voxels, the distance, the voxel
+	std::priority_queue<QueueEntry, std::vector<QueueEntry>, std::greater<QueueEntry> > queue;
+	gaps[rootVoxel] = 0;
+	distance[rootVoxel] = 0.0;
+	predecessor[rootVoxel] = rootVoxel;
+	queue.push(QueueEntry(0, 0.0, rootVoxel));
+	while (!queue.empty()) {
+		const QueueEntry top = queue.top();
+		queue.pop();
+		const int v = std::get<2>(top);
+		if (std::get<0>(top) > gaps[v] || (std::get<0>(top) == gaps[v] && std::get<1>(top) > distance[v]))
+			continue;
+		const Voxel& vox = voxels[v];
+		grid.for_each_neighbor(v, maxGap, [&](int u) {
+			const Voxel& vu = voxels[u];
+			const int radius = std::max(std::abs(vu.i - vox.i), std::max(std::abs(vu.j - vox.j), std::abs(vu.k - vox.k)));
+			const int g = gaps[v] + radius - 1;
+			const double d = distance[v] + std::sqrt(centroids[v].distance2(centroids[u]));
+			if (g < gaps[u] || (g == gaps[u] && d < distance[u])) {
+				gaps[u] = g;
+				distance[u] = d;
+				predecessor[u] = v;
+				queue.push(QueueEntry(g, d, u));
+			}
+		});
+	}
+
+	//the skeleton nodes are the connected components of the voxels in the same bin of geodesic distance
+	std::vector<int> component(nVoxels);
+	for (int v = 0; v < nVoxels; ++v)
+		component[v] = v;
+	auto find_root = [&component](int v) -> int {
+		while (component[v] != v)
+			v = component[v] = component[component[v]];
+		return v;
+	};
+	std::vector<int> bin(nVoxels, -1);
+	for (int v = 0; v < nVoxels; ++v) {
+		if (predecessor[v] >= 0)
+			bin[v] = static_cast<int>(distance[v] / cellSize);
+	}
+	for (int v = 0; v < nVoxels; ++v) {
+		if (bin[v] < 0)
+			continue;
+		grid.for_each_neighbor(v, 1, [&](int u) {
+			if (u < v && bin[u] == bin[v]) {
+				const int ru = find_root(u), rv = find_root(v);
+				if (ru != rv)
+					component[std::max(ru, rv)] = std::min(ru, rv);
+			}
+		});
+	}
+
+	//a vertex of the skeleton for each component (in the order of their first voxel), at the centroid of its points.
+	//Its parent is the component of the predecessor of its voxel closest to the root. Since the closest voxels of the
+	//components strictly decrease in distance towards the root, this is a tree.
+	std::vector<int> node(nVoxels, -1), closest;
+	std::vector<dvec3> sums;
+	std::vector<int> counts;
+	for (int v = 0; v < nVoxels; ++v) {
+		if (bin[v] < 0)
+			continue;
+		const int r = find_root(v);
+		if (node[r] < 0) {
+			node[r] = static_cast<int>(sums.size());
+			sums.push_back(dvec3(0, 0, 0));
+			counts.push_back(0);
+			closest.push_back(v);
+		}
+		const int n = node[r];
+		node[v] = n;
+		sums[n] += voxels[v].sum;
+		counts[n] += voxels[v].count;
+		if (distance[v] < distance[closest[n]])
+			closest[n] = v;
+	}
+
+	const std::size_t nNodes = sums.size();
+	for (std::size_t n = 0; n < nNodes; ++n) {
+		const dvec3 c = sums[n] / counts[n];
+		SGraphVertexProp pV;
+		pV.cVert = vec3(static_cast<float>(c.x), static_cast<float>(c.y), static_cast<float>(c.z));
+		pV.nParent = n;
+		pV.lengthOfSubtree = 0.0;
+		add_vertex(pV, MST_);
+	}
+	RootV_ = node[rootVoxel];
+	for (std::size_t n = 0; n < nNodes; ++n) {
+		if (static_cast<SGraphVertexDescriptor>(n) == RootV_)
+			continue;
+		const SGraphVertexDescriptor parent = node[predecessor[closest[n]]];
+		SGraphEdgeProp pEdge;
+		pEdge.nWeight = 0.0;
+		pEdge.nRadius = 0.0;
+		add_edge(vertex(n, MST_), vertex(parent, MST_), pEdge, MST_);
+		MST_[vertex(n, MST_)].nParent = parent;
+	}
+	if (!quiet_)
+		std::cout << "built a voxel skeleton of " << nNodes << " vertices" << std::endl;
+
+	compute_length_of_subtree(&MST_, RootV_);
+	return nNodes > 1;
+}
@@ -220,7 +220,7 @@ void TreeViewer::export_skeleton() const {
     }
 
 #if 0 // save the simplified skeleton, for which each edge can have a radius.
-    const ::Graph& skeleton = skeleton_->get_simplified_skeleton();
+    const ::Graph& skeleton = *skeleton_->get_simplified_skeleton();
     if (boost::num_edges(skeleton) == 0) {
         std::cerr << "skeleton has 0 edges" << std::endl;
         return;
@@ -255,7 +255,7 @@ void TreeViewer::export_skeleton() const {
         edgeRadius[e] = skeleton[*iter].nRadius;
     }
 #else // save the smoothed skeleton into a PLY file (where each vertex has a radius)
-    const ::Graph& skeleton = skeleton_->get_smoothed_skeleton();
+    const ::Graph& skeleton = *skeleton_->get_smoothed_skeleton();
         if (boost::num_edges(skeleton) == 0) {
         std::cerr << "skeleton has 0 edges" << std::endl;
         return;
@@ -416,16 +416,16 @@ bool TreeViewer::create_skeleton_drawable(SkeletonType type)
     const ::Graph* skeleton = nullptr;
     switch (type) {
     case ST_DELAUNAY:
-        skeleton = &(skeleton_->get_delaunay());
+        skeleton = skeleton_->get_delaunay();
         break;
     case ST_MST:
-        skeleton = &(skeleton_->get_mst());
+        skeleton = skeleton_->get_mst();
         break;
     case ST_SIMPLIFIED:
-        skeleton = &(skeleton_->get_simplified_skeleton());
+        skeleton = skeleton_->get_simplified_skeleton();
         break;
     case ST_SMOOTHED:
-        skeleton = &(skeleton_->get_smoothed_skeleton());
+        skeleton = skeleton_->get_smoothed_skeleton();
         break;
     }
     if (!skeleton)
@@ -489,10 +489,7 @@ bool TreeViewer::reconstruct_skeleton() {
         );
         if (answer == 1) {
             const float threshold = cloud()->bounding_box().diagonal() * 0.001f;
-            const auto &points_to_remove = RemoveDuplication::apply(cloud(), threshold);
-            for (auto v : points_to_remove)
-                cloud()->delete_vertex(v);
-            cloud()->garbage_collection();
+            RemoveDuplication::apply_grid(cloud(), threshold);
             cloud()->points_drawable("vertices")->update_vertex_buffer(cloud()->points());
             std::cout << cloud()->vertices_size() << " points remained" << std::endl;
         }